@@ -0,0 +1,149 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <omp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <faiss/IndexACORN.h>
+#include <faiss/impl/ACORNAttributes.h>
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/impl/IDSelector.h>
+#include <faiss/index_io.h>
+#include <faiss/utils/random.h>
+#include <faiss/utils/utils.h>
+
+/************************
+ * This benchmark measures the filtered search time of ACORN on random
+ * data, with one attribute value per vector and an equality filter per
+ * query. It is meant to be run under a profiler to compare the memory
+ * behavior of the graph traversal, eg.
+ *
+ *   perf stat -e cache-misses,LLC-load-misses ./bench_acorn_search 10000000
+ *
+ * Each setting is run with and without the software prefetches of the
+ * traversal (ACORN::use_prefetch). The throughput is measured on the
+ * batch of queries, the latency on queries searched one at a time.
+ *
+ * The index is stored in /tmp so that the (long) construction is done
+ * only once per database size.
+ *
+ * usage: bench_acorn_search [nb] [n_attr]
+ */
+
+int main(int argc, char** argv) {
+    using idx_t = faiss::idx_t;
+    int d = 64;
+    size_t nb = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000 * 1000;
+    int n_attr = argc > 2 ? atoi(argv[2]) : 12;
+    size_t nq = 10000;
+    int k = 10;
+    int M = 32, gamma = n_attr, M_beta = 64;
+
+    std::vector<float> xq(nq * d);
+    faiss::rand_smooth_vectors(nq, d, xq.data(), 4567);
+
+    std::vector<int> metadata(nb);
+    for (size_t i = 0; i < nb; i++) {
+        metadata[i] = i % n_attr;
+    }
+
+    std::unique_ptr<faiss::IndexACORNFlat> index;
+    std::string stored_name = "/tmp/bench_acorn_search_" + std::to_string(nb) +
+            "_" + std::to_string(n_attr) + ".faissindex";
+
+    if (access(stored_name.c_str(), F_OK) != 0) {
+        printf("creating index, nb=%zd\n", nb);
+        std::vector<float> xb(nb * d);
+        faiss::rand_smooth_vectors(nb, d, xb.data(), 1234);
+
+        index.reset(new faiss::IndexACORNFlat(d, M, gamma, metadata, M_beta));
+        double t0 = faiss::getmillisecs();
+        index->add(nb, xb.data());
+        double t1 = faiss::getmillisecs();
+        printf("add time: %.3f s\n", (t1 - t0) / 1000);
+        index->acorn.attributes.add_int_column("attr", nb, metadata.data());
+        printf("Write %s\n", stored_name.c_str());
+        faiss::write_index(index.get(), stored_name.c_str());
+    } else {
+        printf("Read %s\n", stored_name.c_str());
+        index.reset(dynamic_cast<faiss::IndexACORNFlat*>(
+                faiss::read_index(stored_name.c_str())));
+        FAISS_THROW_IF_NOT(index);
+    }
+
+    // the filters are predicates on an attribute column, so that their
+    // size does not depend on nb
+    faiss::ACORNAttributes& attributes = index->acorn.attributes;
+    if (attributes.column_no("attr") < 0) {
+        attributes.add_int_column("attr", nb, metadata.data());
+    }
+    const faiss::ACORNAttributeColumn* col = &attributes.column("attr");
+    std::vector<faiss::IDSelectorAttributeEqual> sels;
+    std::vector<const faiss::IDSelector*> filters(nq);
+    sels.reserve(nq);
+    for (size_t q = 0; q < nq; q++) {
+        sels.emplace_back(col, q % n_attr);
+        filters[q] = &sels[q];
+    }
+
+    std::vector<float> D(nq * k);
+    std::vector<idx_t> I(nq * k);
+
+    // nb of queries searched one at a time for the latency
+    size_t nq_lat = std::min(nq, size_t(1000));
+    std::vector<double> latencies(nq_lat);
+
+    for (int efs : {16, 64, 256}) {
+        index->acorn.efSearch = efs;
+        for (bool use_prefetch : {false, true}) {
+            index->acorn.use_prefetch = use_prefetch;
+            faiss::acorn_stats.reset();
+            double t0 = faiss::getmillisecs();
+            index->search(
+                    nq, xq.data(), k, D.data(), I.data(), filters.data());
+            double t1 = faiss::getmillisecs();
+
+            for (size_t q = 0; q < nq_lat; q++) {
+                double t2 = faiss::getmillisecs();
+                index->search(
+                        1,
+                        xq.data() + q * d,
+                        k,
+                        D.data(),
+                        I.data(),
+                        filters.data() + q);
+                latencies[q] = faiss::getmillisecs() - t2;
+            }
+            std::sort(latencies.begin(), latencies.end());
+            double sum = 0;
+            for (double l : latencies) {
+                sum += l;
+            }
+
+            printf("efSearch=%d prefetch=%d nt=%d: %.3f ms, %.1f QPS, "
+                   "ndis/query=%.1f, latency mean=%.3f ms p50=%.3f ms "
+                   "p99=%.3f ms\n",
+                   efs,
+                   int(use_prefetch),
+                   omp_get_max_threads(),
+                   t1 - t0,
+                   nq * 1000.0 / (t1 - t0),
+                   faiss::acorn_stats.n3 / double(nq),
+                   sum / nq_lat,
+                   latencies[nq_lat / 2],
+                   latencies[nq_lat * 99 / 100]);
+        }
+    }
+
+    return 0;
+}
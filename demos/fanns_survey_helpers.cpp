@@ -9,6 +9,8 @@
 #include <chrono>
 #include <unistd.h>
 
+#include <faiss/impl/ACORNAttributes.h>
+
 #include "global_thread_counter.h"
 
 
@@ -241,3 +243,44 @@ void monitor_thread_count(std::atomic<bool>& done_flag) {
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 }
+
+// Store the database attributes of a filter type as columns of an ACORN index.
+// Columns that are already present (e.g. loaded with the index) are kept as is.
+// EM: column "em", R: column "r", EMIS: set column "emis", EM_R: columns "em" and "r"
+void add_database_attributes(faiss::ACORNAttributes& attributes, const std::string& path, const std::string& filter_type) {
+    if (filter_type == "EM" || filter_type == "R") {
+        std::string name = filter_type == "EM" ? "em" : "r";
+        if (attributes.column_no(name) < 0) {
+            std::vector<int> values = read_one_int_per_line(path);
+            attributes.add_int_column(name, values.size(), values.data());
+        }
+    } else if (filter_type == "EMIS") {
+        if (attributes.column_no("emis") < 0) {
+            std::vector<std::vector<int>> sets = read_multiple_ints_per_line(path);
+            std::vector<size_t> lims(sets.size() + 1, 0);
+            std::vector<int> values;
+            for (size_t i = 0; i < sets.size(); i++) {
+                values.insert(values.end(), sets[i].begin(), sets[i].end());
+                lims[i + 1] = values.size();
+            }
+            attributes.add_int_set_column("emis", sets.size(), lims.data(), values.data());
+        }
+    } else if (filter_type == "EM_R") {
+        if (attributes.column_no("em") < 0 || attributes.column_no("r") < 0) {
+            std::vector<std::pair<int, int>> pairs = read_em_r_database_attributes(path);
+            std::vector<int> em_values(pairs.size()), r_values(pairs.size());
+            for (size_t i = 0; i < pairs.size(); i++) {
+                em_values[i] = pairs[i].first;
+                r_values[i] = pairs[i].second;
+            }
+            if (attributes.column_no("em") < 0) {
+                attributes.add_int_column("em", em_values.size(), em_values.data());
+            }
+            if (attributes.column_no("r") < 0) {
+                attributes.add_int_column("r", r_values.size(), r_values.data());
+            }
+        }
+    } else {
+        throw std::runtime_error("Unknown filter type: " + filter_type);
+    }
+}
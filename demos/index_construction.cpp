@@ -9,6 +9,7 @@
 #include <faiss/IndexFlat.h>
 #include <faiss/IndexHNSW.h>
 #include <faiss/IndexACORN.h>
+#include <faiss/impl/vecs_io.h>
 #include <faiss/index_io.h>
 
 #include <sys/stat.h>
@@ -66,8 +67,8 @@ int main(int argc, char *argv[]) {
     int M_beta; 		
 
 	// Parse arguments
-	if (argc != 6) {
-		fprintf(stderr, "Usage: %s <path_database_vectors> <path_index> <M> <gamma> <M_beta>\n", argv[0]);
+	if (argc < 6 || argc > 9 || argc == 7) {
+		fprintf(stderr, "Usage: %s <path_database_vectors> <path_index> <M> <gamma> <M_beta> [<path_database_attributes> <filter_type> [<batch_size>]]\n", argv[0]);
 		exit(1);
 	}
 
@@ -77,35 +78,57 @@ int main(int argc, char *argv[]) {
 	M = atoi(argv[3]);
 	gamma = atoi(argv[4]);
 	M_beta = atoi(argv[5]);
+	// Number of vectors read from the file and added per batch, so that only one batch of raw vectors is in RAM
+	size_t batch_size = argc == 9 ? strtoull(argv[8], nullptr, 10) : 1000000;
+	if (batch_size == 0) {
+		fprintf(stderr, "Invalid batch size: %s\n", argv[8]);
+		exit(1);
+	}
 
-	// Read vectors from file
-	size_t n_items, d;
-	// fvecs_read is from utils.cpp and returns a float*, read_fvecs is from fanns_survey_helpers.cpp and returns a vector<vector<float>>
-	float* database_vectors = fvecs_read(path_database_vectors.c_str(), &d, &n_items);
+	// Open the .fvecs / .bvecs file, the vectors are read by batches while adding them
+	faiss::VecsReader reader(path_database_vectors.c_str());
+	size_t n_items = reader.n, d = reader.d;
 
 	// According to the following GitHub issue, the metadata does not influence the performance of ACORN:
 	// https://github.com/TAG-Research/ACORN/issues/2
 	// Therefore, we leave the metadata empty
 	std::vector<int> metadata(n_items,0);
 
-    // Initialize the ACORN index
+    // Initialize the ACORN index, allocated for all vectors upfront so that the arrays are not reallocated between batches
     faiss::IndexACORNFlat acorn_index(d, M, gamma, metadata, M_beta);
-
-	// Add vectors to index: This is the part that is timed for the index construction time
-	auto start_time = std::chrono::high_resolution_clock::now();	
-	acorn_index.add(n_items, database_vectors);
-	auto end_time = std::chrono::high_resolution_clock::now();
+	acorn_index.reserve(n_items);
+
+	// Add vectors to index: The adds are timed for the index construction time, the reads are timed separately
+	std::vector<float> batch(std::min(batch_size, n_items) * d);
+	double add_duration = 0, read_duration = 0;
+	size_t nr;
+	auto read_start = std::chrono::high_resolution_clock::now();
+	while ((nr = reader.read(batch_size, batch.data())) > 0) {
+		auto start_time = std::chrono::high_resolution_clock::now();
+		read_duration += std::chrono::duration<double>(start_time - read_start).count();
+		acorn_index.add(nr, batch.data());
+		auto end_time = std::chrono::high_resolution_clock::now();
+		add_duration += std::chrono::duration<double>(end_time - start_time).count();
+		printf("Added %zu / %zu vectors, %.0f vectors/s\n", reader.i0, n_items, reader.i0 / add_duration);
+		fflush(stdout);
+		read_start = std::chrono::high_resolution_clock::now();
+	}
 	// Stop thread monitoring
     done = true;
     monitor.join();
 
 	// Print statistics
-	std::chrono::duration<double> time_diff = end_time - start_time;
-	double duration = time_diff.count();
 	printf("Maximum number of threads: %d\n", peak_threads.load()-1);	// Subtract 1 because of the monitoring thread
-	printf("Index construction time: %.3f s\n", duration);
+	printf("Index construction time: %.3f s\n", add_duration);
+	printf("Vector reading time: %.3f s\n", read_duration);
 	peak_memory_footprint();
-	delete[] database_vectors;
+	std::vector<float>().swap(batch);
+
+	// Optionally store the database attributes in the index file, so that queries need no attribute file
+	if (argc >= 8) {
+		add_database_attributes(acorn_index.acorn.attributes, argv[6], argv[7]);
+		assert(acorn_index.acorn.attributes.size() == n_items && "Number of database attributes and vectors do not match");
+	}
 
 	// Write index to file
 	write_index(&acorn_index, path_index.c_str());
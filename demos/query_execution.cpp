@@ -9,6 +9,8 @@
 #include <faiss/IndexFlat.h>
 #include <faiss/IndexHNSW.h>
 #include <faiss/IndexACORN.h>
+#include <faiss/impl/ACORNAttributes.h>
+#include <faiss/impl/IDSelector.h>
 #include <faiss/index_io.h>
 
 #include <sys/stat.h>
@@ -40,6 +42,7 @@
 #include "utils.cpp"
 
 #include <atomic>
+#include <memory>
 #include <omp.h>
 #include "fanns_survey_helpers.cpp"
 #include "global_thread_counter.h"
@@ -51,7 +54,7 @@ std::atomic<int> peak_threads(1);
 
 // Execute the queries, compute and report the recall
 int main(int argc, char *argv[]) {
-	// Restrict number of threads to 1 for query execution
+	// Restrict number of threads to 1 for query execution (the optional intra-query threads explore the graph of a single query)
 	omp_set_num_threads(1);
 
 	// Monitor thread count
@@ -70,7 +73,7 @@ int main(int argc, char *argv[]) {
 
 	// Check if the number of arguments is correct
 	if (argc < 9) {
-		fprintf(stderr, "Usage: %s <path_database_attributes> <path_query_vectors> <path_query_attributes> <path_groundtruth> <path_index> <filter_type> <k> <efs>\n", argv[0]);
+		fprintf(stderr, "Usage: %s <path_database_attributes> <path_query_vectors> <path_query_attributes> <path_groundtruth> <path_index> <filter_type> <k> <efs> [<intra_query_threads>]\n", argv[0]);
 		exit(1);	
 	}
 
@@ -83,6 +86,7 @@ int main(int argc, char *argv[]) {
 	filter_type = argv[6];
 	k = atoi(argv[7]);
 	efs = atoi(argv[8]);
+	int intra_query_threads = argc > 9 ? atoi(argv[9]) : 1;
 
 	// Read query vectors
     size_t n_queries, d;
@@ -106,61 +110,56 @@ int main(int argc, char *argv[]) {
 
 	// Set search parameter and prepare data structure for results
 	acorn_index.acorn.efSearch = efs;
+	acorn_index.intra_query_threads = intra_query_threads;
     std::vector<faiss::idx_t> nearest_neighbors(k * n_queries);
 	std::vector<float> distances(k * n_queries);
 
 	std::chrono::time_point<std::chrono::high_resolution_clock> start_time;
-	// Compute bitmap for filtering
-	std::vector<char> filter_bitmap;
+	// The database attributes are stored as columns of the index, and each query gets a predicate over them.
+	// Predicates are only evaluated on the nodes visited by the search, so there is no per-query filter to build.
+	faiss::ACORNAttributes& attributes = acorn_index.acorn.attributes;
+	std::vector<std::unique_ptr<faiss::IDSelector>> predicates;
+	std::vector<const faiss::IDSelector*> filters(n_queries);
+	// Database attributes that are not stored in the index yet are read from path_database_attributes
+	if (filter_type == "EM" || filter_type == "R" || filter_type == "EMIS" || filter_type == "EM_R") {
+		add_database_attributes(attributes, path_database_attributes, filter_type);
+	}
 	// EM
 	if (filter_type == "EM"){
-		// Read database attributes
-		vector<int> database_attributes = read_one_int_per_line(path_database_attributes);
-		size_t n_items = database_attributes.size();
 		// Read query attributes
 		vector<int> query_attributes = read_one_int_per_line(path_query_attributes);
 		assert(n_queries == query_attributes.size() && "Number of queries in query vectors and query attributes do not match");
-		// Compute filter bitmap (timed)
-		filter_bitmap.resize(n_queries * n_items);
+		// Start the searches from an entry point with the query's attribute value when there is one (not timed, done once per index)
+		acorn_index.acorn.set_attribute_entry_points(attributes.column("em"));
+		// Compute filter predicates (timed)
 		start_time = std::chrono::high_resolution_clock::now();
 		for (size_t q = 0; q < n_queries; q++) {
-			for (size_t i = 0; i < n_items; i++) {
-				filter_bitmap[q * n_items + i] = (database_attributes[i] == query_attributes[q]);
-			}
+			predicates.emplace_back(new faiss::IDSelectorAttributeEqual(&attributes.column("em"), query_attributes[q]));
+			filters[q] = predicates.back().get();
 		}
 	}
 	// R
 	else if (filter_type == "R"){
-		// Read database attributes
-		vector<int> database_attributes = read_one_int_per_line(path_database_attributes);
-		size_t n_items = database_attributes.size();
 		// Read query attributes
 		vector<pair<int,int>> query_attributes = read_two_ints_per_line(path_query_attributes);
 		assert(n_queries == query_attributes.size() && "Number of queries in query vectors and query attributes do not match");
-		// Compute filter bitmap (timed)
-		filter_bitmap.resize(n_queries * n_items);
+		// Compute filter predicates (timed)
 		start_time = std::chrono::high_resolution_clock::now();
 		for (size_t q = 0; q < n_queries; q++) {
-			for (size_t i = 0; i < n_items; i++) {
-				filter_bitmap[q * n_items + i] = (database_attributes[i] >= query_attributes[q].first && database_attributes[i] <= query_attributes[q].second);
-			}
+			predicates.emplace_back(new faiss::IDSelectorAttributeRange(&attributes.column("r"), query_attributes[q].first, query_attributes[q].second));
+			filters[q] = predicates.back().get();
 		}
 	}
 	// EMIS
 	else if (filter_type == "EMIS"){
-		// Read database attributes
-		vector<vector<int>> database_attributes = read_multiple_ints_per_line(path_database_attributes);
-		size_t n_items = database_attributes.size();
 		// Read query attributes
 		vector<int> query_attributes = read_one_int_per_line(path_query_attributes);
 		assert(n_queries == query_attributes.size() && "Number of queries in query vectors and query attributes do not match");
-		// Compute filter bitmap
-		filter_bitmap.resize(n_queries * n_items);
+		// Compute filter predicates (timed)
 		start_time = std::chrono::high_resolution_clock::now();
 		for (size_t q = 0; q < n_queries; q++) {
-			for (size_t i = 0; i < n_items; i++) {
-				filter_bitmap[q * n_items + i] = (find(database_attributes[i].begin(), database_attributes[i].end(), query_attributes[q]) != database_attributes[i].end());
-			}
+			predicates.emplace_back(new faiss::IDSelectorAttributeEqual(&attributes.column("emis"), query_attributes[q]));
+			filters[q] = predicates.back().get();
 		}
 	}
 	// EM_R: Combined Exact Match + Range filter
@@ -168,37 +167,28 @@ int main(int argc, char *argv[]) {
 	// Query format: <em_value>,<r_start>-<r_end> per line
 	// A database item matches if: db_em == query_em AND r_start <= db_r <= r_end
 	else if (filter_type == "EM_R"){
-		// Read database attributes (pair of em, r values)
-		vector<pair<int, int>> database_attributes = read_em_r_database_attributes(path_database_attributes);
-		size_t n_items = database_attributes.size();
 		// Read query attributes (em value, r_start, r_end)
 		vector<EMRQueryAttribute> query_attributes = read_em_r_query_attributes(path_query_attributes);
 		assert(n_queries == query_attributes.size() && "Number of queries in query vectors and query attributes do not match");
-		// Compute filter bitmap (timed)
-		filter_bitmap.resize(n_queries * n_items);
+		// Compute filter predicates (timed): both conditions must be true
 		start_time = std::chrono::high_resolution_clock::now();
 		for (size_t q = 0; q < n_queries; q++) {
-			int q_em = query_attributes[q].em_value;
-			int q_r_start = query_attributes[q].r_start;
-			int q_r_end = query_attributes[q].r_end;
-			for (size_t i = 0; i < n_items; i++) {
-				int db_em = database_attributes[i].first;
-				int db_r = database_attributes[i].second;
-				// Both conditions must be true: exact match on EM AND range match on R
-				bool em_match = (db_em == q_em);
-				bool r_match = (db_r >= q_r_start && db_r <= q_r_end);
-				filter_bitmap[q * n_items + i] = (em_match && r_match);
-			}
+			faiss::IDSelector* em_match = new faiss::IDSelectorAttributeEqual(&attributes.column("em"), query_attributes[q].em_value);
+			faiss::IDSelector* r_match = new faiss::IDSelectorAttributeRange(&attributes.column("r"), query_attributes[q].r_start, query_attributes[q].r_end);
+			predicates.emplace_back(em_match);
+			predicates.emplace_back(r_match);
+			predicates.emplace_back(new faiss::IDSelectorAnd(em_match, r_match));
+			filters[q] = predicates.back().get();
 		}
 	} else {
 		fprintf(stderr, "Unknown filter type: %s\n", filter_type.c_str());
 	}
-	// Timing after filter bitmap computation but before query execution
+	// Timing after filter computation but before query execution
 	std::chrono::time_point<std::chrono::high_resolution_clock> mid_time = std::chrono::high_resolution_clock::now();
 
 	// Execute queries on ACORN index
 	// TODO: How does ACORN behave if there are less than k matching items?
-	acorn_index.search(n_queries, query_vectors, k, distances.data(), nearest_neighbors.data(), filter_bitmap.data());
+	acorn_index.search(n_queries, query_vectors, k, distances.data(), nearest_neighbors.data(), filters.data());
 	auto end_time = std::chrono::high_resolution_clock::now();
 
     // Stop thread count monitoring
@@ -17,6 +17,8 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
+#include <memory>
 #include <queue>
 #include <unordered_set>
 
@@ -26,14 +28,22 @@
 
 #include <faiss/Index2Layer.h>
 #include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
 #include <faiss/IndexIVFPQ.h>
+#include <faiss/impl/ACORNDistanceComputers.h>
 #include <faiss/impl/AuxIndexStructures.h>
 #include <faiss/impl/FaissAssert.h>
+#include <faiss/impl/IDSelector.h>
 #include <faiss/utils/Heap.h>
 #include <faiss/utils/distances.h>
+#include <faiss/utils/hamming.h>
 #include <faiss/utils/random.h>
 #include <faiss/utils/sorting.h>
 
+#ifndef _WIN32
+#include <faiss/IndexFlatOnDisk.h>
+#endif
+
 // # added
 #include <sys/time.h>
 #include <stdio.h>
@@ -96,6 +106,27 @@ struct NegativeDistanceComputer : DistanceComputer {
         return -(*basedis)(i);
     }
 
+    void distances_batch_4(
+            const idx_t idx0,
+            const idx_t idx1,
+            const idx_t idx2,
+            const idx_t idx3,
+            float& dis0,
+            float& dis1,
+            float& dis2,
+            float& dis3) override {
+        basedis->distances_batch_4(
+                idx0, idx1, idx2, idx3, dis0, dis1, dis2, dis3);
+        dis0 = -dis0;
+        dis1 = -dis1;
+        dis2 = -dis2;
+        dis3 = -dis3;
+    }
+
+    void prefetch(idx_t i) override {
+        basedis->prefetch(i);
+    }
+
     /// compute distance between two stored vectors
     float symmetric_dis(idx_t i, idx_t j) override {
         return -basedis->symmetric_dis(i, j);
@@ -107,6 +138,9 @@ struct NegativeDistanceComputer : DistanceComputer {
 };
 
 DistanceComputer* storage_distance_computer(const Index* storage) {
+    if (DistanceComputer* dc = acorn_specialized_distance_computer(storage)) {
+        return dc;
+    }
     if (storage->metric_type == METRIC_INNER_PRODUCT) {
         return new NegativeDistanceComputer(storage->get_distance_computer());
     } else {
@@ -144,8 +178,10 @@ void acorn_add_vertices(
         printf("  max_level = %d\n", max_level);
     }
 
-    std::vector<omp_lock_t> locks(ntotal);
-    for (int i = 0; i < ntotal; i++)
+    // striped locks: vertex i is protected by locks[i % nlocks]
+    size_t nlocks = std::min(ntotal, size_t(1) << 16);
+    std::vector<omp_lock_t> locks(nlocks);
+    for (size_t i = 0; i < nlocks; i++)
         omp_init_lock(&locks[i]);
 
     // add vectors from highest to lowest level
@@ -180,6 +216,16 @@ void acorn_add_vertices(
     idx_t check_period = InterruptCallback::get_period_hint(
             max_level * index_acorn.d * acorn.efConstruction);
 
+    // per-thread scratch, reused for all the levels
+    int nt = omp_get_max_threads();
+    std::vector<std::unique_ptr<VisitedTable>> vts(nt);
+    std::vector<std::unique_ptr<DistanceComputer>> dcs(nt);
+    std::vector<ACORNBuildScratch> scratches(nt);
+    for (int rank = 0; rank < nt; rank++) {
+        vts[rank].reset(new VisitedTable(ntotal));
+        dcs[rank].reset(storage_distance_computer(index_acorn.storage));
+    }
+
     { // perform add
         RandomGenerator rng2(789);
 
@@ -198,13 +244,24 @@ void acorn_add_vertices(
 
             bool interrupt = false;
 
-#pragma omp parallel if (i1 > i0 + 100)
-            {
-                VisitedTable vt(ntotal);
+            int i_start = i0;
+            if (acorn.entry_point == -1) {
+                // the first vertex becomes the entry point. It is added
+                // alone so that add_with_locks does not need a critical
+                // section for it
+                storage_idx_t pt_id = order[i0];
+                dcs[0]->set_query(x + (pt_id - n0) * d);
+                acorn.add_with_locks(
+                        *dcs[0], pt_level, pt_id, locks, *vts[0], &scratches[0]);
+                i_start++;
+            }
 
-                DistanceComputer* dis =
-                        storage_distance_computer(index_acorn.storage);
-                ScopeDeleter1<DistanceComputer> del(dis);
+#pragma omp parallel if (i1 > i_start + 100)
+            {
+                int rank = omp_get_thread_num();
+                VisitedTable& vt = *vts[rank];
+                DistanceComputer* dis = dcs[rank].get();
+                ACORNBuildScratch& scratch = scratches[rank];
                 int prev_display =
                         verbose && omp_get_thread_num() == 0 ? 0 : -1;
                 size_t counter = 0;
@@ -213,7 +270,7 @@ void acorn_add_vertices(
                 // some versions of LLVM. The performance impact should not be
                 // too large when (i1 - i0) / num_threads >> 1
 #pragma omp for schedule(static)
-                for (int i = i0; i < i1; i++) {
+                for (int i = i_start; i < i1; i++) {
                     storage_idx_t pt_id = order[i];
                     dis->set_query(x + (pt_id - n0) * d);
 
@@ -222,7 +279,8 @@ void acorn_add_vertices(
                         continue;
                     }
 
-                    acorn.add_with_locks(*dis, pt_level, pt_id, locks, vt);
+                    acorn.add_with_locks(
+                            *dis, pt_level, pt_id, locks, vt, &scratch);
 
                     if (prev_display >= 0 && i - i0 > prev_display + 10000) {
                         prev_display = i - i0;
@@ -248,7 +306,7 @@ void acorn_add_vertices(
         printf("Done in %.3f ms\n", getmillisecs() - t0);
     }
 
-    for (int i = 0; i < ntotal; i++) {
+    for (size_t i = 0; i < nlocks; i++) {
         omp_destroy_lock(&locks[i]);
     }
 }
@@ -256,6 +314,65 @@ void acorn_add_vertices(
 
 } // namespace
 
+/**************************************************************
+ * VisitedTablePool
+ **************************************************************/
+
+VisitedTablePool::VisitedTablePool() : max_size(omp_get_max_threads()) {}
+
+void VisitedTablePool::get(idx_t ntotal, std::unique_ptr<VisitedTable>& vt) {
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (!tables.empty()) {
+            vt = std::move(tables.back());
+            tables.pop_back();
+        }
+    }
+    if (!vt) {
+        vt.reset(new VisitedTable(ntotal));
+    } else if (vt->visited.size() < size_t(ntotal)) {
+        // the new entries are 0, ie. not visited
+        vt->visited.resize(ntotal);
+    }
+}
+
+void VisitedTablePool::get(
+        idx_t,
+        std::unique_ptr<ACORNVisitedHashSet>& vt) {
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (!hashsets.empty()) {
+            vt = std::move(hashsets.back());
+            hashsets.pop_back();
+        }
+    }
+    if (!vt) {
+        vt.reset(new ACORNVisitedHashSet());
+    }
+}
+
+void VisitedTablePool::put(std::unique_ptr<VisitedTable> vt) {
+    vt->advance();
+    std::lock_guard<std::mutex> guard(mutex);
+    if (tables.size() < max_size) {
+        tables.push_back(std::move(vt));
+    }
+}
+
+void VisitedTablePool::put(std::unique_ptr<ACORNVisitedHashSet> vt) {
+    vt->advance();
+    std::lock_guard<std::mutex> guard(mutex);
+    if (hashsets.size() < max_size) {
+        hashsets.push_back(std::move(vt));
+    }
+}
+
+void VisitedTablePool::clear() {
+    std::lock_guard<std::mutex> guard(mutex);
+    tables.clear();
+    hashsets.clear();
+}
+
 /**************************************************************
  * IndexACORN implementation
  **************************************************************/
@@ -274,10 +391,16 @@ IndexACORN::IndexACORN(Index* storage, int M, int gamma, std::vector<int>& metad
           storage(storage)
           /* reconstruct_from_neighbors(nullptr) */ {}
 
+IndexACORN::IndexACORN()
+        : Index(0, METRIC_L2), own_fields(false), storage(nullptr) {}
+
 IndexACORN::~IndexACORN() {
     if (own_fields) {
         delete storage;
     }
+    if (own_refine_index) {
+        delete refine_index;
+    }
 }
 
 void IndexACORN::train(idx_t n, const float* x) {
@@ -286,22 +409,119 @@ void IndexACORN::train(idx_t n, const float* x) {
             "Please use IndexACORNFlat (or variants) instead of IndexACORN directly");
     // acorn structure does not require training
     storage->train(n, x);
+    if (refine_index) {
+        refine_index->train(n, x);
+    }
     is_trained = true;
 }
 
-// overloaded search for hybrid search 
-void IndexACORN::search(
-            idx_t n,
-            const float* x,
-            idx_t k,
-            float* distances,
-            idx_t* labels,
-            char* filter_id_map,
-            const SearchParameters* params_in) const {
+namespace {
+
+/// selector on the ids of a reordered index from a selector on its labels
+struct IDSelectorLabels : IDSelector {
+    const IDSelector* sel;
+    const idx_t* id_map;
+
+    IDSelectorLabels(const IDSelector* sel, const idx_t* id_map)
+            : sel(sel), id_map(id_map) {}
+
+    bool is_member(idx_t id) const final {
+        return sel->is_member(id_map[id]);
+    }
+};
+
+/* selector on the ids of index from a selector given by the user. They
+ * differ only for reordered indexes: the selectors on ids then apply to
+ * the labels, the attribute predicates are evaluated directly. The
+ * selectors that are created are stored in owned. */
+const IDSelector* internal_selector(
+        const IndexACORN& index,
+        const IDSelector* sel,
+        std::vector<std::unique_ptr<IDSelector>>& owned) {
+    if (index.id_map.empty() || !sel ||
+        dynamic_cast<const IDSelectorAttributeEqual*>(sel) ||
+        dynamic_cast<const IDSelectorAttributeRange*>(sel) ||
+        dynamic_cast<const IDSelectorAll*>(sel)) {
+        return sel;
+    }
+    if (auto sel_not = dynamic_cast<const IDSelectorNot*>(sel)) {
+        owned.emplace_back(new IDSelectorNot(
+                internal_selector(index, sel_not->sel, owned)));
+    } else if (auto sel_and = dynamic_cast<const IDSelectorAnd*>(sel)) {
+        const IDSelector* lhs = internal_selector(index, sel_and->lhs, owned);
+        const IDSelector* rhs = internal_selector(index, sel_and->rhs, owned);
+        owned.emplace_back(new IDSelectorAnd(lhs, rhs));
+    } else {
+        owned.emplace_back(new IDSelectorLabels(sel, index.id_map.data()));
+    }
+    return owned.back().get();
+}
+
+/// filtered search whose results are checked by complete_search once it
+/// has run
+template <class VT>
+struct PendingCompletion {
+    const IDSelector* sel;
+    DistanceComputer* dis;
+    idx_t* idxi;
+    float* simi;
+    VT* vt;
+};
+
+/// how search_one runs the hybrid search of a query
+template <class VT>
+struct SearchContext {
+    /// distance computers of the threads that explore the graph for the
+    /// query (IndexACORN::intra_query_threads > 1), null otherwise
+    const std::vector<DistanceComputer*>* query_dis = nullptr;
+
+    /// if not null (IndexACORN::interleave_queries > 1), the hybrid
+    /// search is added to this group instead of being run
+    ACORNInterleavedSearch* interleaved = nullptr;
+
+    /// selectors used by the searches, kept until they are run
+    std::vector<std::unique_ptr<IDSelector>> owned;
+
+    /// searches to complete (IndexACORN::complete_results)
+    std::vector<PendingCompletion<VT>> to_complete;
+
+    /// buffers of the searches of the thread
+    ACORNSearchScratch scratch;
+};
+
+template <class VT>
+ACORNStats complete_search(
+        const IndexACORN& index,
+        const IDSelector& sel,
+        DistanceComputer& dis,
+        idx_t k,
+        idx_t* idxi,
+        float* simi,
+        VT& vt,
+        ACORNSearchScratch& scratch,
+        const SearchParametersACORN* params);
+
+/* Run searches for a batch of queries. search_one performs the search for
+ * query i and is the only part that depends on how the filters are
+ * represented. In interleaved mode, each thread takes the queries by
+ * groups of IndexACORN::interleave_queries, with one distance computer and
+ * one visited set per query of the group. VT is the type of the visited
+ * sets. */
+template <class VT, class SearchOne>
+void acorn_search_batch_impl(
+        const IndexACORN& index,
+        idx_t n,
+        const float* x,
+        idx_t k,
+        float* distances,
+        idx_t* labels,
+        const SearchParameters* params_in,
+        const SearchOne& search_one) {
     FAISS_THROW_IF_NOT(k > 0);
     FAISS_THROW_IF_NOT_MSG(
-            storage,
+            index.storage,
             "Please use IndexACORNFlat (or variants) instead of IndexACORN directly");
+    const ACORN& acorn = index.acorn;
     const SearchParametersACORN* params = nullptr;
 
     int efSearch = acorn.efSearch;
@@ -311,149 +531,1300 @@ void IndexACORN::search(
         efSearch = params->efSearch;
     }
     size_t n1 = 0, n2 = 0, n3 = 0, ndis = 0, nreorder = 0;
-    double candidates_loop = 0, neighbors_loop = 0, tuple_unwrap = 0, skips = 0, visits = 0; //added for profiling
+    double candidates_loop = 0, neighbors_loop = 0, tuple_unwrap = 0,
+           skips = 0, visits = 0; // added for profiling
+    size_t n_brute_force = 0, n_post_filter = 0;
+    size_t n_fallback_beam = 0, n_fallback_scan = 0, n3_fallback = 0;
 
-    idx_t check_period =
-            InterruptCallback::get_period_hint(acorn.max_level * d * efSearch);
+    idx_t check_period = InterruptCallback::get_period_hint(
+            acorn.max_level * index.d * efSearch);
+
+    // the queries are searched one after the other, each by a team of
+    // threads
+    bool intra_query = index.intra_query_threads > 1;
+
+    // nb of queries whose hybrid searches are interleaved on a thread
+    int interleave = intra_query ? 1 : std::max(index.interleave_queries, 1);
 
     for (idx_t i0 = 0; i0 < n; i0 += check_period) {
         idx_t i1 = std::min(i0 + check_period, n);
 
-#pragma omp parallel
+#pragma omp parallel if (!intra_query)
         {
-            VisitedTable vt(ntotal);
-
-            DistanceComputer* dis = storage_distance_computer(storage);
-            ScopeDeleter1<DistanceComputer> del(dis);
-
-#pragma omp for reduction(+ : n1, n2, n3, ndis, nreorder, candidates_loop)
-            for (idx_t i = i0; i < i1; i++) {
-                idx_t* idxi = labels + i * k;
-                float* simi = distances + i * k;
-                char* filters = filter_id_map + i * ntotal;
-                dis->set_query(x + i * d);
-
-                maxheap_heapify(k, simi, idxi);
-                ACORNStats stats = acorn.hybrid_search(*dis, k, idxi, simi, vt, filters, params); //TODO edit to hybrid search
-
-                // ACORNStats stats = acorn.hybrid_search(*dis, k, idxi, simi, vt, filters[i], op, regex, params); //TODO edit to hybrid search
-                n1 += stats.n1;
-                n2 += stats.n2;
-                n3 += stats.n3;
-                ndis += stats.ndis;
-                nreorder += stats.nreorder;
-                // printf("index -- stats updates: %f\n", stats.candidates_loop);
-                // printf("index -- stats updates: %f\n", stats.neighbors_loop);
-                //added for profiling
-                candidates_loop += stats.candidates_loop; 
-                neighbors_loop += stats.neighbors_loop;
-                tuple_unwrap += stats.tuple_unwrap;
-                skips += stats.skips;
-                visits += stats.visits;
-                maxheap_reorder(k, simi, idxi);
-                
+            std::vector<std::unique_ptr<VT>> vts(interleave);
+            std::vector<std::unique_ptr<DistanceComputer>> dcs;
+            for (int g = 0; g < interleave; g++) {
+                index.visited_pool->get(index.ntotal, vts[g]);
+                dcs.emplace_back(storage_distance_computer(index.storage));
+            }
+
+            // distance computers of the threads that search one query
+            std::vector<std::unique_ptr<DistanceComputer>> helper_dis;
+            std::vector<DistanceComputer*> query_dis;
+            if (intra_query) {
+                query_dis.push_back(dcs[0].get());
+                for (int t = 1; t < index.intra_query_threads; t++) {
+                    helper_dis.emplace_back(
+                            storage_distance_computer(index.storage));
+                    query_dis.push_back(helper_dis.back().get());
+                }
+            }
+
+            ACORNInterleavedSearch interleaved(acorn);
+            SearchContext<VT> ctx;
+            if (intra_query) {
+                ctx.query_dis = &query_dis;
+            }
+            if (interleave > 1) {
+                ctx.interleaved = &interleaved;
+            }
+
+#pragma omp for reduction(+ : n1, n2, n3, ndis, nreorder, candidates_loop, neighbors_loop, tuple_unwrap, skips, visits, n_brute_force, n_post_filter, n_fallback_beam, n_fallback_scan, n3_fallback)
+            for (idx_t ib = i0; ib < i1; ib += interleave) {
+                idx_t ie = std::min(ib + interleave, i1);
+                auto accumulate = [&](const ACORNStats& stats) {
+                    n1 += stats.n1;
+                    n2 += stats.n2;
+                    n3 += stats.n3;
+                    ndis += stats.ndis;
+                    nreorder += stats.nreorder;
+                    // added for profiling
+                    candidates_loop += stats.candidates_loop;
+                    neighbors_loop += stats.neighbors_loop;
+                    tuple_unwrap += stats.tuple_unwrap;
+                    skips += stats.skips;
+                    visits += stats.visits;
+                    n_brute_force += stats.n_brute_force;
+                    n_post_filter += stats.n_post_filter;
+                    n_fallback_beam += stats.n_fallback_beam;
+                    n_fallback_scan += stats.n_fallback_scan;
+                    n3_fallback += stats.n3_fallback;
+                };
+                for (idx_t i = ib; i < ie; i++) {
+                    idx_t* idxi = labels + i * k;
+                    float* simi = distances + i * k;
+                    DistanceComputer& dis = *dcs[i - ib];
+                    for (DistanceComputer* qd : query_dis) {
+                        qd->set_query(x + i * index.d);
+                    }
+                    dis.set_query(x + i * index.d);
+
+                    maxheap_heapify(k, simi, idxi);
+                    accumulate(search_one(
+                            i, dis, k, idxi, simi, *vts[i - ib], params, ctx));
+                }
+                if (ctx.interleaved) {
+                    accumulate(interleaved.run());
+                }
+                for (const PendingCompletion<VT>& p : ctx.to_complete) {
+                    accumulate(complete_search(
+                            index,
+                            *p.sel,
+                            *p.dis,
+                            k,
+                            p.idxi,
+                            p.simi,
+                            *p.vt,
+                            ctx.scratch,
+                            params));
+                }
+                ctx.to_complete.clear();
+                ctx.owned.clear();
+                for (idx_t i = ib; i < ie; i++) {
+                    maxheap_reorder(k, distances + i * k, labels + i * k);
+                }
+            }
+            for (std::unique_ptr<VT>& vt : vts) {
+                index.visited_pool->put(std::move(vt));
             }
         }
         InterruptCallback::check();
     }
 
-    if (metric_type == METRIC_INNER_PRODUCT) {
+    if (index.metric_type == METRIC_INNER_PRODUCT) {
         // we need to revert the negated distances
         for (size_t i = 0; i < k * n; i++) {
             distances[i] = -distances[i];
         }
     }
 
-    acorn_stats.combine({n1, n2, n3, ndis, nreorder, candidates_loop, neighbors_loop, tuple_unwrap, skips, visits}); //added for profiling
+    ACORNStats stats(n1, n2, n3, ndis, nreorder, candidates_loop, neighbors_loop, tuple_unwrap, skips, visits); // added for profiling
+    stats.n_brute_force = n_brute_force;
+    stats.n_post_filter = n_post_filter;
+    stats.n_fallback_beam = n_fallback_beam;
+    stats.n_fallback_scan = n_fallback_scan;
+    stats.n3_fallback = n3_fallback;
+    acorn_stats.combine(stats);
 }
 
-// TODO figure out what do with this
-void IndexACORN::search(
+/** exact distances between the query x and the vectors ids[0..n-1], with
+ * the refine_index of index. When the exact vectors are on disk, they are
+ * read with one batch of reads per query instead of one read per vector. */
+void refine_distances(
+        const IndexACORN& index,
+        DistanceComputer& dc,
+        const float* x,
+        idx_t n,
+        const idx_t* ids,
+        float* dis) {
+#ifndef _WIN32
+    if (auto ondisk =
+                dynamic_cast<const IndexFlatOnDisk*>(index.refine_index)) {
+        ondisk->compute_distances(x, n, ids, dis);
+        return;
+    }
+#endif
+    dc.set_query(x);
+    for (idx_t j = 0; j < n; j++) {
+        dis[j] = dc(ids[j]);
+    }
+}
+
+/// keep the k best of the k_base results of each query, with the exact
+/// distances of index.refine_index
+template <class C>
+void refine_results(
+        const IndexACORN& index,
+        idx_t n,
+        const float* x,
+        idx_t k_base,
+        const idx_t* base_labels,
+        float* base_distances,
+        idx_t k,
+        float* distances,
+        idx_t* labels) {
+#pragma omp parallel if (n > 1)
+    {
+        std::unique_ptr<DistanceComputer> dc(
+                index.refine_index->get_distance_computer());
+#pragma omp for
+        for (idx_t i = 0; i < n; i++) {
+            const idx_t* idxi = base_labels + i * k_base;
+            float* disi = base_distances + i * k_base;
+            idx_t nvalid = 0;
+            while (nvalid < k_base && idxi[nvalid] >= 0) {
+                nvalid++;
+            }
+            refine_distances(index, *dc, x + i * index.d, nvalid, idxi, disi);
+            idx_t* idxo = labels + i * k;
+            float* diso = distances + i * k;
+            heap_heapify<C>(k, diso, idxo, disi, idxi, k);
+            heap_addn<C>(k, diso, idxo, disi + k, idxi + k, k_base - k);
+            heap_reorder<C>(k, diso, idxo);
+        }
+    }
+}
+
+/// acorn_search_batch_impl with the visited sets selected by
+/// IndexACORN::visited_set_type
+template <class SearchOne>
+void acorn_search_batch_base(
+        const IndexACORN& index,
         idx_t n,
         const float* x,
         idx_t k,
         float* distances,
         idx_t* labels,
-        const SearchParameters* params_in) const {
-    FAISS_THROW_IF_NOT(k > 0);
-    FAISS_THROW_IF_NOT_MSG(
-            storage,
-            "Please use IndexACORNFlat (or variants) instead of IndexACORN directly");
-    const SearchParametersACORN* params = nullptr;
+        const SearchParameters* params_in,
+        const SearchOne& search_one) {
+    bool use_hashset = index.visited_set_type == 1;
+    if (index.visited_set_type < 0 && index.intra_query_threads <= 1) {
+        // the threads of an intra-query search share the visited set, the
+        // hash set needs a critical section where the table is atomic
+        auto params = dynamic_cast<const SearchParametersACORN*>(params_in);
+        int efSearch = params ? params->efSearch : index.acorn.efSearch;
+        size_t nvisit = size_t(std::max(efSearch, int(k))) *
+                index.acorn.nb_neighbors(0);
+        use_hashset = nvisit * 64 < size_t(index.ntotal);
+    }
+    if (use_hashset) {
+        acorn_search_batch_impl<ACORNVisitedHashSet>(
+                index, n, x, k, distances, labels, params_in, search_one);
+    } else {
+        acorn_search_batch_impl<VisitedTable>(
+                index, n, x, k, distances, labels, params_in, search_one);
+    }
+}
 
-    int efSearch = acorn.efSearch;
-    if (params_in) {
-        params = dynamic_cast<const SearchParametersACORN*>(params_in);
+/// search on the graph followed by the re-ranking with index.refine_index
+template <class SearchOne>
+void acorn_search_batch_refine(
+        const IndexACORN& index,
+        idx_t n,
+        const float* x,
+        idx_t k,
+        float* distances,
+        idx_t* labels,
+        const SearchParameters* params_in,
+        const SearchOne& search_one) {
+    idx_t k_base = std::max(k, idx_t(k * index.k_factor));
+    std::vector<idx_t> base_labels(n * k_base);
+    std::vector<float> base_distances(n * k_base);
+    acorn_search_batch_base(
+            index,
+            n,
+            x,
+            k_base,
+            base_distances.data(),
+            base_labels.data(),
+            params_in,
+            search_one);
+    if (index.metric_type == METRIC_L2) {
+        refine_results<CMax<float, idx_t>>(
+                index, n, x, k_base, base_labels.data(),
+                base_distances.data(), k, distances, labels);
+    } else {
+        refine_results<CMin<float, idx_t>>(
+                index, n, x, k_base, base_labels.data(),
+                base_distances.data(), k, distances, labels);
+    }
+}
+
+/// search on the graph, followed by the re-ranking if there is a
+/// refine_index
+template <class SearchOne>
+void acorn_search_batch(
+        const IndexACORN& index,
+        idx_t n,
+        const float* x,
+        idx_t k,
+        float* distances,
+        idx_t* labels,
+        const SearchParameters* params_in,
+        const SearchOne& search_one) {
+    std::vector<std::unique_ptr<IDSelector>> owned;
+    SearchParametersACORN params_internal;
+    if (!index.id_map.empty() && params_in && params_in->sel) {
+        auto params = dynamic_cast<const SearchParametersACORN*>(params_in);
         FAISS_THROW_IF_NOT_MSG(params, "params type invalid");
-        efSearch = params->efSearch;
+        params_internal = *params;
+        // the selector is only read
+        params_internal.sel = const_cast<IDSelector*>(
+                internal_selector(index, params->sel, owned));
+        params_in = &params_internal;
     }
-    size_t n1 = 0, n2 = 0, n3 = 0, ndis = 0, nreorder = 0;
-    
-    idx_t check_period =
-            InterruptCallback::get_period_hint(acorn.max_level * d * efSearch);
+    if (!index.refine_index) {
+        acorn_search_batch_base(
+                index, n, x, k, distances, labels, params_in, search_one);
+    } else {
+        acorn_search_batch_refine(
+                index, n, x, k, distances, labels, params_in, search_one);
+    }
+    if (!index.id_map.empty()) {
+        for (idx_t i = 0; i < n * k; i++) {
+            if (labels[i] >= 0) {
+                labels[i] = index.id_map[labels[i]];
+            }
+        }
+    }
+}
 
-    for (idx_t i0 = 0; i0 < n; i0 += check_period) {
-        idx_t i1 = std::min(i0 + check_period, n);
+/// unfiltered search
+struct PlainSearchOne {
+    const ACORN& acorn;
 
-#pragma omp parallel
-        {
-            VisitedTable vt(ntotal);
-
-            DistanceComputer* dis = storage_distance_computer(storage);
-            ScopeDeleter1<DistanceComputer> del(dis);
-
-#pragma omp for reduction(+ : n1, n2, n3, ndis, nreorder)
-            for (idx_t i = i0; i < i1; i++) {
-                idx_t* idxi = labels + i * k;
-                float* simi = distances + i * k;
-                dis->set_query(x + i * d);
-
-                maxheap_heapify(k, simi, idxi);
-                ACORNStats stats = acorn.search(*dis, k, idxi, simi, vt, params);
-                n1 += stats.n1;
-                n2 += stats.n2;
-                n3 += stats.n3;
-                ndis += stats.ndis;
-                nreorder += stats.nreorder;
-                maxheap_reorder(k, simi, idxi);
-
-                
+    template <class VT>
+    ACORNStats operator()(
+            idx_t,
+            DistanceComputer& dis,
+            idx_t k,
+            idx_t* idxi,
+            float* simi,
+            VT& vt,
+            const SearchParametersACORN* params,
+            SearchContext<VT>& ctx) const {
+        return acorn.search(dis, k, idxi, simi, vt, params, &ctx.scratch);
+    }
+};
+
+/// IDSelector view of one query of a byte map
+struct IDSelectorCharMap : IDSelector {
+    const char* map;
+
+    explicit IDSelectorCharMap(const char* map) : map(map) {}
+
+    bool is_member(idx_t id) const final {
+        return map[id] != 0;
+    }
+};
+
+/// can the ids accepted by sel be listed without testing all the ids
+bool is_enumerable(const IndexACORN& index, const IDSelector& sel) {
+    if (dynamic_cast<const IDSelectorRange*>(&sel) ||
+        dynamic_cast<const IDSelectorSortedArray*>(&sel) ||
+        dynamic_cast<const IDSelectorBitmap*>(&sel) ||
+        dynamic_cast<const IDSelectorCharMap*>(&sel) ||
+        dynamic_cast<const IDSelectorAttributeEqual*>(&sel) ||
+        dynamic_cast<const IDSelectorAttributeRange*>(&sel)) {
+        return true;
+    }
+    if (auto sel_and = dynamic_cast<const IDSelectorAnd*>(&sel)) {
+        return is_enumerable(index, *sel_and->lhs) ||
+                is_enumerable(index, *sel_and->rhs);
+    }
+    if (auto sel_labels = dynamic_cast<const IDSelectorLabels*>(&sel)) {
+        return is_enumerable(index, *sel_labels->sel);
+    }
+    return false;
+}
+
+/// append the ids in [0, ntotal) accepted by sel, which is enumerable
+void enumerate_ids(
+        const IndexACORN& index,
+        const IDSelector& sel,
+        std::vector<idx_t>& ids) {
+    idx_t ntotal = index.ntotal;
+    if (auto sel_range = dynamic_cast<const IDSelectorRange*>(&sel)) {
+        idx_t imax = std::min(sel_range->imax, ntotal);
+        for (idx_t id = std::max(sel_range->imin, idx_t(0)); id < imax; id++) {
+            ids.push_back(id);
+        }
+    } else if (
+            auto sel_sorted =
+                    dynamic_cast<const IDSelectorSortedArray*>(&sel)) {
+        for (size_t j = 0; j < sel_sorted->n; j++) {
+            idx_t id = sel_sorted->ids[j];
+            if (id >= 0 && id < ntotal &&
+                (j == 0 || id != sel_sorted->ids[j - 1])) {
+                ids.push_back(id);
             }
         }
-        InterruptCallback::check();
+    } else if (auto sel_bitmap = dynamic_cast<const IDSelectorBitmap*>(&sel)) {
+        size_t nbyte = std::min(sel_bitmap->n, size_t(ntotal + 7) / 8);
+        for (size_t j = 0; j < nbyte; j++) {
+            for (uint8_t b = sel_bitmap->bitmap[j]; b; b &= b - 1) {
+                idx_t id = j * 8 + __builtin_ctz(b);
+                if (id < ntotal) {
+                    ids.push_back(id);
+                }
+            }
+        }
+    } else if (auto sel_map = dynamic_cast<const IDSelectorCharMap*>(&sel)) {
+        // the byte map has ntotal entries anyway
+        for (idx_t id = 0; id < ntotal; id++) {
+            if (sel_map->map[id]) {
+                ids.push_back(id);
+            }
+        }
+    } else if (
+            auto sel_eq =
+                    dynamic_cast<const IDSelectorAttributeEqual*>(&sel)) {
+        sel_eq->column->ids_in_range(sel_eq->value, sel_eq->value, ids);
+    } else if (
+            auto sel_attr_range =
+                    dynamic_cast<const IDSelectorAttributeRange*>(&sel)) {
+        sel_attr_range->column->ids_in_range(
+                sel_attr_range->vmin, sel_attr_range->vmax, ids);
+    } else if (auto sel_and = dynamic_cast<const IDSelectorAnd*>(&sel)) {
+        // list one side, test the other
+        bool left = is_enumerable(index, *sel_and->lhs);
+        const IDSelector* listed = left ? sel_and->lhs : sel_and->rhs;
+        const IDSelector* tested = left ? sel_and->rhs : sel_and->lhs;
+        size_t n0 = ids.size();
+        enumerate_ids(index, *listed, ids);
+        size_t j = n0;
+        for (size_t i = n0; i < ids.size(); i++) {
+            if (tested->is_member(ids[i])) {
+                ids[j++] = ids[i];
+            }
+        }
+        ids.resize(j);
+    } else if (
+            auto sel_labels = dynamic_cast<const IDSelectorLabels*>(&sel)) {
+        size_t n0 = ids.size();
+        enumerate_ids(index, *sel_labels->sel, ids);
+        for (size_t i = n0; i < ids.size(); i++) {
+            ids[i] = index.rev_map[ids[i]];
+        }
+    } else {
+        FAISS_THROW_MSG("selector not enumerable");
     }
+}
 
-    if (metric_type == METRIC_INNER_PRODUCT) {
-        // we need to revert the negated distances
-        for (size_t i = 0; i < k * n; i++) {
-            distances[i] = -distances[i];
+/// the vectors of index accepted by sel and not removed. The ids are
+/// listed directly for the enumerable selectors, the other selectors are
+/// tested on all the ids
+void selected_ids(
+        const IndexACORN& index,
+        const IDSelector& sel,
+        std::vector<idx_t>& ids) {
+    const ACORN& acorn = index.acorn;
+    if (is_enumerable(index, sel)) {
+        enumerate_ids(index, sel, ids);
+        if (acorn.ndeleted > 0) {
+            size_t j = 0;
+            for (size_t i = 0; i < ids.size(); i++) {
+                if (!acorn.is_deleted(ids[i])) {
+                    ids[j++] = ids[i];
+                }
+            }
+            ids.resize(j);
+        }
+        return;
+    }
+    for (idx_t id = 0; id < index.ntotal; id++) {
+        if (!acorn.is_deleted(id) && sel.is_member(id)) {
+            ids.push_back(id);
+        }
+    }
+}
+
+/// exact search among the vectors accepted by sel
+ACORNStats brute_force_search(
+        const IndexACORN& index,
+        const IDSelector& sel,
+        DistanceComputer& dis,
+        idx_t k,
+        idx_t* idxi,
+        float* simi) {
+    std::vector<idx_t> ids;
+    selected_ids(index, sel, ids);
+
+    size_t n = ids.size();
+    auto push = [&](idx_t id, float d) {
+        if (d < simi[0]) {
+            maxheap_replace_top(k, simi, idxi, d, id);
+        }
+    };
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        float d0, d1, d2, d3;
+        dis.distances_batch_4(
+                ids[j], ids[j + 1], ids[j + 2], ids[j + 3], d0, d1, d2, d3);
+        push(ids[j], d0);
+        push(ids[j + 1], d1);
+        push(ids[j + 2], d2);
+        push(ids[j + 3], d3);
+    }
+    for (; j < n; j++) {
+        push(ids[j], dis(ids[j]));
+    }
+
+    ACORNStats stats;
+    stats.n3 = stats.ndis = n;
+    stats.n_brute_force = 1;
+    return stats;
+}
+
+/// nb of results in the heap of a search
+idx_t count_results(idx_t k, const idx_t* idxi) {
+    idx_t nres = 0;
+    for (idx_t j = 0; j < k; j++) {
+        nres += idxi[j] >= 0;
+    }
+    return nres;
+}
+
+/* fill the results of a filtered search that found fewer than k of them
+ * (IndexACORN::complete_results). The heap is searched again from
+ * scratch: first with a wider beam if sel matches many vectors (the graph
+ * search stopped early), then with an exact scan of the matching vectors
+ * (they are not reachable in the filtered graph). sel includes the
+ * selector of the params, if any. */
+template <class VT>
+ACORNStats complete_search(
+        const IndexACORN& index,
+        const IDSelector& sel,
+        DistanceComputer& dis,
+        idx_t k,
+        idx_t* idxi,
+        float* simi,
+        VT& vt,
+        ACORNSearchScratch& scratch,
+        const SearchParametersACORN* params) {
+    ACORNStats stats;
+    if (count_results(k, idxi) >= k) {
+        return stats;
+    }
+    int efSearch = params ? params->efSearch : index.acorn.efSearch;
+    int ef = std::max(efSearch, int(k));
+    float nmatch = index.estimate_selectivity(sel) * index.ntotal;
+    if (nmatch > 4 * ef) {
+        SearchParametersACORN wide_params;
+        if (params) {
+            wide_params = *params;
+        }
+        wide_params.efSearch = 4 * ef;
+        maxheap_heapify(k, simi, idxi);
+        stats = index.acorn.hybrid_search(
+                dis, k, idxi, simi, vt, &sel, &wide_params, &scratch);
+        stats.n_fallback_beam = 1;
+        if (count_results(k, idxi) >= k) {
+            stats.n3_fallback = stats.n3;
+            return stats;
+        }
+    }
+    maxheap_heapify(k, simi, idxi);
+    ACORNStats scan_stats = brute_force_search(index, sel, dis, k, idxi, simi);
+    stats.n3 += scan_stats.n3;
+    stats.ndis += scan_stats.ndis;
+    stats.n_fallback_scan = 1;
+    stats.n3_fallback = stats.n3;
+    return stats;
+}
+
+/** route a filtered query according to the estimated selectivity of its
+ * filter if IndexACORN::query_planner is set. hybrid_search runs the
+ * ACORN search. sel must live until the searches of ctx are completed. */
+template <class VT, class HybridSearch>
+ACORNStats plan_search(
+        const IndexACORN& index,
+        const IDSelector& sel,
+        DistanceComputer& dis,
+        idx_t k,
+        idx_t* idxi,
+        float* simi,
+        VT& vt,
+        const SearchParametersACORN* params,
+        SearchContext<VT>& ctx,
+        const HybridSearch& hybrid_search) {
+    // the selector of the params (already on the ids of the index) is
+    // honored by the hybrid search, the other routes and the completion
+    // use the conjunction
+    const IDSelector* qsel = &sel;
+    if ((index.query_planner || index.complete_results) && params &&
+        params->sel) {
+        ctx.owned.emplace_back(new IDSelectorAnd(&sel, params->sel));
+        qsel = ctx.owned.back().get();
+    }
+    float selectivity = 1;
+    if (index.query_planner) {
+        selectivity = index.estimate_selectivity(*qsel);
+        if (selectivity < index.brute_force_selectivity &&
+            is_enumerable(index, *qsel)) {
+            return brute_force_search(index, *qsel, dis, k, idxi, simi);
+        }
+    }
+    if (index.complete_results) {
+        PendingCompletion<VT> pending = {qsel, &dis, idxi, simi, &vt};
+        ctx.to_complete.push_back(pending);
+    }
+    if (index.query_planner && selectivity > index.post_filter_selectivity) {
+        SearchParametersACORN post_params;
+        if (params) {
+            post_params.check_relative_distance =
+                    params->check_relative_distance;
+        }
+        int efSearch = params ? params->efSearch : index.acorn.efSearch;
+        post_params.efSearch = int(efSearch / selectivity) + 1;
+        // the selector is only read
+        post_params.sel = const_cast<IDSelector*>(qsel);
+        ACORNStats stats =
+                index.acorn.search(
+                        dis, k, idxi, simi, vt, &post_params, &ctx.scratch);
+        stats.n_post_filter = 1;
+        return stats;
+    }
+    return hybrid_search();
+}
+
+/// hybrid search of one query, run as set by ctx
+template <class FilterArg, class VT>
+ACORNStats hybrid_search_one(
+        const IndexACORN& index,
+        FilterArg filter,
+        DistanceComputer& dis,
+        idx_t k,
+        idx_t* idxi,
+        float* simi,
+        VT& vt,
+        const SearchParametersACORN* params,
+        SearchContext<VT>& ctx) {
+    const ACORN& acorn = index.acorn;
+    if (ctx.query_dis) {
+        return acorn.hybrid_search_parallel(
+                *ctx.query_dis, k, idxi, simi, vt, filter, params);
+    }
+    if (ctx.interleaved) {
+        // the stats are returned by ACORNInterleavedSearch::run
+        ctx.interleaved->add(dis, k, idxi, simi, vt, filter, params);
+        return ACORNStats();
+    }
+    return acorn.hybrid_search(
+            dis, k, idxi, simi, vt, filter, params, &ctx.scratch);
+}
+
+/// filtered search of one query with a selector on the ids of the index
+template <class VT>
+ACORNStats selector_search(
+        const IndexACORN& index,
+        const IDSelector* sel,
+        DistanceComputer& dis,
+        idx_t k,
+        idx_t* idxi,
+        float* simi,
+        VT& vt,
+        const SearchParametersACORN* params,
+        SearchContext<VT>& ctx) {
+    return plan_search(
+            index, *sel, dis, k, idxi, simi, vt, params, ctx, [&]() {
+                return hybrid_search_one(
+                        index, sel, dis, k, idxi, simi, vt, params, ctx);
+            });
+}
+
+/// per-query filter given as a slice of an n * ntotal byte map
+struct CharMapSearchOne {
+    const IndexACORN& index;
+    char* filter_id_map;
+
+    template <class VT>
+    ACORNStats operator()(
+            idx_t i,
+            DistanceComputer& dis,
+            idx_t k,
+            idx_t* idxi,
+            float* simi,
+            VT& vt,
+            const SearchParametersACORN* params,
+            SearchContext<VT>& ctx) const {
+        char* map = filter_id_map + i * index.ntotal;
+        if (!index.id_map.empty()) {
+            // the map is indexed by label
+            IDSelector* sel = new IDSelectorCharMap(map);
+            ctx.owned.emplace_back(sel);
+            ctx.owned.emplace_back(
+                    new IDSelectorLabels(sel, index.id_map.data()));
+            return selector_search(
+                    index,
+                    ctx.owned.back().get(),
+                    dis,
+                    k,
+                    idxi,
+                    simi,
+                    vt,
+                    params,
+                    ctx);
+        }
+        IDSelector* sel = new IDSelectorCharMap(map);
+        ctx.owned.emplace_back(sel);
+        return plan_search(
+                index, *sel, dis, k, idxi, simi, vt, params, ctx, [&]() {
+                    return hybrid_search_one(
+                            index, map, dis, k, idxi, simi, vt, params, ctx);
+                });
+    }
+};
+
+/// one IDSelector per query
+struct SelectorSearchOne {
+    const IndexACORN& index;
+    const IDSelector* const* filters;
+
+    template <class VT>
+    ACORNStats operator()(
+            idx_t i,
+            DistanceComputer& dis,
+            idx_t k,
+            idx_t* idxi,
+            float* simi,
+            VT& vt,
+            const SearchParametersACORN* params,
+            SearchContext<VT>& ctx) const {
+        const IDSelector* sel =
+                internal_selector(index, filters[i], ctx.owned);
+        return selector_search(
+                index, sel, dis, k, idxi, simi, vt, params, ctx);
+    }
+};
+
+/* Range search of a batch. The selector of query i is filters[i] (if
+ * filters is not null) and params->sel. With the query planner, the
+ * queries whose selector is enumerable and below brute_force_selectivity
+ * are scanned exhaustively, the others are searched on the graph. With a refine_index, the results found with the
+ * storage distances are checked again with the exact distances. */
+void acorn_range_search(
+        const IndexACORN& index,
+        idx_t n,
+        const float* x,
+        float radius,
+        RangeSearchResult* result,
+        const IDSelector* const* filters,
+        const SearchParameters* params_in) {
+    FAISS_THROW_IF_NOT_MSG(
+            index.storage,
+            "Please use IndexACORNFlat (or variants) instead of IndexACORN directly");
+    const ACORN& acorn = index.acorn;
+    const SearchParametersACORN* params = nullptr;
+    SearchParametersACORN params_nosel;
+    const IDSelector* params_sel = nullptr;
+    if (params_in) {
+        auto params_acorn =
+                dynamic_cast<const SearchParametersACORN*>(params_in);
+        FAISS_THROW_IF_NOT_MSG(params_acorn, "params type invalid");
+        // the selector of the params is combined with the filters
+        params_nosel = *params_acorn;
+        params_nosel.sel = nullptr;
+        params_sel = params_acorn->sel;
+        params = &params_nosel;
+    }
+
+    // smaller is closer in the graph
+    bool is_ip = index.metric_type == METRIC_INNER_PRODUCT;
+    float graph_radius = is_ip ? -radius : radius;
+    bool use_hashset = index.visited_set_type == 1;
+
+    size_t n1 = 0, n2 = 0, n3 = 0, ndis = 0, n_brute_force = 0;
+
+#pragma omp parallel reduction(+ : n1, n2, n3, ndis, n_brute_force)
+    {
+        RangeSearchPartialResult pres(result);
+        std::unique_ptr<DistanceComputer> dis(
+                storage_distance_computer(index.storage));
+        std::unique_ptr<DistanceComputer> refine_dis(
+                index.refine_index ? index.refine_index->get_distance_computer()
+                                   : nullptr);
+        std::unique_ptr<VisitedTable> vt;
+        std::unique_ptr<ACORNVisitedHashSet> vt_sparse;
+        if (use_hashset) {
+            index.visited_pool->get(index.ntotal, vt_sparse);
+        } else {
+            index.visited_pool->get(index.ntotal, vt);
+        }
+        std::vector<std::unique_ptr<IDSelector>> owned;
+        std::vector<float> D;
+        std::vector<idx_t> I, ids;
+        ACORNSearchScratch scratch;
+
+#pragma omp for
+        for (idx_t i = 0; i < n; i++) {
+            const float* xi = x + i * index.d;
+            const IDSelector* sel = filters
+                    ? internal_selector(index, filters[i], owned)
+                    : nullptr;
+            if (params_sel) {
+                const IDSelector* psel =
+                        internal_selector(index, params_sel, owned);
+                if (sel) {
+                    owned.emplace_back(new IDSelectorAnd(sel, psel));
+                    psel = owned.back().get();
+                }
+                sel = psel;
+            }
+
+            dis->set_query(xi);
+            D.clear();
+            I.clear();
+            ACORNStats stats;
+            if (sel && index.query_planner && is_enumerable(index, *sel) &&
+                index.estimate_selectivity(*sel) <
+                        index.brute_force_selectivity) {
+                ids.clear();
+                selected_ids(index, *sel, ids);
+                for (idx_t id : ids) {
+                    float d = (*dis)(id);
+                    if (d < graph_radius) {
+                        D.push_back(d);
+                        I.push_back(id);
+                    }
+                }
+                stats.n3 = stats.ndis = ids.size();
+                stats.n_brute_force = 1;
+            } else if (vt_sparse) {
+                stats = acorn.range_search(
+                        *dis,
+                        graph_radius,
+                        D,
+                        I,
+                        *vt_sparse,
+                        sel,
+                        params,
+                        &scratch);
+            } else {
+                stats = acorn.range_search(
+                        *dis, graph_radius, D, I, *vt, sel, params, &scratch);
+            }
+            owned.clear();
+
+            RangeQueryResult& qres = pres.new_result(i);
+            if (refine_dis) {
+                refine_distances(
+                        index, *refine_dis, xi, I.size(), I.data(), D.data());
+            }
+            for (size_t j = 0; j < I.size(); j++) {
+                float d = is_ip && !refine_dis ? -D[j] : D[j];
+                if (refine_dis) {
+                    if (is_ip ? d <= radius : d >= radius) {
+                        continue;
+                    }
+                }
+                qres.add(d, index.id_map.empty() ? I[j] : index.id_map[I[j]]);
+            }
+
+            n1 += stats.n1;
+            n2 += stats.n2;
+            n3 += stats.n3;
+            ndis += stats.ndis;
+            n_brute_force += stats.n_brute_force;
+        }
+        pres.finalize();
+        if (vt_sparse) {
+            index.visited_pool->put(std::move(vt_sparse));
+        } else {
+            index.visited_pool->put(std::move(vt));
         }
     }
 
-    acorn_stats.combine({n1, n2, n3, ndis, nreorder});
+    ACORNStats stats(n1, n2, n3, ndis);
+    stats.n_brute_force = n_brute_force;
+    acorn_stats.combine(stats);
+}
+
+} // namespace
+
+// overloaded search for hybrid search
+void IndexACORN::search(
+        idx_t n,
+        const float* x,
+        idx_t k,
+        float* distances,
+        idx_t* labels,
+        char* filter_id_map,
+        const SearchParameters* params_in) const {
+    CharMapSearchOne search_one = {*this, filter_id_map};
+    acorn_search_batch(
+            *this, n, x, k, distances, labels, params_in, search_one);
+}
+
+void IndexACORN::search(
+        idx_t n,
+        const float* x,
+        idx_t k,
+        float* distances,
+        idx_t* labels,
+        const IDSelector* const* filters,
+        const SearchParameters* params_in) const {
+    FAISS_THROW_IF_NOT(filters);
+    FAISS_THROW_IF_NOT_MSG(
+            acorn.attributes.columns.empty() ||
+                    acorn.attributes.size() == size_t(ntotal),
+            "attribute columns do not cover all the vectors of the index");
+    SelectorSearchOne search_one = {*this, filters};
+    acorn_search_batch(
+            *this, n, x, k, distances, labels, params_in, search_one);
+}
+
+void IndexACORN::range_search(
+        idx_t n,
+        const float* x,
+        float radius,
+        RangeSearchResult* result,
+        const SearchParameters* params_in) const {
+    acorn_range_search(*this, n, x, radius, result, nullptr, params_in);
+}
+
+void IndexACORN::range_search(
+        idx_t n,
+        const float* x,
+        float radius,
+        RangeSearchResult* result,
+        const IDSelector* const* filters,
+        const SearchParameters* params_in) const {
+    FAISS_THROW_IF_NOT(filters);
+    FAISS_THROW_IF_NOT_MSG(
+            acorn.attributes.columns.empty() ||
+                    acorn.attributes.size() == size_t(ntotal),
+            "attribute columns do not cover all the vectors of the index");
+    acorn_range_search(*this, n, x, radius, result, filters, params_in);
+}
+
+// TODO figure out what do with this
+void IndexACORN::search(
+        idx_t n,
+        const float* x,
+        idx_t k,
+        float* distances,
+        idx_t* labels,
+        const SearchParameters* params_in) const {
+    PlainSearchOne search_one = {acorn};
+    acorn_search_batch(
+            *this, n, x, k, distances, labels, params_in, search_one);
 }
 
 // add n vectors of dimension d to the index, x is the matrix of vectors TODO
-void IndexACORN::add(idx_t n, const float* x) {
+namespace {
+
+/// add the vectors to the storage of index (and the refine index) and
+/// resize the per-vector arrays, the graph is not updated
+void add_to_storage(IndexACORN& index, idx_t n, const float* x) {
     FAISS_THROW_IF_NOT_MSG(
-            storage,
+            index.storage,
             "Please use IndexACORNFlat (or variants) instead of IndexACORN directly");
-    FAISS_THROW_IF_NOT(is_trained);
-    int n0 = ntotal;
-    storage->add(n, x);
-    ntotal = storage->ntotal;
+    FAISS_THROW_IF_NOT(index.is_trained);
+    FAISS_THROW_IF_NOT_MSG(
+            !index.acorn.is_level0_compressed(),
+            "cannot add to an index with a compressed level 0");
+    ACORN& acorn = index.acorn;
+    Index* refine_index = index.refine_index;
+    idx_t n0 = index.ntotal;
+    if (refine_index) {
+        FAISS_THROW_IF_NOT(refine_index->ntotal == n0);
+        refine_index->add(n, x);
+    }
+    index.storage->add(n, x);
+    idx_t ntotal = index.ntotal = index.storage->ntotal;
+    if (acorn.metadata && acorn.metadata == acorn.loaded_metadata.data()) {
+        acorn.loaded_metadata.resize(ntotal, 0);
+        acorn.metadata = acorn.loaded_metadata.data();
+    }
+    if (!acorn.attributes.columns.empty()) {
+        // the attributes of the new vectors are set afterwards
+        acorn.attributes.resize(ntotal);
+    }
+    if (!index.id_map.empty()) {
+        for (idx_t j = n0; j < ntotal; j++) {
+            index.id_map.push_back(j);
+            index.rev_map.push_back(j);
+        }
+    }
+}
 
+} // namespace
+
+void IndexACORN::add(idx_t n, const float* x) {
+    int n0 = ntotal;
+    add_to_storage(*this, n, x);
     acorn_add_vertices(*this, n0, n, x, verbose, acorn.levels.size() == ntotal);
 }
 
+void IndexACORN::init_from_hnsw(const IndexHNSW& index_hnsw) {
+    FAISS_THROW_IF_NOT_MSG(ntotal == 0, "the index must be empty");
+    FAISS_THROW_IF_NOT(index_hnsw.storage);
+    FAISS_THROW_IF_NOT(index_hnsw.d == d);
+    FAISS_THROW_IF_NOT(index_hnsw.metric_type == metric_type);
+    idx_t n = index_hnsw.ntotal;
+    FAISS_THROW_IF_NOT(index_hnsw.hnsw.levels.size() == size_t(n));
+    if (n == 0) {
+        return;
+    }
+    std::vector<float> x(n * d);
+    index_hnsw.storage->reconstruct_n(0, n, x.data());
+    add_to_storage(*this, n, x.data());
+    acorn.copy_from_hnsw(index_hnsw.hnsw);
+
+    // the new level 0 lists are computed from the copied ones, then
+    // written back once all of them are known
+    size_t nn = acorn.nb_neighbors(0);
+    std::vector<storage_idx_t> level0(n * nn);
+
+#pragma omp parallel
+    {
+        std::unique_ptr<DistanceComputer> dis(
+                storage_distance_computer(storage));
+        ACORNBuildScratch scratch;
+        std::vector<storage_idx_t> out;
+#pragma omp for schedule(dynamic, 256)
+        for (idx_t i = 0; i < n; i++) {
+            acorn.densify_level0(*dis, i, out, &scratch);
+            std::copy(out.begin(), out.end(), level0.begin() + i * nn);
+        }
+    }
+
+    for (idx_t i = 0; i < n; i++) {
+        size_t begin, end;
+        acorn.neighbor_range(i, 0, &begin, &end);
+        std::copy(
+                level0.begin() + i * nn,
+                level0.begin() + (i + 1) * nn,
+                acorn.neighbors.begin() + begin);
+    }
+}
+
 void IndexACORN::reset() {
     acorn.reset();
+    visited_pool->clear();
+    id_map.clear();
+    rev_map.clear();
     storage->reset();
+    if (refine_index) {
+        refine_index->reset();
+    }
     ntotal = 0;
 }
 
+void IndexACORN::reserve(idx_t n) {
+    FAISS_THROW_IF_NOT(n >= 0);
+    if (auto flat = dynamic_cast<IndexFlatCodes*>(storage)) {
+        flat->codes.reserve(n * flat->code_size);
+    }
+    if (auto flat = dynamic_cast<IndexFlatCodes*>(refine_index)) {
+        flat->codes.reserve(n * flat->code_size);
+    }
+    acorn.reserve(n);
+}
+
+float IndexACORN::estimate_selectivity(const IDSelector& sel) const {
+    if (ntotal == 0) {
+        return 0;
+    }
+    // exact counts
+    if (auto sel_range = dynamic_cast<const IDSelectorRange*>(&sel)) {
+        idx_t n = std::min(sel_range->imax, ntotal) -
+                std::max(sel_range->imin, idx_t(0));
+        return std::max(n, idx_t(0)) / float(ntotal);
+    }
+    if (auto sel_sorted = dynamic_cast<const IDSelectorSortedArray*>(&sel)) {
+        return std::min(sel_sorted->n, size_t(ntotal)) / float(ntotal);
+    }
+    if (auto sel_batch = dynamic_cast<const IDSelectorBatch*>(&sel)) {
+        return std::min(sel_batch->set.size(), size_t(ntotal)) /
+                float(ntotal);
+    }
+    if (auto sel_bitmap = dynamic_cast<const IDSelectorBitmap*>(&sel)) {
+        size_t nbyte = std::min(sel_bitmap->n, size_t(ntotal + 7) / 8);
+        size_t count = 0;
+        size_t j = 0;
+        for (; j + 8 <= nbyte; j += 8) {
+            uint64_t w;
+            memcpy(&w, sel_bitmap->bitmap + j, 8);
+            count += popcount64(w);
+        }
+        for (; j < nbyte; j++) {
+            count += popcount64(sel_bitmap->bitmap[j]);
+        }
+        return std::min(count, size_t(ntotal)) / float(ntotal);
+    }
+
+    // evenly spaced sample
+    idx_t nsample = std::min(idx_t(selectivity_sample_size), ntotal);
+    if (nsample <= 0) {
+        return 1;
+    }
+    size_t count = 0;
+    for (idx_t j = 0; j < nsample; j++) {
+        if (sel.is_member(j * ntotal / nsample)) {
+            count++;
+        }
+    }
+    return count / float(nsample);
+}
+
+size_t IndexACORN::remove_ids(const IDSelector& sel) {
+    FAISS_THROW_IF_NOT_MSG(
+            !acorn.is_level0_compressed(),
+            "cannot remove from an index with a compressed level 0");
+    acorn.deleted.resize(ntotal, 0);
+    std::vector<std::unique_ptr<IDSelector>> owned;
+    const IDSelector* sel_ids = internal_selector(*this, &sel, owned);
+    size_t nremove = 0;
+    for (idx_t i = 0; i < ntotal; i++) {
+        if (!acorn.deleted[i] && sel_ids->is_member(i)) {
+            acorn.deleted[i] = 1;
+            nremove++;
+        }
+    }
+    acorn.ndeleted += nremove;
+    return nremove;
+}
+
+void IndexACORN::repair_deleted() {
+    if (acorn.ndeleted == 0) {
+        return;
+    }
+    FAISS_THROW_IF_NOT(storage);
+
+    // the new lists are computed from the current graph, then written
+    // back once all of them are known
+    std::vector<std::pair<storage_idx_t, int>> todo;
+    for (idx_t i = 0; i < ntotal; i++) {
+        if (acorn.is_deleted(i)) {
+            continue;
+        }
+        for (int level = 0; level < acorn.levels[i]; level++) {
+            todo.emplace_back(i, level);
+        }
+    }
+    std::vector<std::vector<storage_idx_t>> new_links(todo.size());
+    std::vector<uint8_t> repaired(todo.size());
+
+#pragma omp parallel
+    {
+        std::unique_ptr<DistanceComputer> dis(
+                storage_distance_computer(storage));
+        ACORNBuildScratch scratch;
+#pragma omp for schedule(dynamic, 256)
+        for (idx_t j = 0; j < (idx_t)todo.size(); j++) {
+            repaired[j] = acorn.repair_links(
+                    *dis,
+                    todo[j].first,
+                    todo[j].second,
+                    new_links[j],
+                    &scratch);
+        }
+    }
+
+    for (size_t j = 0; j < todo.size(); j++) {
+        if (!repaired[j]) {
+            continue;
+        }
+        size_t begin, end;
+        acorn.neighbor_range(todo[j].first, todo[j].second, &begin, &end);
+        std::copy(
+                new_links[j].begin(),
+                new_links[j].end(),
+                acorn.neighbors.begin() + begin);
+    }
+}
+
+void IndexACORN::compact() {
+    if (acorn.ndeleted == 0) {
+        return;
+    }
+    // check before modifying anything, so that a failure does not leave
+    // the index half-compacted
+    for (const std::unique_ptr<ACORNAttributeColumn>& col :
+         acorn.attributes.columns) {
+        FAISS_THROW_IF_NOT_FMT(
+                col->size() == size_t(ntotal),
+                "attribute column %s has %zd values, expected %zd",
+                col->name.c_str(),
+                col->size(),
+                size_t(ntotal));
+    }
+    repair_deleted();
+    visited_pool->clear();
+
+    std::vector<idx_t> removed;
+    for (idx_t i = 0; i < ntotal; i++) {
+        if (acorn.is_deleted(i)) {
+            removed.push_back(i);
+        }
+    }
+    IDSelectorBatch sel(removed.size(), removed.data());
+    size_t nremove = storage->remove_ids(sel);
+    FAISS_THROW_IF_NOT(nremove == removed.size());
+    if (refine_index) {
+        nremove = refine_index->remove_ids(sel);
+        FAISS_THROW_IF_NOT(nremove == removed.size());
+    }
+
+    std::vector<idx_t> map;
+    size_t n1 = acorn.remove_deleted(map);
+
+    if (!acorn.attributes.columns.empty()) {
+        acorn.attributes.remap(ntotal, map.data());
+    }
+    if (acorn.metadata) {
+        // the legacy metadata may be owned by the caller, keep a compacted
+        // copy
+        std::vector<int> metadata(n1);
+        for (idx_t i = 0; i < ntotal; i++) {
+            if (map[i] >= 0) {
+                metadata[map[i]] = acorn.metadata[i];
+            }
+        }
+        acorn.loaded_metadata.swap(metadata);
+        acorn.metadata = acorn.loaded_metadata.data();
+    }
+    if (!id_map.empty()) {
+        // the labels are shifted down over the removed labels, as the ids
+        std::vector<idx_t> removed_labels;
+        for (idx_t i : removed) {
+            removed_labels.push_back(id_map[i]);
+        }
+        std::sort(removed_labels.begin(), removed_labels.end());
+        std::vector<idx_t> new_id_map(n1);
+        for (idx_t i = 0; i < ntotal; i++) {
+            if (map[i] >= 0) {
+                idx_t shift = std::lower_bound(
+                                      removed_labels.begin(),
+                                      removed_labels.end(),
+                                      id_map[i]) -
+                        removed_labels.begin();
+                new_id_map[map[i]] = id_map[i] - shift;
+            }
+        }
+        id_map.swap(new_id_map);
+    }
+
+    ntotal = n1;
+    construct_rev_map();
+    FAISS_ASSERT(storage->ntotal == ntotal);
+}
+
+void IndexACORN::reorder_graph() {
+    FAISS_THROW_IF_NOT(storage);
+    auto flat = dynamic_cast<IndexFlatCodes*>(storage);
+    FAISS_THROW_IF_NOT_MSG(
+            flat, "reorder_graph requires an IndexFlatCodes storage");
+    auto flat_refine = dynamic_cast<IndexFlatCodes*>(refine_index);
+    FAISS_THROW_IF_NOT_MSG(
+            !refine_index || flat_refine,
+            "reorder_graph requires an IndexFlatCodes refine_index");
+    if (ntotal == 0) {
+        return;
+    }
+    // check before modifying anything, so that a failure does not leave
+    // the codes and the graph numbered differently
+    FAISS_THROW_IF_NOT_MSG(
+            !acorn.is_level0_compressed(),
+            "cannot reorder a graph with a compressed level 0");
+    FAISS_THROW_IF_NOT(acorn.levels.size() == size_t(ntotal));
+    FAISS_THROW_IF_NOT(flat->ntotal == ntotal);
+    FAISS_THROW_IF_NOT(!flat_refine || flat_refine->ntotal == ntotal);
+    FAISS_THROW_IF_NOT(id_map.empty() || id_map.size() == size_t(ntotal));
+    for (const std::unique_ptr<ACORNAttributeColumn>& col :
+         acorn.attributes.columns) {
+        FAISS_THROW_IF_NOT_FMT(
+                col->size() == size_t(ntotal),
+                "attribute column %s has %zd values, expected %zd",
+                col->name.c_str(),
+                col->size(),
+                size_t(ntotal));
+    }
+
+    std::vector<idx_t> perm;
+    acorn.bfs_order(perm);
+
+    // the graph first: the codes are permuted only if it succeeded
+    acorn.reorder_nodes(perm.data());
+
+    for (IndexFlatCodes* codes_index : {flat, flat_refine}) {
+        if (!codes_index) {
+            continue;
+        }
+        size_t cs = codes_index->code_size;
+        std::vector<uint8_t> codes(ntotal * cs);
+        for (idx_t i = 0; i < ntotal; i++) {
+            memcpy(codes.data() + i * cs,
+                   codes_index->codes.data() + perm[i] * cs,
+                   cs);
+        }
+        codes_index->codes = std::move(codes);
+    }
+
+    std::vector<idx_t> new_id_map(ntotal);
+    for (idx_t i = 0; i < ntotal; i++) {
+        new_id_map[i] = id_map.empty() ? perm[i] : id_map[perm[i]];
+    }
+    id_map.swap(new_id_map);
+    construct_rev_map();
+    visited_pool->clear();
+}
+
+void IndexACORN::construct_rev_map() {
+    rev_map.assign(id_map.size(), -1);
+    for (size_t i = 0; i < id_map.size(); i++) {
+        idx_t label = id_map[i];
+        FAISS_THROW_IF_NOT_MSG(
+                label >= 0 && size_t(label) < id_map.size() &&
+                        rev_map[label] < 0,
+                "id_map is not a permutation");
+        rev_map[label] = i;
+    }
+}
+
 void IndexACORN::reconstruct(idx_t key, float* recons) const {
-    storage->reconstruct(key, recons);
+    if (!rev_map.empty()) {
+        FAISS_THROW_IF_NOT_MSG(
+                key >= 0 && size_t(key) < rev_map.size(), "label not found");
+        key = rev_map[key];
+    }
+    if (refine_index) {
+        refine_index->reconstruct(key, recons);
+    } else {
+        storage->reconstruct(key, recons);
+    }
 }
 
 
@@ -478,12 +1849,64 @@ void IndexACORN::printStats(bool print_edge_list, bool print_filtered_edge_lists
 
 
 
+IndexACORNFlat::IndexACORNFlat() {
+    is_trained = true;
+}
+
 IndexACORNFlat::IndexACORNFlat(int d, int M, int gamma, std::vector<int>& metadata, int M_beta, MetricType metric)
         : IndexACORN(new IndexFlat(d, metric), M, gamma, metadata, M_beta) {
     own_fields = true;
     is_trained = true;
 }
 
+/**************************************************************
+ * IndexACORNSQ implementation
+ **************************************************************/
+
+IndexACORNSQ::IndexACORNSQ() {}
+
+IndexACORNSQ::IndexACORNSQ(
+        int d,
+        ScalarQuantizer::QuantizerType qtype,
+        int M,
+        int gamma,
+        std::vector<int>& metadata,
+        int M_beta,
+        MetricType metric)
+        : IndexACORN(
+                  new IndexScalarQuantizer(d, qtype, metric),
+                  M,
+                  gamma,
+                  metadata,
+                  M_beta) {
+    own_fields = true;
+    is_trained = this->storage->is_trained;
+}
+
+/**************************************************************
+ * IndexACORNPQ implementation
+ **************************************************************/
+
+IndexACORNPQ::IndexACORNPQ() {}
+
+IndexACORNPQ::IndexACORNPQ(
+        int d,
+        int pq_m,
+        int M,
+        int gamma,
+        std::vector<int>& metadata,
+        int M_beta)
+        : IndexACORN(new IndexPQ(d, pq_m, 8), M, gamma, metadata, M_beta) {
+    own_fields = true;
+    is_trained = false;
+}
+
+void IndexACORNPQ::train(idx_t n, const float* x) {
+    IndexACORN::train(n, x);
+    // the construction uses the symmetric distances
+    (dynamic_cast<IndexPQ*>(storage))->pq.compute_sdc_table();
+}
+
 
 
 
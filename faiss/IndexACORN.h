@@ -9,6 +9,8 @@
 
 #pragma once
 
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include <faiss/IndexFlat.h>
@@ -25,9 +27,36 @@
 namespace faiss {
 
 struct IndexACORN;
-
-
-
+struct IndexHNSW;
+struct VisitedTable;
+
+/** Visited sets kept between the search calls of an index, so that a
+ * call does not allocate (and fault in) one table of size ntotal per
+ * thread. A VisitedTable takes ntotal bytes, so the dense tables kept use
+ * up to max_size * ntotal bytes; the sets given back to a full pool are
+ * freed. A search call takes one set per thread, or interleave_queries
+ * sets per thread in interleaved mode. Thread-safe. */
+struct VisitedTablePool {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<VisitedTable>> tables;
+    std::vector<std::unique_ptr<ACORNVisitedHashSet>> hashsets;
+
+    /// max nb of tables kept, and of hash sets kept
+    size_t max_size;
+
+    /// max_size is the max nb of OpenMP threads
+    VisitedTablePool();
+
+    /// a cleared set for ntotal vectors, from the pool if possible
+    void get(idx_t ntotal, std::unique_ptr<VisitedTable>& vt);
+    void get(idx_t ntotal, std::unique_ptr<ACORNVisitedHashSet>& vt);
+
+    /// give back a set obtained with get()
+    void put(std::unique_ptr<VisitedTable> vt);
+    void put(std::unique_ptr<ACORNVisitedHashSet> vt);
+
+    void clear();
+};
 
 /** The ACORN index is a normal random-access index with a ACORN
  * link structure built on top */
@@ -42,11 +71,92 @@ struct IndexACORN : Index {
     bool own_fields;
     Index* storage;
 
+    /// optional exact vectors (eg. an IndexFlat) to re-rank the results
+    /// found on a quantized storage. Contains the same vectors as storage,
+    /// it is filled by add() when set before the first add.
+    Index* refine_index = nullptr;
+    bool own_refine_index = false;
+
+    /// nb of results re-ranked per requested result when there is a
+    /// refine_index
+    float k_factor = 1;
+
+    /** Query planner of the searches with a filter, off by default (all
+     * the filtered searches are hybrid ACORN searches). When on, the
+     * fraction of vectors accepted by the filter (selectivity) is
+     * estimated first: below brute_force_selectivity, the matching vectors
+     * are scanned exhaustively; above post_filter_selectivity, the graph
+     * is searched without the filter, with an efSearch scaled by 1 /
+     * selectivity, and the non-matching results are dropped. In between,
+     * the hybrid ACORN search is used. The exhaustive scan is used only
+     * for the filters whose matching ids can be listed without testing
+     * all the ids: id ranges, sorted id lists, bitmaps, byte maps,
+     * attribute predicates (with the inverted index of the column) and
+     * conjunctions of them with other selectors. */
+    bool query_planner = false;
+    float brute_force_selectivity = 0.001;
+    float post_filter_selectivity = 0.9;
+
+    /// nb of vectors sampled to estimate the selectivity of filters whose
+    /// size is not known (arbitrary IDSelectors, byte maps)
+    int selectivity_sample_size = 1024;
+
+    /** fill the results of the filtered searches that return fewer than k
+     * results while more vectors match the filter. Such a query is
+     * searched again with a 4x larger efSearch if the filter is estimated
+     * to match many vectors, then, if still incomplete, the matching
+     * vectors are scanned exhaustively. The labels are -1 only when fewer
+     * than k vectors match. The cost is reported in ACORNStats. */
+    bool complete_results = false;
+
+    /** nb of threads that explore the level 0 of the graph for one
+     * filtered query. When > 1, the queries of a batch are searched one
+     * after the other instead of in parallel: use it to reduce the latency
+     * of small batches (typically single queries with a large efSearch). */
+    int intra_query_threads = 1;
+
+    /** nb of queries whose hybrid searches each thread advances in
+     * round-robin (see ACORNInterleavedSearch), so that the memory accesses
+     * of one query overlap with the computations of the others. 1 =
+     * queries searched one after the other. Useful for large batches on
+     * indexes that do not fit in the cache; the results do not change. */
+    int interleave_queries = 1;
+
+    /** visited set of the searches: 0 = VisitedTable (byte array of size
+     * ntotal), 1 = ACORNVisitedHashSet, -1 = hash set when the expected nb
+     * of visited vertices (from efSearch) is below 1/64 of ntotal. The
+     * hash table avoids the memory and the periodic clearing of the byte
+     * arrays on very large indexes. */
+    int visited_set_type = -1;
+
+    /// visited sets reused across search calls, emptied by reset() and
+    /// compact()
+    std::shared_ptr<VisitedTablePool> visited_pool =
+            std::make_shared<VisitedTablePool>();
+
+    /** label of each vector after reorder_graph(), empty if the index was
+     * not reordered (the labels are then the ids). The search results are
+     * labels, and the filters on ids (byte maps, id selectors, including
+     * SearchParameters::sel) are given in terms of labels. The attribute
+     * columns are reordered with the vectors, so the attribute predicates
+     * are evaluated directly. */
+    std::vector<idx_t> id_map;
+
+    /// inverse of id_map (id of each label), empty if id_map is empty
+    std::vector<idx_t> rev_map;
+
+    /// rebuild rev_map from id_map, which must be a permutation
+    void construct_rev_map();
+
+    /// estimated fraction of the vectors that sel accepts
+    float estimate_selectivity(const IDSelector& sel) const;
+
 //     ReconstructFromNeighbors* reconstruct_from_neighbors;
 
     explicit IndexACORN(int d, int M, int gamma, std::vector<int>& metadata, int M_beta, MetricType metric = METRIC_L2); // defaults d = 0, M=32, gamma=1
     explicit IndexACORN(Index* storage, int M, int gamma, std::vector<int>& metadata, int M_beta);
-//     explicit IndexACORN(); // TODO check this is right
+    /// empty index without storage, used when reading from disk
+    IndexACORN();
 
     ~IndexACORN() override;
 
@@ -56,6 +166,13 @@ struct IndexACORN : Index {
     /// Trains the storage if needed
     void train(idx_t n, const float* x) override;
 
+    /** fill an empty index with the vectors of index_hnsw, reusing its
+     * graph instead of inserting the vectors one by one: the levels and
+     * the upper level links are copied, the level 0 lists are rebuilt
+     * from the two-hop neighborhoods of the HNSW level 0 with the ACORN
+     * pruning (see ACORN::densify_level0). The storage must be trained. */
+    void init_from_hnsw(const IndexHNSW& index_hnsw);
+
     /// entry point for search
     void search(
             idx_t n,
@@ -76,11 +193,76 @@ struct IndexACORN : Index {
             char* filter_id_map,
             const SearchParameters* params = nullptr) const;
 
+    /** hybrid search with one filter per query.
+     *
+     * @param filters  n pointers to IDSelectors; filters[i] restricts the
+     *                 results of query i. Bitmaps (IDSelectorBitmap), sorted
+     *                 id lists (IDSelectorSortedArray), ranges, predicates
+     *                 on acorn.attributes (IDSelectorAttributeEqual,
+     *                 IDSelectorAttributeRange, IDSelectorAnd) and arbitrary
+     *                 selectors are accepted. The same selector may be
+     *                 shared by several queries.
+     */
+    void search(
+            idx_t n,
+            const float* x,
+            idx_t k,
+            float* distances,
+            idx_t* labels,
+            const IDSelector* const* filters,
+            const SearchParameters* params = nullptr) const;
+
+    /** all the vectors within radius of the queries that the graph search
+     * reaches (see ACORN::range_search). params->sel is supported. */
+    void range_search(
+            idx_t n,
+            const float* x,
+            float radius,
+            RangeSearchResult* result,
+            const SearchParameters* params = nullptr) const override;
+
+    /// range search with one filter per query, as in the filtered search
+    void range_search(
+            idx_t n,
+            const float* x,
+            float radius,
+            RangeSearchResult* result,
+            const IDSelector* const* filters,
+            const SearchParameters* params = nullptr) const;
+
     void reconstruct(idx_t key, float* recons) const override;
 
     void reset() override;
 
-    
+    /** allocate the storage and the graph for n vectors in total. Use
+     * before adding a large dataset by batches to bound the peak memory
+     * usage. Only the codes of IndexFlatCodes storages are reserved. */
+    void reserve(idx_t n);
+
+    /** flag the vectors selected by sel as removed. Unlike for other
+     * indexes, the ids do not change: the vectors stay in the graph, are
+     * still traversed by the searches but never returned, until compact()
+     * is called. Not thread-safe with concurrent searches or adds.
+     *
+     * @return nb of vectors that were not removed yet */
+    size_t remove_ids(const IDSelector& sel) override;
+
+    /// replace the links to removed vectors with links to their remaining
+    /// neighbors, so that the graph stays connected around them
+    void repair_deleted();
+
+    /** repair the links, then drop the removed vectors from the storage,
+     * the graph and the attributes. The ids of the remaining vectors are
+     * shifted down, as for Index::remove_ids. This is the maintenance
+     * pass to run when acorn.ndeleted becomes large. */
+    void compact();
+
+    /** renumber the vectors in the breadth-first order of the level 0 of
+     * the graph (see ACORN::bfs_order), so that neighbors are close in the
+     * storage and in the link arrays. The labels are kept in id_map and
+     * do not change. Requires IndexFlatCodes storages. */
+    void reorder_graph();
+
 
     // added for debugging
     void printStats(bool print_edge_list=false, bool print_filtered_edge_lists=false, int filter=-1, Operation op=EQUAL);
@@ -134,6 +316,36 @@ struct IndexACORNFlat : IndexACORN {
 
 };
 
+/** SQ index topped with a ACORN structure. The graph is built with the
+ * distances between the encoded vectors.
+ */
+struct IndexACORNSQ : IndexACORN {
+    IndexACORNSQ();
+    IndexACORNSQ(
+            int d,
+            ScalarQuantizer::QuantizerType qtype,
+            int M,
+            int gamma,
+            std::vector<int>& metadata,
+            int M_beta,
+            MetricType metric = METRIC_L2);
+};
+
+/** PQ index topped with a ACORN structure. The graph is built with the
+ * symmetric (code to code) distances of the PQ.
+ */
+struct IndexACORNPQ : IndexACORN {
+    IndexACORNPQ();
+    IndexACORNPQ(
+            int d,
+            int pq_m,
+            int M,
+            int gamma,
+            std::vector<int>& metadata,
+            int M_beta);
+    void train(idx_t n, const float* x) override;
+};
+
 
 
 
@@ -105,6 +105,29 @@ struct FlatL2Dis : FlatCodesDistanceComputer {
         return fvec_L2sqr(b + j * d, b + i * d, d);
     }
 
+    void distances_batch_4(
+            const idx_t idx0,
+            const idx_t idx1,
+            const idx_t idx2,
+            const idx_t idx3,
+            float& dis0,
+            float& dis1,
+            float& dis2,
+            float& dis3) final {
+        ndis += 4;
+        fvec_L2sqr_batch_4(
+                q,
+                b + idx0 * d,
+                b + idx1 * d,
+                b + idx2 * d,
+                b + idx3 * d,
+                d,
+                dis0,
+                dis1,
+                dis2,
+                dis3);
+    }
+
     explicit FlatL2Dis(const IndexFlat& storage, const float* q = nullptr)
             : FlatCodesDistanceComputer(
                       storage.codes.data(),
@@ -131,6 +154,29 @@ struct FlatIPDis : FlatCodesDistanceComputer {
         return fvec_inner_product(b + j * d, b + i * d, d);
     }
 
+    void distances_batch_4(
+            const idx_t idx0,
+            const idx_t idx1,
+            const idx_t idx2,
+            const idx_t idx3,
+            float& dis0,
+            float& dis1,
+            float& dis2,
+            float& dis3) final {
+        ndis += 4;
+        fvec_inner_product_batch_4(
+                q,
+                b + idx0 * d,
+                b + idx1 * d,
+                b + idx2 * d,
+                b + idx3 * d,
+                d,
+                dis0,
+                dis1,
+                dis2,
+                dis3);
+    }
+
     float distance_to_code(const uint8_t* code) final {
         ndis++;
         return fvec_inner_product(q, (float*)code, d);
@@ -0,0 +1,380 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#include <faiss/IndexFlatOnDisk.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#include <faiss/impl/DistanceComputer.h>
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/impl/IDSelector.h>
+#include <faiss/utils/Heap.h>
+#include <faiss/utils/distances.h>
+
+namespace faiss {
+
+namespace {
+
+/// first 4 bytes of the header page
+const char file_magic[4] = {'F', 'x', 'O', 'd'};
+
+void pread_all(int fd, void* buf, size_t size, size_t offset) {
+    char* p = (char*)buf;
+    while (size > 0) {
+        ssize_t ret = pread(fd, p, size, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        FAISS_THROW_IF_NOT_FMT(
+                ret > 0,
+                "pread failed at offset %zu: %s",
+                offset,
+                ret == 0 ? "end of file" : strerror(errno));
+        p += ret;
+        size -= ret;
+        offset += ret;
+    }
+}
+
+void pwrite_all(int fd, const void* buf, size_t size, size_t offset) {
+    const char* p = (const char*)buf;
+    while (size > 0) {
+        ssize_t ret = pwrite(fd, p, size, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        FAISS_THROW_IF_NOT_FMT(
+                ret > 0, "pwrite failed: %s", strerror(errno));
+        p += ret;
+        size -= ret;
+        offset += ret;
+    }
+}
+
+float vector_distance(
+        MetricType metric,
+        const float* x,
+        const float* y,
+        size_t d) {
+    return metric == METRIC_INNER_PRODUCT ? fvec_inner_product(x, y, d)
+                                          : fvec_L2sqr(x, y, d);
+}
+
+/// reads the vector for each distance computation
+struct FlatOnDiskDis : DistanceComputer {
+    const IndexFlatOnDisk& index;
+    const float* q = nullptr;
+    std::vector<float> buf;
+
+    explicit FlatOnDiskDis(const IndexFlatOnDisk& index)
+            : index(index), buf(2 * index.d) {}
+
+    void set_query(const float* x) override {
+        q = x;
+    }
+
+    float operator()(idx_t i) override {
+        index.reconstruct(i, buf.data());
+        return vector_distance(index.metric_type, q, buf.data(), index.d);
+    }
+
+    float symmetric_dis(idx_t i, idx_t j) override {
+        index.reconstruct(i, buf.data());
+        index.reconstruct(j, buf.data() + index.d);
+        return vector_distance(
+                index.metric_type, buf.data(), buf.data() + index.d, index.d);
+    }
+};
+
+template <class C>
+void search_blocks(
+        const IndexFlatOnDisk& index,
+        idx_t n,
+        const float* x,
+        idx_t k,
+        float* distances,
+        idx_t* labels) {
+    for (idx_t i = 0; i < n; i++) {
+        heap_heapify<C>(k, distances + i * k, labels + i * k);
+    }
+    size_t bs = std::max(index.scan_block_size, size_t(1));
+    std::vector<float> block(bs * index.d);
+    std::vector<float> block_dis(n * k);
+    std::vector<idx_t> block_labels(n * k);
+    for (idx_t i0 = 0; i0 < index.ntotal; i0 += bs) {
+        idx_t i1 = std::min(index.ntotal, idx_t(i0 + bs));
+        pread_all(
+                index.fd,
+                block.data(),
+                (i1 - i0) * index.d * sizeof(float),
+                IndexFlatOnDisk::header_size + i0 * index.d * sizeof(float));
+        if (index.metric_type == METRIC_INNER_PRODUCT) {
+            knn_inner_product(
+                    x,
+                    block.data(),
+                    index.d,
+                    n,
+                    i1 - i0,
+                    k,
+                    block_dis.data(),
+                    block_labels.data());
+        } else {
+            knn_L2sqr(
+                    x,
+                    block.data(),
+                    index.d,
+                    n,
+                    i1 - i0,
+                    k,
+                    block_dis.data(),
+                    block_labels.data());
+        }
+#pragma omp parallel for if (n > 1)
+        for (idx_t i = 0; i < n; i++) {
+            float* simi = distances + i * k;
+            idx_t* idxi = labels + i * k;
+            for (idx_t j = 0; j < k; j++) {
+                idx_t id = block_labels[i * k + j];
+                float dis = block_dis[i * k + j];
+                if (id >= 0 && C::cmp(simi[0], dis)) {
+                    heap_replace_top<C>(k, simi, idxi, dis, id + i0);
+                }
+            }
+        }
+    }
+    for (idx_t i = 0; i < n; i++) {
+        heap_reorder<C>(k, distances + i * k, labels + i * k);
+    }
+}
+
+} // namespace
+
+IndexFlatOnDisk::IndexFlatOnDisk(
+        const char* filename,
+        idx_t d,
+        MetricType metric)
+        : Index(d, metric), filename(filename) {
+    FAISS_THROW_IF_NOT_MSG(
+            metric == METRIC_L2 || metric == METRIC_INNER_PRODUCT,
+            "IndexFlatOnDisk supports only L2 and inner product");
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    FAISS_THROW_IF_NOT_FMT(
+            fd >= 0, "could not open %s: %s", filename, strerror(errno));
+    std::vector<char> header(header_size);
+    memcpy(header.data(), file_magic, 4);
+    int32_t d32 = d;
+    memcpy(header.data() + 4, &d32, sizeof(d32));
+    pwrite_all(fd, header.data(), header_size, 0);
+}
+
+IndexFlatOnDisk::IndexFlatOnDisk() {}
+
+IndexFlatOnDisk::~IndexFlatOnDisk() {
+    close_file();
+}
+
+void IndexFlatOnDisk::close_file() {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+void IndexFlatOnDisk::open_file() {
+    close_file();
+    fd = open(filename.c_str(), read_only ? O_RDONLY : O_RDWR);
+    FAISS_THROW_IF_NOT_FMT(
+            fd >= 0,
+            "could not open %s: %s",
+            filename.c_str(),
+            strerror(errno));
+    char header[8];
+    pread_all(fd, header, sizeof(header), 0);
+    int32_t d32;
+    memcpy(&d32, header + 4, sizeof(d32));
+    FAISS_THROW_IF_NOT_FMT(
+            memcmp(header, file_magic, 4) == 0 && d32 == d,
+            "%s is not a file of vectors of dimension %" PRId64,
+            filename.c_str(),
+            d);
+    struct stat st;
+    FAISS_THROW_IF_NOT_FMT(
+            fstat(fd, &st) == 0, "fstat failed: %s", strerror(errno));
+    FAISS_THROW_IF_NOT_FMT(
+            size_t(st.st_size) >= header_size + ntotal * d * sizeof(float),
+            "%s contains fewer than %" PRId64 " vectors",
+            filename.c_str(),
+            ntotal);
+}
+
+void IndexFlatOnDisk::add(idx_t n, const float* x) {
+    FAISS_THROW_IF_NOT_MSG(fd >= 0 && !read_only, "file not writable");
+    pwrite_all(
+            fd,
+            x,
+            n * d * sizeof(float),
+            header_size + ntotal * d * sizeof(float));
+    ntotal += n;
+}
+
+void IndexFlatOnDisk::reset() {
+    FAISS_THROW_IF_NOT_MSG(fd >= 0 && !read_only, "file not writable");
+    FAISS_THROW_IF_NOT_FMT(
+            ftruncate(fd, header_size) == 0,
+            "ftruncate failed: %s",
+            strerror(errno));
+    ntotal = 0;
+}
+
+size_t IndexFlatOnDisk::remove_ids(const IDSelector& sel) {
+    FAISS_THROW_IF_NOT_MSG(fd >= 0 && !read_only, "file not writable");
+    size_t vsize = d * sizeof(float);
+    size_t bs = std::max(scan_block_size, size_t(1));
+    std::vector<float> block(bs * d);
+    // the kept vectors are written at j <= i0, so a block is read before
+    // it is overwritten
+    idx_t j = 0;
+    for (idx_t i0 = 0; i0 < ntotal; i0 += bs) {
+        idx_t i1 = std::min(ntotal, idx_t(i0 + bs));
+        pread_all(
+                fd, block.data(), (i1 - i0) * vsize, header_size + i0 * vsize);
+        idx_t nkeep = 0;
+        for (idx_t i = i0; i < i1; i++) {
+            if (sel.is_member(i)) {
+                continue;
+            }
+            if (nkeep != i - i0) {
+                memcpy(block.data() + nkeep * d,
+                       block.data() + (i - i0) * d,
+                       vsize);
+            }
+            nkeep++;
+        }
+        if (j != i0 || nkeep != i1 - i0) {
+            pwrite_all(fd, block.data(), nkeep * vsize, header_size + j * vsize);
+        }
+        j += nkeep;
+    }
+    size_t nremove = ntotal - j;
+    if (nremove > 0) {
+        FAISS_THROW_IF_NOT_FMT(
+                ftruncate(fd, header_size + j * vsize) == 0,
+                "ftruncate failed: %s",
+                strerror(errno));
+        ntotal = j;
+    }
+    return nremove;
+}
+
+void IndexFlatOnDisk::search(
+        idx_t n,
+        const float* x,
+        idx_t k,
+        float* distances,
+        idx_t* labels,
+        const SearchParameters* params) const {
+    FAISS_THROW_IF_NOT(k > 0);
+    FAISS_THROW_IF_NOT_MSG(
+            !params || !params->sel, "IndexFlatOnDisk does not support sel");
+    if (metric_type == METRIC_INNER_PRODUCT) {
+        search_blocks<CMin<float, idx_t>>(*this, n, x, k, distances, labels);
+    } else {
+        search_blocks<CMax<float, idx_t>>(*this, n, x, k, distances, labels);
+    }
+}
+
+void IndexFlatOnDisk::reconstruct(idx_t key, float* recons) const {
+    FAISS_THROW_IF_NOT(key >= 0 && key < ntotal);
+    pread_all(
+            fd,
+            recons,
+            d * sizeof(float),
+            header_size + key * d * sizeof(float));
+}
+
+void IndexFlatOnDisk::read_vectors(idx_t n, const idx_t* ids, float* out)
+        const {
+    std::vector<idx_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [ids](idx_t a, idx_t b) {
+        return ids[a] < ids[b];
+    });
+    for (idx_t i = 0; i < n; i++) {
+        FAISS_THROW_IF_NOT(ids[i] >= 0 && ids[i] < ntotal);
+    }
+    size_t vsize = d * sizeof(float);
+
+    // runs of consecutive (or repeated) ids, as [begin, end) in order
+    std::vector<idx_t> run_begin;
+    for (idx_t i = 0; i < n; i++) {
+        if (i == 0 || ids[order[i]] > ids[order[i - 1]] + 1) {
+            run_begin.push_back(i);
+        }
+    }
+    run_begin.push_back(n);
+    size_t nrun = run_begin.size() - 1;
+
+#ifdef POSIX_FADV_WILLNEED
+    for (size_t r = 0; r < nrun; r++) {
+        idx_t first = ids[order[run_begin[r]]];
+        idx_t last = ids[order[run_begin[r + 1] - 1]];
+        posix_fadvise(
+                fd,
+                header_size + first * vsize,
+                (last - first + 1) * vsize,
+                POSIX_FADV_WILLNEED);
+    }
+#endif
+
+    std::vector<float> buf;
+    for (size_t r = 0; r < nrun; r++) {
+        idx_t first = ids[order[run_begin[r]]];
+        idx_t last = ids[order[run_begin[r + 1] - 1]];
+        buf.resize((last - first + 1) * d);
+        pread_all(
+                fd,
+                buf.data(),
+                (last - first + 1) * vsize,
+                header_size + first * vsize);
+        for (idx_t i = run_begin[r]; i < run_begin[r + 1]; i++) {
+            memcpy(out + order[i] * d,
+                   buf.data() + (ids[order[i]] - first) * d,
+                   vsize);
+        }
+    }
+}
+
+void IndexFlatOnDisk::compute_distances(
+        const float* x,
+        idx_t n,
+        const idx_t* ids,
+        float* distances) const {
+    std::vector<float> vectors(n * d);
+    read_vectors(n, ids, vectors.data());
+    for (idx_t i = 0; i < n; i++) {
+        distances[i] =
+                vector_distance(metric_type, x, vectors.data() + i * d, d);
+    }
+}
+
+DistanceComputer* IndexFlatOnDisk::get_distance_computer() const {
+    return new FlatOnDiskDis(*this);
+}
+
+} // namespace faiss
@@ -0,0 +1,107 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <string>
+
+#include <faiss/Index.h>
+
+namespace faiss {
+
+/** Exhaustive index whose vectors stay in a file instead of RAM. It is
+ * meant as the refine_index of an index with compressed vectors (eg. an
+ * IndexACORNPQ) when the full vectors do not fit in memory: only the
+ * k_factor * k results of each query are read back to be re-ranked.
+ *
+ * The file starts with a header page, followed by the vectors stored
+ * contiguously as floats, so that the vector data is page-aligned. The
+ * vectors are read with pread (no mmap), so that the reads do not compete
+ * with the in-RAM structures for the page cache more than necessary.
+ * Concurrent searches are supported, add() and reset() are not
+ * thread-safe.
+ */
+struct IndexFlatOnDisk : Index {
+    /// size of the header, the vectors start at this offset of the file
+    static const size_t header_size = 4096;
+
+    std::string filename;
+
+    /// open with O_RDONLY, add() is then forbidden
+    bool read_only = false;
+
+    /// nb of vectors read at a time by search()
+    size_t scan_block_size = 16384;
+
+    /// file descriptor, -1 if no file is open
+    int fd = -1;
+
+    /// create (or truncate) the file
+    IndexFlatOnDisk(
+            const char* filename,
+            idx_t d,
+            MetricType metric = METRIC_L2);
+
+    IndexFlatOnDisk();
+
+    // the file descriptor is owned
+    IndexFlatOnDisk(const IndexFlatOnDisk&) = delete;
+    IndexFlatOnDisk& operator=(const IndexFlatOnDisk&) = delete;
+
+    ~IndexFlatOnDisk() override;
+
+    /** open an existing file (created by the constructor above) that
+     * contains at least ntotal vectors of dimension d */
+    void open_file();
+
+    /// append the vectors at the end of the file
+    void add(idx_t n, const float* x) override;
+
+    void reset() override;
+
+    /** remove the vectors selected by sel, the following vectors are
+     * shifted down in the file, which is then truncated. The file is
+     * rewritten from the first removed vector on. */
+    size_t remove_ids(const IDSelector& sel) override;
+
+    /// exhaustive search, the file is read by blocks of scan_block_size
+    void search(
+            idx_t n,
+            const float* x,
+            idx_t k,
+            float* distances,
+            idx_t* labels,
+            const SearchParameters* params = nullptr) const override;
+
+    void reconstruct(idx_t key, float* recons) const override;
+
+    /** read the vectors ids[0..n-1] to out (size n * d). The reads are done
+     * in the order of the offsets, the runs of consecutive ids are read
+     * with a single pread, and the kernel is told beforehand with
+     * posix_fadvise which ranges will be read, so that the reads of the
+     * next ranges proceed while the current one is copied. */
+    void read_vectors(idx_t n, const idx_t* ids, float* out) const;
+
+    /** distances between the query x and the vectors ids[0..n-1], read
+     * with read_vectors. Used by IndexACORN to re-rank the results of a
+     * query with one batch of reads. */
+    void compute_distances(
+            const float* x,
+            idx_t n,
+            const idx_t* ids,
+            float* distances) const;
+
+    /// reads one vector per distance computation, prefer compute_distances
+    DistanceComputer* get_distance_computer() const override;
+
+   private:
+    void close_file();
+};
+
+} // namespace faiss
@@ -9,11 +9,20 @@
 
 #include <faiss/impl/ACORN.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
 #include <string>
+#include <thread>
 
+#include <faiss/impl/ACORNDistanceComputers.h>
 #include <faiss/impl/AuxIndexStructures.h>
 #include <faiss/impl/DistanceComputer.h>
+#include <faiss/impl/HNSW.h>
 #include <faiss/impl/IDSelector.h>
+#include <faiss/utils/hamming.h>
+#include <faiss/utils/prefetch.h>
 
 // added
 #include <sys/time.h>
@@ -88,6 +97,163 @@ namespace faiss {
 
 
 
+/**************************************************************
+ * ACORNCompressedLinks
+ **************************************************************/
+
+void ACORNCompressedLinks::set_lims(size_t n, const size_t* abs_lims) {
+    block_lims.resize((n >> block_bits) + 1);
+    lims.resize(n + 1);
+    for (size_t i = 0; i <= n; i++) {
+        size_t& b0 = block_lims[i >> block_bits];
+        if ((i & ((size_t(1) << block_bits) - 1)) == 0) {
+            b0 = abs_lims[i];
+        }
+        FAISS_THROW_IF_NOT(
+                abs_lims[i] >= b0 &&
+                abs_lims[i] - b0 <= std::numeric_limits<uint32_t>::max());
+        lims[i] = abs_lims[i] - b0;
+    }
+}
+
+void ACORNCompressedLinks::encode(
+        size_t n,
+        const size_t* begins,
+        const storage_idx_t* ids,
+        int nbits_in) {
+    FAISS_THROW_IF_NOT(nbits_in > 0 && nbits_in <= 32);
+    nbits = nbits_in;
+    std::vector<size_t> abs_lims(n + 1);
+    abs_lims[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        abs_lims[i + 1] = abs_lims[i] + begins[i + 1] - begins[i];
+    }
+    set_lims(n, abs_lims.data());
+    codes.resize((abs_lims[n] * nbits + 7) / 8 + 8);
+    BitstringWriter wr(codes.data(), codes.size());
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = begins[i]; j < begins[i + 1]; j++) {
+            FAISS_THROW_IF_NOT(ids[j] >= 0 && (uint64_t)ids[j] >> nbits == 0);
+            wr.write(ids[j], nbits);
+        }
+    }
+}
+
+size_t ACORNCompressedLinks::decode(size_t i, storage_idx_t* out) const {
+    size_t e0 = begin(i);
+    size_t n = begin(i + 1) - e0;
+    const uint8_t* data = codes.data();
+    uint64_t mask = (uint64_t(1) << nbits) - 1;
+    size_t bit = e0 * nbits;
+    // an entry spans at most 5 bytes, read it from a little-endian
+    // 64-bit word (the 8 bytes of padding keep this in bounds)
+    for (size_t j = 0; j < n; j++) {
+        uint64_t w;
+        memcpy(&w, data + (bit >> 3), sizeof(w));
+        out[j] = (w >> (bit & 7)) & mask;
+        bit += nbits;
+    }
+    return n;
+}
+
+void ACORNCompressedLinks::prefetch(size_t i) const {
+    prefetch_L2(codes.data() + ((begin(i) * nbits) >> 3));
+}
+
+void ACORNCompressedLinks::reset() {
+    nbits = 0;
+    block_lims.clear();
+    lims.clear();
+    codes.clear();
+}
+
+/**************************************************************
+ * ACORNSearchScratch
+ **************************************************************/
+
+void ACORNSearchScratch::prepare(const ACORN& acorn) {
+    size_t n = 0;
+    for (size_t level = 0; level + 1 < acorn.cum_nneighbor_per_level.size();
+         level++) {
+        n = std::max(n, size_t(acorn.nb_neighbors(level)));
+    }
+    if (batch_ids.size() < n) {
+        batch_ids.resize(n);
+        batch_dis.resize(n);
+        buf0.resize(n);
+        buf1.resize(n);
+    }
+}
+
+/**************************************************************
+ * ACORNBuildScratch
+ **************************************************************/
+
+void ACORNBuildScratch::NeighborSet::clear(size_t n) {
+    size_t capacity = 16;
+    while (capacity < 2 * n) {
+        capacity *= 2;
+    }
+    if (keys.size() < capacity) {
+        keys.resize(capacity);
+        epochs.assign(capacity, 0);
+        epoch = 0;
+    }
+    epoch++;
+    if (epoch == 0) {
+        // wrapped around, tags of older epochs may collide
+        std::fill(epochs.begin(), epochs.end(), 0);
+        epoch = 1;
+    }
+    count = 0;
+}
+
+size_t ACORNBuildScratch::NeighborSet::slot(storage_idx_t id) const {
+    size_t mask = keys.size() - 1;
+    size_t i = (uint32_t(id) * 2654435761U) & mask;
+    while (epochs[i] == epoch && keys[i] != id) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+bool ACORNBuildScratch::NeighborSet::insert(storage_idx_t id) {
+    if (2 * (count + 1) > keys.size()) {
+        grow();
+    }
+    size_t i = slot(id);
+    if (epochs[i] == epoch) {
+        return false;
+    }
+    keys[i] = id;
+    epochs[i] = epoch;
+    count++;
+    return true;
+}
+
+bool ACORNBuildScratch::NeighborSet::contains(storage_idx_t id) const {
+    if (keys.empty()) {
+        return false;
+    }
+    return epochs[slot(id)] == epoch;
+}
+
+void ACORNBuildScratch::NeighborSet::grow() {
+    std::vector<storage_idx_t> ids;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (epochs[i] == epoch) {
+            ids.push_back(keys[i]);
+        }
+    }
+    keys.resize(std::max(keys.size() * 2, size_t(16)));
+    epochs.assign(keys.size(), 0);
+    epoch = 1;
+    count = 0;
+    for (storage_idx_t id : ids) {
+        insert(id);
+    }
+}
+
 /**************************************************************
  * ACORN structure implementation
  **************************************************************/
@@ -113,15 +279,85 @@ void ACORN::neighbor_range(idx_t no, int layer_no, size_t* begin, size_t* end)
         const {
     size_t o = offsets[no];
     // debug("offset o: %ld\n", o);
-    *begin = o + cum_nb_neighbors(layer_no);
+    int base = 0;
+    if (is_level0_compressed()) {
+        // the neighbors table starts at level 1
+        FAISS_THROW_IF_NOT_MSG(layer_no > 0, "level 0 is compressed");
+        base = cum_nb_neighbors(1);
+    }
+    *begin = o + cum_nb_neighbors(layer_no) - base;
     // debug("begin: %ln\n", begin);
-    *end = o + cum_nb_neighbors(layer_no + 1);
+    *end = o + cum_nb_neighbors(layer_no + 1) - base;
     // debug("end: %ln\n", end);
 }
 
+const ACORN::storage_idx_t* ACORN::get_neighbors(
+        idx_t no,
+        int layer_no,
+        storage_idx_t* buf,
+        size_t* n) const {
+    if (layer_no == 0 && is_level0_compressed()) {
+        *n = compressed_level0.decode(no, buf);
+        return buf;
+    }
+    size_t begin, end;
+    neighbor_range(no, layer_no, &begin, &end);
+    *n = end - begin;
+    return neighbors.data() + begin;
+}
+
+void ACORN::compress_level0() {
+    FAISS_THROW_IF_NOT_MSG(
+            !is_level0_compressed(), "level 0 is already compressed");
+    size_t n = levels.size();
+    if (n == 0) {
+        return;
+    }
+
+    // level 0 lists up to their first -1 entry
+    std::vector<size_t> begins(n + 1);
+    std::vector<storage_idx_t> ids;
+    begins[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t begin, end;
+        neighbor_range(i, 0, &begin, &end);
+        for (size_t j = begin; j < end && neighbors[j] >= 0; j++) {
+            ids.push_back(neighbors[j]);
+        }
+        begins[i + 1] = ids.size();
+    }
+
+    int nbits = 1;
+    while (nbits < 32 && (size_t(1) << nbits) < n) {
+        nbits++;
+    }
+
+    // levels >= 1 stay in the neighbors table
+    size_t n0 = cum_nb_neighbors(1);
+    std::vector<size_t> new_offsets(n + 1);
+    std::vector<NeighNode> new_neighbors;
+    new_offsets[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        new_neighbors.insert(
+                new_neighbors.end(),
+                neighbors.begin() + offsets[i] + n0,
+                neighbors.begin() + offsets[i + 1]);
+        new_offsets[i + 1] = new_neighbors.size();
+    }
+
+    compressed_level0.encode(n, begins.data(), ids.data(), nbits);
+    offsets = std::move(new_offsets);
+    neighbors = std::move(new_neighbors);
+}
+
+
 
+ACORN::ACORN(int M, int gamma, std::vector<int>& metadata, int M_beta)
+        : ACORN(M, gamma, M_beta) {
+    this->metadata = metadata.data();
+}
 
-ACORN::ACORN(int M, int gamma, std::vector<int>& metadata, int M_beta) : rng(12345) {
+ACORN::ACORN(int M, int gamma, int M_beta) : rng(12345), metadata(nullptr) {
     set_default_probas(M, 1.0 / log(M), M_beta, gamma);
     max_level = -1;
     entry_point = -1;
@@ -129,7 +365,6 @@ ACORN::ACORN(int M, int gamma, std::vector<int>& metadata, int M_beta) : rng(123
     efConstruction = M * gamma; //added gamma
     upper_beam = 1;
     this->gamma = gamma;
-    this->metadata = metadata.data();
     this->M = M;
     this->M_beta = M_beta;
     // gamma = gamma;
@@ -187,6 +422,11 @@ void ACORN::reset() {
     offsets.push_back(0);
     levels.clear();
     neighbors.clear();
+    compressed_level0.reset();
+    attributes.reset();
+    attribute_entry_points.clear();
+    deleted.clear();
+    ndeleted = 0;
 }
 
 
@@ -197,30 +437,37 @@ void ACORN::print_neighbor_stats(int level) const {
            nb_neighbors(level));
 
     size_t tot_neigh = 0, tot_common = 0, tot_reciprocal = 0, n_node = 0;
-#pragma omp parallel for reduction(+: tot_neigh) reduction(+: tot_common) \
+#pragma omp parallel reduction(+: tot_neigh) reduction(+: tot_common) \
   reduction(+: tot_reciprocal) reduction(+: n_node)
+    {
+    // the lists are read with get_neighbors, that decodes the compressed
+    // level 0
+    std::vector<storage_idx_t> buf(nb_neighbors(level)), buf2(buf.size());
+#pragma omp for
     for (int i = 0; i < levels.size(); i++) {
         if (levels[i] > level) {
             n_node++;
-            size_t begin, end;
-            neighbor_range(i, level, &begin, &end);
+            size_t nn;
+            const storage_idx_t* neigh =
+                    get_neighbors(i, level, buf.data(), &nn);
             std::unordered_set<int> neighset;
-            for (size_t j = begin; j < end; j++) {
-                if (neighbors[j] < 0) // mod
+            for (size_t j = 0; j < nn; j++) {
+                if (neigh[j] < 0) // mod
                     break;
-                neighset.insert(neighbors[j]); // mod
+                neighset.insert(neigh[j]); // mod
             }
             int n_neigh = neighset.size();
             int n_common = 0;
             int n_reciprocal = 0;
-            for (size_t j = begin; j < end; j++) {
-                storage_idx_t i2 = neighbors[j]; // mod
+            for (size_t j = 0; j < nn; j++) {
+                storage_idx_t i2 = neigh[j]; // mod
                 if (i2 < 0)
                     break;
-                size_t begin2, end2;
-                neighbor_range(i2, level, &begin2, &end2);
-                for (size_t j2 = begin2; j2 < end2; j2++) {
-                    storage_idx_t i3 = neighbors[j2];  //mod
+                size_t nn2;
+                const storage_idx_t* neigh2 =
+                        get_neighbors(i2, level, buf2.data(), &nn2);
+                for (size_t j2 = 0; j2 < nn2; j2++) {
+                    storage_idx_t i3 = neigh2[j2];  //mod
                     if (i3 < 0)
                         break;
                     if (i3 == i) {
@@ -238,6 +485,7 @@ void ACORN::print_neighbor_stats(int level) const {
             tot_reciprocal += n_reciprocal;
         }
     }
+    }
     float normalizer = n_node;
     printf("   1. nb of nodes: %zd\n", n_node);
     printf("   2. neighbors per node: %.2f (%zd)\n",
@@ -259,35 +507,40 @@ void ACORN::print_edges(int level) const {
            nb_neighbors(level));
 
     size_t tot_neigh = 0, tot_common = 0, tot_reciprocal = 0, n_node = 0;
+    std::vector<storage_idx_t> buf(nb_neighbors(level)), buf2(buf.size());
     printf("\t edges lists:\n");
-//#pragma omp parallel for reduction(+: tot_neigh) reduction(+: tot_common) \
-  reduction(+: tot_reciprocal) reduction(+: n_node)
     for (int i = 0; i < levels.size(); i++) {
         if (levels[i] > level) {
             n_node++;
-            size_t begin, end;
-            neighbor_range(i, level, &begin, &end);
+            size_t nn;
+            const storage_idx_t* neigh =
+                    get_neighbors(i, level, buf.data(), &nn);
             std::unordered_set<int> neighset;
             printf("\t\t %d: [", i);
-            for (size_t j = begin; j < end; j++) {
-                if (neighbors[j] < 0) // mod
+            for (size_t j = 0; j < nn; j++) {
+                if (neigh[j] < 0) // mod
                     break;
-                printf("%d(%d), ", neighbors[j], metadata[neighbors[j]]); // mod
-                neighset.insert(neighbors[j]); // mod
+                if (metadata) {
+                    printf("%d(%d), ", neigh[j], metadata[neigh[j]]); // mod
+                } else {
+                    printf("%d, ", neigh[j]);
+                }
+                neighset.insert(neigh[j]); // mod
             }
             printf("]\n");
             int n_neigh = neighset.size();
             int n_common = 0;
             int n_reciprocal = 0;
-            for (size_t j = begin; j < end; j++) {
-                storage_idx_t i2 = neighbors[j]; //mod
+            for (size_t j = 0; j < nn; j++) {
+                storage_idx_t i2 = neigh[j]; //mod
                 if (i2 < 0)
                     break;
                 FAISS_ASSERT(i2 != i);
-                size_t begin2, end2;
-                neighbor_range(i2, level, &begin2, &end2);
-                for (size_t j2 = begin2; j2 < end2; j2++) {
-                    storage_idx_t i3 = neighbors[j2]; // mod
+                size_t nn2;
+                const storage_idx_t* neigh2 =
+                        get_neighbors(i2, level, buf2.data(), &nn2);
+                for (size_t j2 = 0; j2 < nn2; j2++) {
+                    storage_idx_t i3 = neigh2[j2]; // mod
                     if (i3 < 0)
                         break;
                     if (i3 == i) {
@@ -323,51 +576,48 @@ void ACORN::print_edges(int level) const {
 // same as print_neighbor_stats with additional edge lists printed according to filter
 void ACORN::print_edges_filtered(int level, int filter, Operation op) const {
     FAISS_THROW_IF_NOT(level < cum_nneighbor_per_level.size());
+    FAISS_THROW_IF_NOT_MSG(metadata, "the filtered edge lists need metadata");
     printf("* stats on level %d, max %d neighbors per vertex:\n",
            level,
            nb_neighbors(level));
 
     size_t tot_neigh = 0, tot_common = 0, tot_reciprocal = 0, n_node = 0;
+    std::vector<storage_idx_t> buf(nb_neighbors(level)), buf2(buf.size());
     printf("\t edges lists:\n");
-//#pragma omp parallel for reduction(+: tot_neigh) reduction(+: tot_common) \
-  reduction(+: tot_reciprocal) reduction(+: n_node)
     for (int i = 0; i < levels.size(); i++) {
         if (levels[i] > level) {   
             if (((op == EQUAL) && (metadata[i] == filter)) || (op == OR && ((metadata[i] & filter) != 0))) {
-            // if (metadata[i] == filter) {
                 n_node++;
-                size_t begin, end;
-                neighbor_range(i, level, &begin, &end);
+                size_t nn;
+                const storage_idx_t* neigh =
+                        get_neighbors(i, level, buf.data(), &nn);
                 std::unordered_set<int> neighset;
                 printf("\t\t %d (%d): [", i, metadata[i]);
 
-                for (size_t j = begin; j < end; j++) {
-                    if (neighbors[j] < 0) // mod
+                for (size_t j = 0; j < nn; j++) {
+                    if (neigh[j] < 0) // mod
                         break;
-                    if (((op == EQUAL) && (metadata[neighbors[j]] == filter)) || (op == OR && ((metadata[neighbors[j]] & filter) != 0))) {
-                    // if (neighbors[j].second == filter) {
-                        printf("%d(%d), ", neighbors[j], metadata[neighbors[j]]); // mod
-                        neighset.insert(neighbors[j]); // mod
+                    if (((op == EQUAL) && (metadata[neigh[j]] == filter)) || (op == OR && ((metadata[neigh[j]] & filter) != 0))) {
+                        printf("%d(%d), ", neigh[j], metadata[neigh[j]]); // mod
+                        neighset.insert(neigh[j]); // mod
                     }
                 }
-                // if (metadata[i] == filter) {
-                //     printf("]\n");
-                // }
                 printf("]\n");
 
 
                 int n_neigh = neighset.size();
                 int n_common = 0;
                 int n_reciprocal = 0;
-                for (size_t j = begin; j < end; j++) {
-                    storage_idx_t i2 = neighbors[j]; //mod
+                for (size_t j = 0; j < nn; j++) {
+                    storage_idx_t i2 = neigh[j]; //mod
                     if (i2 < 0)
                         break;
                     FAISS_ASSERT(i2 != i);
-                    size_t begin2, end2;
-                    neighbor_range(i2, level, &begin2, &end2);
-                    for (size_t j2 = begin2; j2 < end2; j2++) {
-                        storage_idx_t i3 = neighbors[j2]; // mod
+                    size_t nn2;
+                    const storage_idx_t* neigh2 =
+                            get_neighbors(i2, level, buf2.data(), &nn2);
+                    for (size_t j2 = 0; j2 < nn2; j2++) {
+                        storage_idx_t i3 = neigh2[j2]; // mod
                         if (i3 < 0)
                             break;
                         if (i3 == i) {
@@ -523,19 +773,98 @@ int ACORN::prepare_level_tab(size_t n, bool preset_levels) {
     return max_level;
 }
 
+void ACORN::set_attribute_entry_points(
+        const ACORNAttributeColumn& col,
+        size_t max_values) {
+    size_t n = std::min(col.size(), levels.size());
+    // value -> (nb of vertices, vertex of highest level)
+    std::unordered_map<int32_t, std::pair<size_t, storage_idx_t>> stats;
+    auto add_value = [&](int32_t v, storage_idx_t i) {
+        auto it = stats.find(v);
+        if (it == stats.end()) {
+            stats[v] = std::make_pair(size_t(1), i);
+        } else {
+            it->second.first++;
+            if (levels[i] > levels[it->second.second]) {
+                it->second.second = i;
+            }
+        }
+    };
+    for (size_t i = 0; i < n; i++) {
+        if (is_deleted(i)) {
+            continue;
+        }
+        if (col.type == ATTR_INT) {
+            add_value(col.values[i], i);
+        } else {
+            for (size_t j = col.lims[i]; j < col.lims[i + 1]; j++) {
+                add_value(col.values[j], i);
+            }
+        }
+    }
+
+    // most frequent values first
+    std::vector<std::pair<size_t, storage_idx_t>> eps;
+    eps.reserve(stats.size());
+    for (const auto& it : stats) {
+        eps.push_back(it.second);
+    }
+    size_t nkeep = std::min(max_values, eps.size());
+    std::partial_sort(
+            eps.begin(),
+            eps.begin() + nkeep,
+            eps.end(),
+            [](const std::pair<size_t, storage_idx_t>& a,
+               const std::pair<size_t, storage_idx_t>& b) {
+                return a.first > b.first ||
+                        (a.first == b.first && a.second < b.second);
+            });
+
+    attribute_entry_points.clear();
+    for (size_t j = 0; j < nkeep; j++) {
+        attribute_entry_points.push_back(eps[j].second);
+    }
+    std::sort(attribute_entry_points.begin(), attribute_entry_points.end());
+    attribute_entry_points.erase(
+            std::unique(
+                    attribute_entry_points.begin(),
+                    attribute_entry_points.end()),
+            attribute_entry_points.end());
+}
+
+void ACORN::reserve(size_t n) {
+    // expected nb of links per vector, with a margin for the variance of
+    // the random levels
+    double links_per_vector = 0;
+    for (size_t level = 0; level < assign_probas.size(); level++) {
+        links_per_vector += assign_probas[level] * cum_nb_neighbors(level + 1);
+    }
+    size_t n_add = n > levels.size() ? n - levels.size() : 0;
+    size_t nlinks = neighbors.size() + size_t(n_add * links_per_vector * 1.01) +
+            cum_nb_neighbors(assign_probas.size());
+    levels.reserve(n);
+    offsets.reserve(n + 1);
+    neighbors.reserve(nlinks);
+}
+
 /** Enumerate vertices from farthest to nearest from query, keep a
  * neighbor only if there is no previous neighbor that is closer to
  * that vertex than the query.
  */
 void ACORN::shrink_neighbor_list(
-        DistanceComputer& qdis,
         std::priority_queue<NodeDistFarther>& input,
         std::vector<NodeDistFarther>& output,
-        int max_size, int gamma, storage_idx_t q_id, int q_attr) {
+        int max_size, int gamma,
+        ACORNBuildScratch* scratch) {
 
     debug("shrink_neighbor_list: input size: %ld, max_size: %d, gamma: %d\n", input.size(), max_size, gamma);
+    ACORNBuildScratch local_scratch;
+    if (!scratch) {
+        scratch = &local_scratch;
+    }
     // new pruning method which removes neighbors are in an existing neighbors neighborhood
-    std::unordered_set<storage_idx_t> neigh_of_neigh;
+    ACORNBuildScratch::NeighborSet& neigh_of_neigh = scratch->neigh_of_neigh;
+    neigh_of_neigh.clear(max_size + nb_neighbors(0));
         // for (const NodeDistFarther& node : output) {
         //     outputSet.insert(node.id);
         // }
@@ -546,13 +875,12 @@ void ACORN::shrink_neighbor_list(
 
         NodeDistFarther v1 = input.top();
         input.pop();
-        float dist_v1_q = v1.d;
 
         debug("shrink_neighbor_list: checking whether to keep v1: %d\n", v1.id);
         bool good = true;
 
         // check if current candidate is in the neighbors of output 
-        if (node_num > this->M_beta  && neigh_of_neigh.count(v1.id) > 0) {
+        if (node_num > this->M_beta  && neigh_of_neigh.contains(v1.id)) {
             good = false;
             debug("PRUNE v1: %d\n", v1.id);
         }
@@ -604,29 +932,94 @@ using storage_idx_t = ACORN::storage_idx_t;
 using NodeDistCloser = ACORN::NodeDistCloser;
 using NodeDistFarther = ACORN::NodeDistFarther;
 
+/// hint that the neighbor list of node no at this level will be read soon
+void prefetch_neighbor_list(
+        const ACORN& hnsw,
+        storage_idx_t no,
+        int level) {
+    if (!hnsw.use_prefetch) {
+        return;
+    }
+    if (level == 0 && hnsw.is_level0_compressed()) {
+        hnsw.compressed_level0.prefetch(no);
+        return;
+    }
+    size_t begin, end;
+    hnsw.neighbor_range(no, level, &begin, &end);
+    prefetch_L2(hnsw.neighbors.data() + begin);
+}
+
+/// distances from the query to ids[0:n], 4 at a time so that the
+/// DistanceComputer can interleave the memory accesses
+template <class DC>
+void batch_distances(
+        DC& qdis,
+        size_t n,
+        const storage_idx_t* ids,
+        float* dis) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        qdis.distances_batch_4(
+                ids[i],
+                ids[i + 1],
+                ids[i + 2],
+                ids[i + 3],
+                dis[i],
+                dis[i + 1],
+                dis[i + 2],
+                dis[i + 3]);
+    }
+    for (; i < n; i++) {
+        dis[i] = qdis(ids[i]);
+    }
+}
+
+/** Calls f(dc), where dc is qdis downcast to its concrete type if it is
+ * one of the distance computers of ACORNDistanceComputers.h, so that the
+ * routines instantiated by f call the distance functions directly. This
+ * is the only dynamic dispatch on the distance computer, it is done once
+ * per query or per added vector. */
+template <class F>
+auto with_concrete_distance_computer(DistanceComputer& qdis, const F& f)
+        -> decltype(f(qdis)) {
+    if (auto dc = dynamic_cast<ACORNFlatL2Dis*>(&qdis)) {
+        return f(*dc);
+    }
+    if (auto dc = dynamic_cast<ACORNFlatNegIPDis*>(&qdis)) {
+        return f(*dc);
+    }
+    return f(qdis);
+}
+
 /**************************************************************
  * Addition subroutines
  **************************************************************/
 
+/// the locks are striped: vertex id is protected by locks[id % nlocks]
+omp_lock_t& vertex_lock(std::vector<omp_lock_t>& locks, storage_idx_t id) {
+    return locks[id % locks.size()];
+}
+
 /// remove neighbors from the list to make it smaller than max_size
 void shrink_neighbor_list(
-        DistanceComputer& qdis,
         std::priority_queue<NodeDistCloser>& resultSet1,
-        int max_size, int gamma, storage_idx_t q_id, int q_attr, ACORN& hnsw) {
+        int max_size, int gamma, ACORN& hnsw,
+        ACORNBuildScratch& scratch) {
     debug("shrink_neighbor_list from size %ld, to max size %d\n", resultSet1.size(), max_size);
     // if (resultSet1.size() < max_size) {
     //     return;
     // }
-    std::priority_queue<NodeDistFarther> resultSet;
-    std::vector<NodeDistFarther> returnlist;
+    ACORNBuildScratch::Queue<NodeDistFarther>& resultSet = scratch.shrink_input;
+    std::vector<NodeDistFarther>& returnlist = scratch.shrink_output;
+    resultSet.clear();
+    returnlist.clear();
 
     while (resultSet1.size() > 0) {
         resultSet.emplace(resultSet1.top().d, resultSet1.top().id);
         resultSet1.pop();
     }
 
-    // ACORN::shrink_neighbor_list(qdis, resultSet, returnlist, max_size, gamma, q_id, q_attr);
-    hnsw.shrink_neighbor_list(qdis, resultSet, returnlist, max_size, gamma, q_id, q_attr);
+    hnsw.shrink_neighbor_list(resultSet, returnlist, max_size, gamma, &scratch);
 
 
     for (NodeDistFarther curen2 : returnlist) {
@@ -637,12 +1030,14 @@ void shrink_neighbor_list(
 // modified from normal hnsw
 /// add a link between two elements, possibly shrinking the list
 /// of links to make room for it.
+template <class DC>
 void add_link(
         ACORN& hnsw,
-        DistanceComputer& qdis,
+        DC& qdis,
         storage_idx_t src,
         storage_idx_t dest,
-        int level) {
+        int level,
+        ACORNBuildScratch& scratch) {
     size_t begin, end;
     hnsw.neighbor_range(src, level, &begin, &end);
     if (hnsw.neighbors[end - 1] == -1) { // mood
@@ -662,13 +1057,14 @@ void add_link(
     // otherwise we let them fight out which to keep
 
     // copy to resultSet...
-    std::priority_queue<NodeDistCloser> resultSet;
+    ACORNBuildScratch::Queue<NodeDistCloser>& resultSet =
+            scratch.link_candidates;
+    resultSet.clear();
     resultSet.emplace(qdis.symmetric_dis(src, dest), dest);
     for (size_t i = begin; i < end; i++) { // HERE WAS THE BUG
         // storage_idx_t neigh = hnsw.neighbors[i];
         // auto [neigh, metadata] = hnsw.neighbors[i]; // mod
         auto neigh = hnsw.neighbors[i];
-        auto metadata = hnsw.metadata[neigh];
         resultSet.emplace(qdis.symmetric_dis(src, neigh), neigh);
     }
 
@@ -676,8 +1072,13 @@ void add_link(
     debug("calling shrink neigbor list, src: %d, dest: %d, level: %d\n", src, dest, level);
     
     if (level == 0) {
-        shrink_neighbor_list(qdis, resultSet, end - begin, hnsw.gamma, src, hnsw.metadata[src], hnsw);
+        shrink_neighbor_list(resultSet, end - begin, hnsw.gamma, hnsw, scratch);
 
+    } else {
+        // drop the farthest so that the list fits in its slots
+        while (resultSet.size() > end - begin) {
+            resultSet.pop();
+        }
     }
     
     
@@ -700,18 +1101,20 @@ void add_link(
 // modified from normal hnsw
 /// search neighbors on a single level, starting from an entry point
 // this only gets called in construction
+template <class DC>
 void search_neighbors_to_add(
         ACORN& hnsw,
-        DistanceComputer& qdis,
+        DC& qdis,
         std::priority_queue<NodeDistCloser>& results,
         int entry_point,
         float d_entry_point,
         int level,
         VisitedTable& vt,
-        std::vector<storage_idx_t> ep_per_level = {}) {
+        ACORNBuildScratch& scratch) {
     debug("search_neighbors to add, entrypoint: %d\n", entry_point);
     // top is nearest candidate
-    std::priority_queue<NodeDistFarther> candidates;
+    ACORNBuildScratch::Queue<NodeDistFarther>& candidates = scratch.candidates;
+    candidates.clear();
 
     NodeDistFarther ev(d_entry_point, entry_point);
     candidates.push(ev);
@@ -732,6 +1135,13 @@ void search_neighbors_to_add(
 
     int backtrack_level = level;
 
+    // unvisited neighbors of the current node, their vectors are prefetched
+    // while the list is collected
+    std::vector<storage_idx_t>& batch_ids = scratch.batch_ids;
+    std::vector<float>& batch_dis = scratch.batch_dis;
+    batch_ids.resize(hnsw.nb_neighbors(level));
+    batch_dis.resize(batch_ids.size());
+
     while (!candidates.empty()) {
         // get nearest
         const NodeDistFarther& currEv = candidates.top();
@@ -750,11 +1160,18 @@ void search_neighbors_to_add(
         
         int numIters = 0;
 
+        for (size_t i = begin; hnsw.use_prefetch && i < end; i++) {
+            auto nodeId = hnsw.neighbors[i];
+            if (nodeId < 0)
+                break;
+            vt.prefetch(nodeId);
+        }
+
         debug("checking neighbors of %d\n", currNode);
+        size_t nbatch = 0;
         for (size_t i = begin; i < end; i++) {
             // auto [nodeId, metadata] = hnsw.neighbors[i]; // storage_idx_t, int
             auto nodeId = hnsw.neighbors[i];
-            auto metadata = hnsw.metadata[nodeId];
             // storage_idx_t nodeId = hnsw.neighbors[i];
             if (nodeId < 0)
                 break;
@@ -768,8 +1185,23 @@ void search_neighbors_to_add(
                 break;
             }
 
-            float dis = qdis(nodeId);
-            NodeDistFarther evE1(dis, nodeId);
+            if (hnsw.use_prefetch) {
+                qdis.prefetch(nodeId);
+            }
+            batch_ids[nbatch++] = nodeId;
+
+            // limit number neighbors visisted during construciton
+            numIters = numIters + 1;
+            if (numIters > hnsw.M) {
+                break;
+            }
+        }
+
+        batch_distances(qdis, nbatch, batch_ids.data(), batch_dis.data());
+
+        for (size_t i = 0; i < nbatch; i++) {
+            storage_idx_t nodeId = batch_ids[i];
+            float dis = batch_dis[i];
 
             // debug("while checking neighbors of %d, efc: %d, results size: %ld, just visited %d\n", currNode, hnsw.efConstruction, results.size(), nodeId);
             if (results.size() < hnsw.efConstruction || results.top().d > dis) {
@@ -780,16 +1212,11 @@ void search_neighbors_to_add(
                 }
             }
             debug("while checking neighbors of %d, just visited %d -- efc: %d, results size: %ld, candidates size: %ld, \n", currNode, nodeId, hnsw.efConstruction, results.size(), candidates.size());
+        }
 
-            
-
-            // limit number neighbors visisted during construciton
-            numIters = numIters + 1;
-            if (numIters > hnsw.M) {
-                break;
-            }
-
-        
+        // the nearest candidate is expanded next
+        if (!candidates.empty()) {
+            prefetch_neighbor_list(hnsw, candidates.top().id, level);
         }
         
         debug("during BFS, gamma: %d, candidates size: %ld, results size: %ld, vt.num_visited: %d, nb on level: %d, backtrack_level: %d, level: %d\n", hnsw.gamma, candidates.size(), results.size(), vt.num_visited(), hnsw.nb_per_level[level], backtrack_level, level);
@@ -808,9 +1235,10 @@ void search_neighbors_to_add(
 
 /// greedily update a nearest vector at a given level
 /// used for construction (other version below will be used in search)
+template <class DC>
 void greedy_update_nearest(
         const ACORN& hnsw,
-        DistanceComputer& qdis,
+        DC& qdis,
         int level,
         storage_idx_t& nearest,
         float& d_nearest) {
@@ -824,9 +1252,18 @@ void greedy_update_nearest(
         
         int numIters = 0;
 
+        size_t end_prefetch =
+                hnsw.use_prefetch ? std::min(end, begin + hnsw.M) : begin;
+        for (size_t i = begin; i < end_prefetch; i++) {
+            auto v = hnsw.neighbors[i];
+            if (v < 0) {
+                break;
+            }
+            qdis.prefetch(v);
+        }
+
         for (size_t i = begin; i < end; i++) {
             auto v = hnsw.neighbors[i];
-            auto metadata = hnsw.metadata[v];
             if (v < 0) {
                 break;
             }
@@ -850,20 +1287,165 @@ void greedy_update_nearest(
 }
 
 
+/**************************************************************
+ * Instrumentation of hybrid search
+ *
+ * hybrid_search_from_candidates takes the timer as a policy. The default
+ * one times the loops only when the library is compiled with
+ * FAISS_ACORN_PROFILING (cmake option of the same name). Otherwise it is
+ * empty and compiles to nothing, so there is no gettimeofday call in the
+ * search loops.
+ **************************************************************/
+
+/// accumulates wall-clock time between start() and stop()
+struct WallClockTimer {
+    double t0 = 0;
+
+    void start() {
+        t0 = elapsed();
+    }
+
+    void stop(double& total) const {
+        total += elapsed() - t0;
+    }
+};
+
+struct NoTimer {
+    void start() {}
+
+    void stop(double&) const {}
+};
+
+#ifdef FAISS_ACORN_PROFILING
+using SearchTimer = WallClockTimer;
+#else
+using SearchTimer = NoTimer;
+#endif
+
+/**************************************************************
+ * Filters for hybrid search
+ *
+ * The hybrid search routines are templated on a filter functor so
+ * that the membership test is inlined in the traversal loops. A
+ * filter only has to answer for the nodes the traversal touches, so
+ * its memory is independent of the number of queries. prefetch(i) is
+ * a hint that the test for node i comes soon.
+ **************************************************************/
+
+/// one byte per stored vector (legacy char* interface)
+struct CharMapFilter {
+    const char* filter_map;
+
+    explicit CharMapFilter(const char* filter_map) : filter_map(filter_map) {}
+
+    bool operator()(idx_t i) const {
+        return filter_map[i];
+    }
+
+    void prefetch(idx_t i) const {
+        prefetch_L2(filter_map + i);
+    }
+};
+
+/// packed bitmap, same layout as IDSelectorBitmap
+struct BitmapFilter {
+    size_t n;
+    const uint8_t* bitmap;
+
+    explicit BitmapFilter(const IDSelectorBitmap* sel)
+            : n(sel->n), bitmap(sel->bitmap) {}
+
+    bool operator()(idx_t i) const {
+        return size_t(i >> 3) < n && ((bitmap[i >> 3] >> (i & 7)) & 1);
+    }
+
+    void prefetch(idx_t i) const {
+        prefetch_L2(bitmap + (i >> 3));
+    }
+};
+
+/// contiguous range of ids, as in IDSelectorRange
+struct RangeFilter {
+    idx_t imin, imax;
+
+    explicit RangeFilter(const IDSelectorRange* sel)
+            : imin(sel->imin), imax(sel->imax) {}
+
+    bool operator()(idx_t i) const {
+        return i >= imin && i < imax;
+    }
+
+    void prefetch(idx_t) const {}
+};
+
+/// exact match on a scalar attribute column
+struct AttributeEqualFilter {
+    const int32_t* values;
+    int32_t value;
+
+    explicit AttributeEqualFilter(const IDSelectorAttributeEqual* sel)
+            : values(sel->column->values.data()), value(sel->value) {}
+
+    bool operator()(idx_t i) const {
+        return values[i] == value;
+    }
+
+    void prefetch(idx_t i) const {
+        prefetch_L2(values + i);
+    }
+};
+
+/// range on a scalar attribute column
+struct AttributeRangeFilter {
+    const int32_t* values;
+    int32_t vmin, vmax;
+
+    explicit AttributeRangeFilter(const IDSelectorAttributeRange* sel)
+            : values(sel->column->values.data()),
+              vmin(sel->vmin),
+              vmax(sel->vmax) {}
+
+    bool operator()(idx_t i) const {
+        return values[i] >= vmin && values[i] <= vmax;
+    }
+
+    void prefetch(idx_t i) const {
+        prefetch_L2(values + i);
+    }
+};
+
+/// any other IDSelector (sorted id list, set attributes, conjunctions...):
+/// one virtual call per test
+struct SelectorFilter {
+    const IDSelector* sel;
+
+    explicit SelectorFilter(const IDSelector* sel) : sel(sel) {}
+
+    bool operator()(idx_t i) const {
+        return sel->is_member(i);
+    }
+
+    void prefetch(idx_t) const {}
+};
+
 /// for hybrid search only
+template <class Filter, class DC>
 int hybrid_greedy_update_nearest(
         const ACORN& hnsw,
-        DistanceComputer& qdis,
-        char* filter_map,
-        // int filter,
-        // Operation op,
-        // std::string regex,
+        DC& qdis,
+        const Filter& filter,
         int level,
         storage_idx_t& nearest,
-        float& d_nearest) {
+        float& d_nearest,
+        ACORNSearchScratch& scratch) {
     debug("%s\n", "reached"); 
     // printf("hybrid_greedy_update_nearest called with parameters: filter: %d, op: %d, regex: %s, level: %d\n", filter, op, regex.c_str(), level);
     int ndis = 0;
+
+    // two-hop neighbors of one node that pass the filter
+    storage_idx_t* batch_ids = scratch.batch_ids.data();
+    float* batch_dis = scratch.batch_dis.data();
+
     for (;;) {
         int num_found = 0;
         storage_idx_t prev_nearest = nearest;
@@ -872,26 +1454,23 @@ int hybrid_greedy_update_nearest(
         size_t begin, end;
         hnsw.neighbor_range(nearest, level, &begin, &end);
         debug_search("%s", "--------checking neighbors: \n");
-        
-        // for debugging, collect all neighbors looked at in a vector
-        std::vector<std::pair<storage_idx_t, int>> neighbors_checked;
-        bool keep_expanding = true;
 
+        for (size_t i = begin; hnsw.use_prefetch && i < end; i++) {
+            auto v = hnsw.neighbors[i];
+            if (v < 0)
+                break;
+            filter.prefetch(v);
+        }
+        
         for (size_t i = begin; i < end; i++) {
             auto v = hnsw.neighbors[i];
             
             if (v < 0)
                 break;
-                
-            // note that this slows down search significantly but can be useful for debugging
-            // if (debugSearchFlag) {
-            //     neighbors_checked.push_back(std::make_pair(v, metadata)); 
-            //     debug_search("------------checking neighbor: %d, metadata: %d, metadata & filter: %d\n", v, metadata, metadata & filter);
-            // }
 
             // filter
             // printf("---at first filter: op: %d, metadata: %s, regex: %s, check_regex result: %d\n", op, hnsw.metadata_strings[v].c_str(), regex.c_str(), CHECK_REGEX(hnsw.metadata_strings[v], regex));
-            if (filter_map[v]) {
+            if (filter(v)) {
                 num_found = num_found + 1;
             } else {
                 // not filter & gamma > 1
@@ -904,11 +1483,11 @@ int hybrid_greedy_update_nearest(
         
             
             // check if filter pass
-            if (filter_map[v]) {
+            if (filter(v)) {
     
                 float dis = qdis(v);
                 ndis += 1;
-                if (dis < d_nearest || !filter_map[nearest]) {
+                if (dis < d_nearest || !filter(nearest)) {
                 
                     nearest = v;
                     d_nearest = dis;
@@ -926,6 +1505,7 @@ int hybrid_greedy_update_nearest(
             if (hnsw.gamma == 1) {
                 size_t begin2, end2;
                 hnsw.neighbor_range(v, level, &begin2, &end2);
+                size_t nbatch = 0;
                 for (size_t j = begin2; j < end2; j++) {
                     auto v2 = hnsw.neighbors[j];
                    
@@ -935,23 +1515,29 @@ int hybrid_greedy_update_nearest(
 
 
                     // check filter pass
-                    if (filter_map[v2]) {
+                    if (filter(v2)) {
                         num_found = num_found + 1;
-                        float dis2 = qdis(v2);
-                        ndis += 1;
-                        // debug_search("------------found: %d, metadata: %d distance to v: %f\n", v2, metadata2, dis2);
-          
-                        if (dis2 < d_nearest || !filter_map[nearest]) {
-                            nearest = v2;
-                            d_nearest = dis2;
-                            // debug_search("----------------new nearest: %d, d_nearest: %f\n", nearest, d_nearest);
+                        if (hnsw.use_prefetch) {
+                            qdis.prefetch(v2);
                         }
+                        batch_ids[nbatch++] = v2;
                         if (num_found >= hnsw.M) {
                             break;
                         }
                     } 
                    
                 }
+
+                batch_distances(qdis, nbatch, batch_ids, batch_dis);
+                ndis += nbatch;
+                for (size_t j = 0; j < nbatch; j++) {
+                    float dis2 = batch_dis[j];
+                    if (dis2 < d_nearest || !filter(nearest)) {
+                        nearest = batch_ids[j];
+                        d_nearest = dis2;
+                        // debug_search("----------------new nearest: %d, d_nearest: %f\n", nearest, d_nearest);
+                    }
+                }
             }
         }       
 
@@ -962,29 +1548,51 @@ int hybrid_greedy_update_nearest(
     return ndis;
 }
 
-} // namespace
-
 // modified from normal hnsw
-void ACORN::add_links_starting_from(
-        DistanceComputer& ptdis,
+template <class DC>
+void add_links_starting_from_impl(
+        ACORN& hnsw,
+        DC& ptdis,
         storage_idx_t pt_id,
         storage_idx_t nearest,
         float d_nearest,
         int level,
-        omp_lock_t* locks,
+        std::vector<omp_lock_t>& locks,
         VisitedTable& vt,
-        std::vector<storage_idx_t> ep_per_level) {
+        ACORNBuildScratch* scratch) {
     debug("add_links_starting_from at level: %d, nearest: %d\n", level, nearest);
-    std::priority_queue<NodeDistCloser> link_targets;
+    ACORNBuildScratch local_scratch;
+    if (!scratch) {
+        scratch = &local_scratch;
+    }
+    ACORNBuildScratch::Queue<NodeDistCloser>& link_targets =
+            scratch->link_targets;
+    link_targets.clear();
 
     search_neighbors_to_add(
-            *this, ptdis, link_targets, nearest, d_nearest, level, vt, ep_per_level); // mod
+            hnsw, ptdis, link_targets, nearest, d_nearest, level, vt, *scratch); // mod
+
+    if (hnsw.ndeleted > 0) {
+        // removed vectors are traversed but not linked to
+        ACORNBuildScratch::Queue<NodeDistCloser>& kept =
+                scratch->link_candidates;
+        kept.clear();
+        for (; !link_targets.empty(); link_targets.pop()) {
+            if (!hnsw.is_deleted(link_targets.top().id)) {
+                kept.push(link_targets.top());
+            }
+        }
+        std::swap(link_targets, kept);
+        if (link_targets.empty()) {
+            return;
+        }
+    }
 
     // added update nearest
     nearest = link_targets.top().id;
 
     // but we can afford only this many neighbors
-    int M = nb_neighbors(level);
+    int M = hnsw.nb_neighbors(level);
 
     debug("add_links_starting_from will shrink results list to size: %d\n", M);
 
@@ -992,29 +1600,43 @@ void ACORN::add_links_starting_from(
     debug("calling shrink neigbor list, pt_id: %d, level: %d\n", pt_id, level);
 
     if (level == 0) {
-        ::faiss::shrink_neighbor_list(ptdis, link_targets, M, gamma, pt_id, this->metadata[pt_id], *this);
+        shrink_neighbor_list(link_targets, M, hnsw.gamma, hnsw, *scratch);
         // printf("shrunk");
     }
     
     
     debug("add_links_starting_from gets edge link size: %ld\n", link_targets.size());
 
-    std::vector<storage_idx_t> neighbors;
-    neighbors.reserve(link_targets.size());
+    std::vector<storage_idx_t>& neighbors = scratch->linked;
+    neighbors.clear();
     while (!link_targets.empty()) {
         storage_idx_t other_id = link_targets.top().id;
-        add_link(*this, ptdis, pt_id, other_id, level); // mod
+        add_link(hnsw, ptdis, pt_id, other_id, level, *scratch); // mod
         neighbors.push_back(other_id);
         link_targets.pop();
     }
 
-    omp_unset_lock(&locks[pt_id]);
-    for (storage_idx_t other_id : neighbors) {
-        omp_set_lock(&locks[other_id]);
-        add_link(*this, ptdis, other_id, pt_id, level); // mod
-        omp_unset_lock(&locks[other_id]);
+    omp_unset_lock(&vertex_lock(locks, pt_id));
+
+    // reverse links, grouped by lock so that each lock is taken once
+    size_t nlocks = locks.size();
+    std::sort(
+            neighbors.begin(),
+            neighbors.end(),
+            [nlocks](storage_idx_t a, storage_idx_t b) {
+                return a % nlocks < b % nlocks;
+            });
+    for (size_t i = 0; i < neighbors.size();) {
+        omp_lock_t& lock = vertex_lock(locks, neighbors[i]);
+        omp_set_lock(&lock);
+        do {
+            add_link(hnsw, ptdis, neighbors[i], pt_id, level, *scratch); // mod
+            i++;
+        } while (i < neighbors.size() &&
+                 &vertex_lock(locks, neighbors[i]) == &lock);
+        omp_unset_lock(&lock);
     }
-    omp_set_lock(&locks[pt_id]);
+    omp_set_lock(&vertex_lock(locks, pt_id));
 }
 
 
@@ -1023,66 +1645,492 @@ void ACORN::add_links_starting_from(
  * Building, parallel
  **************************************************************/
 // mod compared to original hnsnw
-void ACORN::add_with_locks(
-        DistanceComputer& ptdis,
+template <class DC>
+void add_with_locks_impl(
+        ACORN& hnsw,
+        DC& ptdis,
         int pt_level,
         int pt_id,
         std::vector<omp_lock_t>& locks,
-        VisitedTable& vt) {
+        VisitedTable& vt,
+        ACORNBuildScratch* scratch) {
     //  greedy search on upper levels
     debug("add_with_locks called for node %d, level %d\n", pt_id, pt_level);
 
 
-    storage_idx_t nearest;
-#pragma omp critical
-    {
-        nearest = entry_point;
+    // the entry point is set by the first vertex, that is added before
+    // the parallel loop, so it can be read without a critical section
+    storage_idx_t nearest = hnsw.entry_point;
 
-        if (nearest == -1) {
-            max_level = pt_level;
-            entry_point = pt_id;
-            for (int i=0; i <= max_level; i++){
-                nb_per_level[i] = nb_per_level[i] + 1;
-            }
-            
+    if (nearest == -1) {
+        hnsw.max_level = pt_level;
+        hnsw.entry_point = pt_id;
+        for (int i=0; i <= hnsw.max_level; i++){
+            hnsw.nb_per_level[i] = hnsw.nb_per_level[i] + 1;
         }
+        return;
     }
 
-    if (nearest < 0) {
-        return;
+    ACORNBuildScratch local_scratch;
+    if (!scratch) {
+        scratch = &local_scratch;
     }
 
-    omp_set_lock(&locks[pt_id]);
+    omp_set_lock(&vertex_lock(locks, pt_id));
 
-    int level = max_level; // level at which we start adding neighbors
+    int level = hnsw.max_level; // level at which we start adding neighbors
     float d_nearest = ptdis(nearest);
 
-    // needed for backtracking in hybrid search - TODO DEPRECATED, remove backtracking things
-    std::vector<storage_idx_t> ep_per_level(max_level); // idx of nearest node per level
-    ep_per_level[level] = nearest;
-
     for (; level > pt_level; level--) {
         debug("--greedy update nearest at level: %d, ep: %d\n", level, nearest);
-        greedy_update_nearest(*this, ptdis, level, nearest, d_nearest);
-        ep_per_level[level] = nearest;
-    }
-
-    for (int i = 0; i <= max_level; i++) {
-        debug("--at level: %d, ep: %d\n", i, ep_per_level[i]);
+        greedy_update_nearest(hnsw, ptdis, level, nearest, d_nearest);
     }
 
     for (; level >= 0; level--) {
         debug("--add_links_starting_from at level: %d\n", level);
-        add_links_starting_from(
-                ptdis, pt_id, nearest, d_nearest, level, locks.data(), vt, ep_per_level);
-        nb_per_level[level] = nb_per_level[level] + 1;
+        add_links_starting_from_impl(
+                hnsw, ptdis, pt_id, nearest, d_nearest, level, locks, vt, scratch);
+#pragma omp atomic
+        hnsw.nb_per_level[level]++;
     }
 
-    omp_unset_lock(&locks[pt_id]);
+    omp_unset_lock(&vertex_lock(locks, pt_id));
 
-    if (pt_level > max_level) {
-        max_level = pt_level;
-        entry_point = pt_id;
+    if (pt_level > hnsw.max_level) {
+        hnsw.max_level = pt_level;
+        hnsw.entry_point = pt_id;
+    }
+}
+
+struct AddLinksStartingFrom {
+    ACORN& hnsw;
+    storage_idx_t pt_id;
+    storage_idx_t nearest;
+    float d_nearest;
+    int level;
+    std::vector<omp_lock_t>& locks;
+    VisitedTable& vt;
+    ACORNBuildScratch* scratch;
+
+    template <class DC>
+    void operator()(DC& ptdis) const {
+        add_links_starting_from_impl(
+                hnsw,
+                ptdis,
+                pt_id,
+                nearest,
+                d_nearest,
+                level,
+                locks,
+                vt,
+                scratch);
+    }
+};
+
+struct AddWithLocks {
+    ACORN& hnsw;
+    int pt_level;
+    int pt_id;
+    std::vector<omp_lock_t>& locks;
+    VisitedTable& vt;
+    ACORNBuildScratch* scratch;
+
+    template <class DC>
+    void operator()(DC& ptdis) const {
+        add_with_locks_impl(hnsw, ptdis, pt_level, pt_id, locks, vt, scratch);
+    }
+};
+
+} // namespace
+
+void ACORN::add_links_starting_from(
+        DistanceComputer& ptdis,
+        storage_idx_t pt_id,
+        storage_idx_t nearest,
+        float d_nearest,
+        int level,
+        std::vector<omp_lock_t>& locks,
+        VisitedTable& vt,
+        ACORNBuildScratch* scratch) {
+    AddLinksStartingFrom f = {
+            *this,
+            pt_id,
+            nearest,
+            d_nearest,
+            level,
+            locks,
+            vt,
+            scratch};
+    with_concrete_distance_computer(ptdis, f);
+}
+
+void ACORN::add_with_locks(
+        DistanceComputer& ptdis,
+        int pt_level,
+        int pt_id,
+        std::vector<omp_lock_t>& locks,
+        VisitedTable& vt,
+        ACORNBuildScratch* scratch) {
+    AddWithLocks f = {*this, pt_level, pt_id, locks, vt, scratch};
+    with_concrete_distance_computer(ptdis, f);
+}
+
+/**************************************************************
+ * Removal of vectors
+ **************************************************************/
+
+bool ACORN::repair_links(
+        DistanceComputer& qdis,
+        storage_idx_t no,
+        int level,
+        std::vector<storage_idx_t>& out,
+        ACORNBuildScratch* scratch) {
+    FAISS_THROW_IF_NOT_MSG(
+            !is_level0_compressed(),
+            "cannot modify an index with a compressed level 0");
+    size_t begin, end;
+    neighbor_range(no, level, &begin, &end);
+    bool has_deleted = false;
+    for (size_t i = begin; i < end && neighbors[i] >= 0; i++) {
+        if (is_deleted(neighbors[i])) {
+            has_deleted = true;
+            break;
+        }
+    }
+    if (!has_deleted) {
+        return false;
+    }
+
+    ACORNBuildScratch local_scratch;
+    if (!scratch) {
+        scratch = &local_scratch;
+    }
+
+    // collect the candidates: remaining neighbors, and neighbors of the
+    // removed neighbors
+    std::vector<storage_idx_t>& cands = scratch->linked;
+    cands.clear();
+    for (size_t i = begin; i < end; i++) {
+        storage_idx_t v = neighbors[i];
+        if (v < 0) {
+            break;
+        }
+        if (!is_deleted(v)) {
+            cands.push_back(v);
+            continue;
+        }
+        size_t begin2, end2;
+        neighbor_range(v, level, &begin2, &end2);
+        for (size_t j = begin2; j < end2; j++) {
+            storage_idx_t v2 = neighbors[j];
+            if (v2 < 0) {
+                break;
+            }
+            if (v2 != no && !is_deleted(v2)) {
+                cands.push_back(v2);
+            }
+        }
+    }
+    std::sort(cands.begin(), cands.end());
+    cands.erase(std::unique(cands.begin(), cands.end()), cands.end());
+
+    ACORNBuildScratch::Queue<NodeDistCloser>& resultSet =
+            scratch->link_candidates;
+    resultSet.clear();
+    for (storage_idx_t v : cands) {
+        resultSet.emplace(qdis.symmetric_dis(no, v), v);
+    }
+
+    if (level == 0) {
+        ::faiss::shrink_neighbor_list(
+                resultSet,
+                end - begin,
+                gamma,
+                *this,
+                *scratch);
+    } else {
+        while (resultSet.size() > end - begin) {
+            resultSet.pop();
+        }
+    }
+
+    // same order as add_link
+    out.resize(end - begin);
+    size_t i = 0;
+    for (; !resultSet.empty(); resultSet.pop()) {
+        out[i++] = resultSet.top().id;
+    }
+    std::fill(out.begin() + i, out.end(), -1);
+    return true;
+}
+
+void ACORN::copy_from_hnsw(const HNSW& hnsw) {
+    FAISS_THROW_IF_NOT_MSG(levels.size() == 0, "the graph must be empty");
+    size_t n = hnsw.levels.size();
+    // the levels above those of this graph are dropped
+    int nlevel = cum_nneighbor_per_level.size() - 1;
+    for (size_t i = 0; i < n; i++) {
+        levels.push_back(std::min(hnsw.levels[i], nlevel));
+    }
+    max_level = prepare_level_tab(n, true);
+
+    for (size_t i = 0; i < n; i++) {
+        for (int level = 0; level < levels[i]; level++) {
+            size_t begin, end, hbegin, hend;
+            neighbor_range(i, level, &begin, &end);
+            hnsw.neighbor_range(i, level, &hbegin, &hend);
+            for (; begin < end && hbegin < hend; begin++, hbegin++) {
+                if (hnsw.neighbors[hbegin] < 0) {
+                    break;
+                }
+                neighbors[begin] = hnsw.neighbors[hbegin];
+            }
+            nb_per_level[level]++;
+        }
+    }
+    entry_point = n > 0 ? hnsw.entry_point : -1;
+}
+
+void ACORN::densify_level0(
+        DistanceComputer& qdis,
+        storage_idx_t no,
+        std::vector<storage_idx_t>& out,
+        ACORNBuildScratch* scratch) {
+    FAISS_THROW_IF_NOT_MSG(
+            !is_level0_compressed(),
+            "cannot modify an index with a compressed level 0");
+    ACORNBuildScratch local_scratch;
+    if (!scratch) {
+        scratch = &local_scratch;
+    }
+
+    // neighbors and neighbors of neighbors
+    size_t begin, end;
+    neighbor_range(no, 0, &begin, &end);
+    std::vector<storage_idx_t>& cands = scratch->linked;
+    cands.clear();
+    for (size_t i = begin; i < end; i++) {
+        storage_idx_t v = neighbors[i];
+        if (v < 0) {
+            break;
+        }
+        cands.push_back(v);
+        size_t begin2, end2;
+        neighbor_range(v, 0, &begin2, &end2);
+        for (size_t j = begin2; j < end2; j++) {
+            storage_idx_t v2 = neighbors[j];
+            if (v2 < 0) {
+                break;
+            }
+            if (v2 != no) {
+                cands.push_back(v2);
+            }
+        }
+    }
+    std::sort(cands.begin(), cands.end());
+    cands.erase(std::unique(cands.begin(), cands.end()), cands.end());
+
+    ACORNBuildScratch::Queue<NodeDistCloser>& resultSet =
+            scratch->link_candidates;
+    resultSet.clear();
+    for (storage_idx_t v : cands) {
+        resultSet.emplace(qdis.symmetric_dis(no, v), v);
+        if (resultSet.size() > size_t(efConstruction)) {
+            resultSet.pop();
+        }
+    }
+
+    ::faiss::shrink_neighbor_list(
+            resultSet,
+            end - begin,
+            gamma,
+            *this,
+            *scratch);
+
+    // same order as add_link
+    out.resize(end - begin);
+    size_t i = 0;
+    for (; !resultSet.empty(); resultSet.pop()) {
+        out[i++] = resultSet.top().id;
+    }
+    std::fill(out.begin() + i, out.end(), -1);
+}
+
+size_t ACORN::remove_deleted(std::vector<idx_t>& map) {
+    FAISS_THROW_IF_NOT_MSG(
+            !is_level0_compressed(),
+            "cannot modify an index with a compressed level 0");
+    size_t ntotal = levels.size();
+    map.resize(ntotal);
+    size_t n1 = 0;
+    for (size_t i = 0; i < ntotal; i++) {
+        map[i] = is_deleted(i) ? -1 : idx_t(n1++);
+    }
+
+    // the lists are moved down in place: the destination of an entry is
+    // never after its source
+    std::vector<size_t> new_offsets(n1 + 1);
+    new_offsets[0] = 0;
+    size_t o = 0;
+    for (size_t i = 0; i < ntotal; i++) {
+        if (map[i] < 0) {
+            continue;
+        }
+        int nl = levels[i];
+        for (int level = 0; level < nl; level++) {
+            size_t begin, end;
+            neighbor_range(i, level, &begin, &end);
+            size_t j = o + cum_nb_neighbors(level);
+            size_t j_end = j + end - begin;
+            for (size_t k = begin; k < end; k++) {
+                storage_idx_t v = neighbors[k];
+                if (v < 0) {
+                    break;
+                }
+                if (map[v] >= 0) {
+                    neighbors[j++] = map[v];
+                }
+            }
+            while (j < j_end) {
+                neighbors[j++] = -1;
+            }
+        }
+        o += cum_nb_neighbors(nl);
+        levels[map[i]] = nl;
+        new_offsets[map[i] + 1] = o;
+    }
+    neighbors.resize(o);
+    levels.resize(n1);
+    offsets = std::move(new_offsets);
+
+    std::fill(nb_per_level.begin(), nb_per_level.end(), 0);
+    for (size_t i = 0; i < n1; i++) {
+        for (int level = 0; level < levels[i]; level++) {
+            nb_per_level[level]++;
+        }
+    }
+
+    if (n1 == 0) {
+        entry_point = -1;
+        max_level = -1;
+    } else if (map[entry_point] >= 0) {
+        entry_point = map[entry_point];
+    } else {
+        // the new entry point is one of the vertices of maximum level
+        entry_point = 0;
+        for (size_t i = 1; i < n1; i++) {
+            if (levels[i] > levels[entry_point]) {
+                entry_point = i;
+            }
+        }
+        max_level = levels[entry_point] - 1;
+    }
+
+    size_t nep = 0;
+    for (storage_idx_t ep : attribute_entry_points) {
+        if (map[ep] >= 0) {
+            attribute_entry_points[nep++] = map[ep];
+        }
+    }
+    attribute_entry_points.resize(nep);
+
+    deleted.clear();
+    ndeleted = 0;
+    return n1;
+}
+
+void ACORN::bfs_order(std::vector<idx_t>& perm) const {
+    size_t n = levels.size();
+    perm.clear();
+    perm.reserve(n);
+    std::vector<uint8_t> seen(n);
+    std::vector<storage_idx_t> buf(nb_neighbors(0));
+    auto visit = [&](storage_idx_t start) {
+        size_t head = perm.size();
+        seen[start] = 1;
+        perm.push_back(start);
+        while (head < perm.size()) {
+            size_t nn;
+            const storage_idx_t* nbs =
+                    get_neighbors(perm[head++], 0, buf.data(), &nn);
+            for (size_t j = 0; j < nn && nbs[j] >= 0; j++) {
+                if (!seen[nbs[j]]) {
+                    seen[nbs[j]] = 1;
+                    perm.push_back(nbs[j]);
+                }
+            }
+        }
+    };
+    if (entry_point >= 0) {
+        visit(entry_point);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!seen[i]) {
+            visit(i);
+        }
+    }
+}
+
+void ACORN::reorder_nodes(const idx_t* perm) {
+    FAISS_THROW_IF_NOT_MSG(
+            !is_level0_compressed(),
+            "cannot reorder a graph with a compressed level 0");
+    size_t n = levels.size();
+    std::vector<storage_idx_t> map(n, -1); // inverse of perm
+    for (size_t i = 0; i < n; i++) {
+        FAISS_THROW_IF_NOT(
+                perm[i] >= 0 && size_t(perm[i]) < n && map[perm[i]] < 0);
+        map[perm[i]] = i;
+    }
+
+    std::vector<int> new_levels(n);
+    std::vector<size_t> new_offsets(n + 1);
+    new_offsets[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        new_levels[i] = levels[perm[i]];
+        new_offsets[i + 1] = new_offsets[i] + offsets[perm[i] + 1] -
+                offsets[perm[i]];
+    }
+    std::vector<NeighNode> new_neighbors(new_offsets[n]);
+    for (size_t i = 0; i < n; i++) {
+        size_t o = offsets[perm[i]];
+        for (size_t j = new_offsets[i]; j < new_offsets[i + 1]; j++, o++) {
+            storage_idx_t v = neighbors[o];
+            new_neighbors[j] = v < 0 ? v : map[v];
+        }
+    }
+    levels = std::move(new_levels);
+    offsets = std::move(new_offsets);
+    neighbors = std::move(new_neighbors);
+
+    if (!deleted.empty()) {
+        deleted.resize(n, 0);
+        std::vector<uint8_t> new_deleted(n);
+        for (size_t i = 0; i < n; i++) {
+            new_deleted[i] = deleted[perm[i]];
+        }
+        deleted.swap(new_deleted);
+    }
+    if (entry_point >= 0) {
+        entry_point = map[entry_point];
+    }
+    for (storage_idx_t& ep : attribute_entry_points) {
+        ep = map[ep];
+    }
+    std::sort(attribute_entry_points.begin(), attribute_entry_points.end());
+
+    if (metadata) {
+        // the legacy metadata may be owned by the caller, keep a permuted
+        // copy
+        std::vector<int> new_metadata(n);
+        for (size_t i = 0; i < n; i++) {
+            new_metadata[i] = metadata[perm[i]];
+        }
+        loaded_metadata.swap(new_metadata);
+        metadata = loaded_metadata.data();
+    }
+    if (!attributes.columns.empty()) {
+        attributes.permute(n, perm);
     }
 }
 
@@ -1097,14 +2145,16 @@ using Node = ACORN::Node;
 using NeighNode = ACORN::NeighNode;
 /** Do a BFS on the candidates list */
 // this is called in search and search_from_level_0
+template <class DC, class VT>
 int search_from_candidates(
         const ACORN& hnsw,
-        DistanceComputer& qdis,
+        DC& qdis,
         int k,
         idx_t* I,
         float* D,
         MinimaxHeap& candidates,
-        VisitedTable& vt,
+        VT& vt,
+        ACORNSearchScratch& scratch,
         ACORNStats& stats,
         int level,
         int nres_in = 0,
@@ -1123,7 +2173,7 @@ int search_from_candidates(
         idx_t v1 = candidates.ids[i];
         float d = candidates.dis[i];
         FAISS_ASSERT(v1 >= 0);
-        if (!sel || sel->is_member(v1)) {
+        if ((!sel || sel->is_member(v1)) && !hnsw.is_deleted(v1)) {
             if (nres < k) {
                 faiss::maxheap_push(++nres, D, I, d, v1);
             } else if (d < D[0]) {
@@ -1150,11 +2200,12 @@ int search_from_candidates(
             }
         }
 
-        size_t begin, end;
-        hnsw.neighbor_range(v0, level, &begin, &end);
+        size_t n0;
+        const storage_idx_t* neighbors0 =
+                hnsw.get_neighbors(v0, level, scratch.buf0.data(), &n0);
 
-        for (size_t j = begin; j < end; j++) {
-            int v1 = hnsw.neighbors[j];
+        for (size_t j = 0; j < n0; j++) {
+            int v1 = neighbors0[j];
             if (v1 < 0)
                 break;
             if (vt.get(v1)) {
@@ -1163,7 +2214,7 @@ int search_from_candidates(
             vt.set(v1);
             ndis++;
             float d = qdis(v1);
-            if (!sel || sel->is_member(v1)) {
+            if ((!sel || sel->is_member(v1)) && !hnsw.is_deleted(v1)) {
                 if (nres < k) {
                     faiss::maxheap_push(++nres, D, I, d, v1);
                 } else if (d < D[0]) {
@@ -1190,27 +2241,291 @@ int search_from_candidates(
     return nres;
 }
 
+/// results of a k-nn search: max-heap of size k on (D, I)
+struct HeapResults {
+    int k;
+    idx_t* I;
+    float* D;
+    int nres;
+
+    /// nb of additions that changed the heap
+    size_t nupdate = 0;
+
+    HeapResults(int k, idx_t* I, float* D, int nres)
+            : k(k), I(I), D(D), nres(nres) {}
+
+    void add(float d, idx_t id) {
+        if (nres < k) {
+            faiss::maxheap_push(++nres, D, I, d, id);
+            nupdate++;
+        } else if (d < D[0]) {
+            faiss::maxheap_replace_top(nres, D, I, d, id);
+            nupdate++;
+        }
+    }
+
+    bool full() const {
+        return nres >= k;
+    }
+};
+
+/// results of a range search: all the nodes closer than radius, in
+/// arrays that grow as needed
+struct RangeResults {
+    float radius;
+    std::vector<float> D;
+    std::vector<idx_t> I;
+    size_t nupdate = 0;
+
+    explicit RangeResults(float radius) : radius(radius) {}
+
+    void add(float d, idx_t id) {
+        if (d < radius) {
+            D.push_back(d);
+            I.push_back(id);
+            nupdate++;
+        }
+    }
+
+    /// a range search is never complete before the end of the traversal
+    bool full() const {
+        return false;
+    }
+};
+
+/* State of the adaptive termination of a level 0 search (see
+ * SearchParametersACORN::convergence_patience). The results are deemed
+ * converged when there are k of them and they did not change during
+ * patience consecutive expansions: the search then stops. This is a
+ * heuristic, the recall it reaches is not bounded. Until then, the beam (the capacity
+ * of the candidate queue and the stopping bound efSearch) doubles, up to
+ * efSearch_max, each time the queue is full or the bound is reached: the
+ * candidates are not dropped while the results still improve, which
+ * happens for sparse filters. */
+struct AdaptiveTermination {
+    int efSearch_max;
+    int patience;
+
+    /// nb of consecutive expansions that did not change the results
+    int nstale = 0;
+
+    explicit AdaptiveTermination(const SearchParametersACORN& params) {
+        efSearch_max = params.efSearch_max > 0 ? params.efSearch_max
+                                               : 8 * params.efSearch;
+        efSearch_max = std::max(efSearch_max, params.efSearch);
+        patience = std::max(params.convergence_patience, 1);
+    }
+
+    template <class Results>
+    bool converged(const Results& res) const {
+        return res.full() && nstale >= patience;
+    }
+
+    /// widens the beam if the results did not converge, returns whether
+    /// it was widened
+    template <class Results>
+    bool extend(const Results& res, int& efSearch, MinimaxHeap& candidates)
+            const {
+        if (converged(res) || efSearch >= efSearch_max) {
+            return false;
+        }
+        efSearch = std::min(2 * efSearch, efSearch_max);
+        if (candidates.n < efSearch) {
+            candidates.n = efSearch;
+            candidates.ids.resize(efSearch);
+            candidates.dis.resize(efSearch);
+        }
+        return true;
+    }
+
+    /// called after each expansion, returns whether to stop
+    template <class Results>
+    bool step(
+            const Results& res,
+            bool updated,
+            int& efSearch,
+            MinimaxHeap& candidates) {
+        nstale = updated ? 0 : nstale + 1;
+        if (converged(res)) {
+            return true;
+        }
+        if (candidates.k >= candidates.n) {
+            // the next candidates would evict others
+            extend(res, efSearch, candidates);
+        }
+        return false;
+    }
+};
+
+/** Explores the neighbors neighbors0[0:n0] of a candidate and, depending
+ * on their rank and on gamma, the neighbors of these neighbors (two-hop
+ * expansion). The new nodes that pass the filter are added to the
+ * candidates and to the results. */
+template <class Filter, class DC, class Results, class VT>
+void hybrid_expand_candidate(
+        const ACORN& hnsw,
+        DC& qdis,
+        const Filter& filter,
+        const IDSelector* sel,
+        const storage_idx_t* neighbors0,
+        size_t n0,
+        int level,
+        Results& res,
+        int& ndis,
+        MinimaxHeap& candidates,
+        VT& vt,
+        ACORNSearchScratch& scratch) {
+    storage_idx_t* batch_ids = scratch.batch_ids.data();
+    float* batch_dis = scratch.batch_dis.data();
+
+    // variable to keep track of search expansion
+    int num_found = 0;
+    int num_new = 0;
+    bool keep_expanding = true;
+
+    for (size_t j = 0; j < n0; j++) {
+        // auto [v1, metadata] = hnsw.neighbors[j];
+        auto v1 = neighbors0[j];
+        // auto metadata = hnsw.metadata[v1];
+        // debug_search("------------visiting neighbor (%ld) - %d, metadata: %d\n", j-begin, v1, metadata);
+
+
+        if (v1 < 0) {
+            break;
+        }
+
+        // the next neighbor may be expanded as well
+        if (j + 1 < n0 && neighbors0[j + 1] >= 0 &&
+            (hnsw.gamma == 1 || j + 1 >= size_t(hnsw.M_beta))) {
+            prefetch_neighbor_list(hnsw, neighbors0[j + 1], level);
+        }
+
+        if (filter(v1)) {
+           num_found = num_found + 1; // increment num found
+        }
+        
+        if (vt.get(v1)) {
+            continue;
+        }
+
+
+        // filter
+        if (filter(v1)) {
+            vt.set(v1);
+            num_new = num_new + 1; // increment num new
+            ndis++;
+            float d = qdis(v1);
+            // debug_search("------------new candidate %d, distance: %f\n", v1, d);
+
+            if ((!sel || sel->is_member(v1)) && !hnsw.is_deleted(v1)) {
+                res.add(d, v1);
+            }
+            candidates.push(v1, d);
+
+            if (num_found >= hnsw.M * 2) {
+                // debug_search("------------num_found: %d, M: %d - triggered outer brea, skpping to M_beta=%d neighbork\n", num_found, hnsw.M * 2, hnsw.M_beta);
+                keep_expanding = false;
+                break;
+            }
+        }    
+        
+        if (((j >= size_t(hnsw.M_beta)) && keep_expanding) || hnsw.gamma == 1) {
+            debug_search("------------expanding neighbor list for %d; neighbor %ld, hnsw.M_beta: %d\n", v1, j, hnsw.M_beta);
+            size_t n1;
+            const storage_idx_t* neighbors1 =
+                    hnsw.get_neighbors(v1, level, scratch.buf1.data(), &n1);
+
+            for (size_t j2 = 0; hnsw.use_prefetch && j2 < n1; j2++) {
+                auto v2 = neighbors1[j2];
+                if (v2 < 0) {
+                    break;
+                }
+                filter.prefetch(v2);
+                vt.prefetch(v2);
+            }
+
+            // collect the new neighbors first, then compute their
+            // distances in batches
+            size_t nbatch = 0;
+            for (size_t j2 = 0; j2 < n1; j2+=1) {
+                
+                auto v2 = neighbors1[j2];
+
+                if (v2 < 0) {
+                    // continue;
+                    break;
+                }
+
+                // if (metadata2 == filter) {
+                if (filter(v2)) {
+                    num_found = num_found + 1; // increment num found
+                } else {
+                    continue;
+                }
+
+    
+
+                if (vt.get(v2)) {
+                    continue;
+                }
+                
+                vt.set(v2);
+                if (hnsw.use_prefetch) {
+                    qdis.prefetch(v2);
+                }
+                batch_ids[nbatch++] = v2;
+
+                if (num_found >= hnsw.M * 2) {
+
+                    // debug_search("------------num_found: %d, 2M: %d - triggers break\n", num_found, hnsw.M * 2);
+                    keep_expanding = false;
+                    break;
+                }
+            }
+
+            batch_distances(qdis, nbatch, batch_ids, batch_dis);
+            ndis += nbatch;
+
+            for (size_t j2 = 0; j2 < nbatch; j2++) {
+                storage_idx_t v2 = batch_ids[j2];
+                float d2 = batch_dis[j2];
+                // debug_search("------------new candidate from expansion %d, distance: %f\n", v2, d2);
+                if ((!sel || sel->is_member(v2)) && !hnsw.is_deleted(v2)) {
+                    res.add(d2, v2);
+                }
+                candidates.push(v2, d2);
+            }
+
+
+
+        }
+    
+        
+    }
+}
+
 // has a filter arg for hybrid search, this only gets called on level 0
-int hybrid_search_from_candidates(
+template <
+        class Filter,
+        class DC,
+        class Results,
+        class VT,
+        class Timer = SearchTimer>
+void hybrid_search_from_candidates(
         const ACORN& hnsw,
-        DistanceComputer& qdis,
-        char* filter_map,
-        // int filter,
-        // Operation op,
-        // std::string regex,
-        int k,
-        idx_t* I,
-        float* D,
+        DC& qdis,
+        const Filter& filter,
+        Results& res,
         MinimaxHeap& candidates,
-        VisitedTable& vt,
+        VT& vt,
+        ACORNSearchScratch& scratch,
         ACORNStats& stats,
         int level,
-        int nres_in = 0,
-        const SearchParametersACORN* params = nullptr) {
+        const SearchParametersACORN* params = nullptr,
+        AdaptiveTermination* adaptive = nullptr) {
     // debug("%s\n", "reached");
     // printf("----hybrid_search_from_candidates called with filter: %d, k: %d, op: %d, regex: %s\n", filter, k, op, regex.c_str());
     // debug_search("----hybrid_search_from_candidates called with filter: %d, k: %d\n", filter, k);
-    int nres = nres_in;
     int ndis = 0;
 
     // can be overridden by search params
@@ -1223,22 +2538,21 @@ int hybrid_search_from_candidates(
         idx_t v1 = candidates.ids[i];
         float d = candidates.dis[i];
         FAISS_ASSERT(v1 >= 0);
-        if (!sel || sel->is_member(v1)) {
-            if (nres < k) {
-                faiss::maxheap_push(++nres, D, I, d, v1);
-            } else if (d < D[0]) {
-                faiss::maxheap_replace_top(nres, D, I, d, v1);
-            }
+        // the entry point may not pass the filter if none of the upper
+        // levels did
+        if (filter(v1) && (!sel || sel->is_member(v1)) &&
+            !hnsw.is_deleted(v1)) {
+            res.add(d, v1);
         }
         vt.set(v1);
     }
 
     int nstep = 0;
 
+    // timing of the loops, only with FAISS_ACORN_PROFILING
+    Timer candidates_timer, neighbors_timer;
+    candidates_timer.start();
 
-    // timing variables
-    double t1_candidates_loop = elapsed();
-    
     while (candidates.size() > 0) { // candidates is heap of size max(efs, k)
         float d0 = 0;
         int v0 = candidates.pop_min(&d0);
@@ -1249,200 +2563,354 @@ int hybrid_search_from_candidates(
             // distances that are processed already that are smaller
             // than d0
             int n_dis_below = candidates.count_below(d0);
-            if (n_dis_below >= efSearch) {
+            if (n_dis_below >= efSearch &&
+                !(adaptive && adaptive->extend(res, efSearch, candidates))) {
                 // debug("--------%s\n", "n_dis_below >= efSearch BREAK cond reached");
                 // debug_search("--------n_dis_below: %d, efSearch: %d - triggers break\n", n_dis_below, efSearch);
                 break;
             }
         }
 
-        size_t begin, end;
-        hnsw.neighbor_range(v0, level, &begin, &end);
+        size_t n0;
+        const storage_idx_t* neighbors0 =
+                hnsw.get_neighbors(v0, level, scratch.buf0.data(), &n0);
 
-        // variable to keep track of search expansion
-        int num_found = 0;
-        int num_new = 0;
-        bool keep_expanding = true;
+        neighbors_timer.start();
 
-        // for debugging, collect all neighbors looked at in a vector
-        std::vector<std::pair<storage_idx_t, int>> neighbors_checked;
+        // the filter and visited flags of all the neighbors are read below
+        for (size_t j = 0; hnsw.use_prefetch && j < n0; j++) {
+            auto v1 = neighbors0[j];
+            if (v1 < 0) {
+                break;
+            }
+            filter.prefetch(v1);
+            vt.prefetch(v1);
+        }
 
-        double t1_neighbors_loop = elapsed();
-        for (size_t j = begin; j < end; j++) {
-            // auto [v1, metadata] = hnsw.neighbors[j];
-            bool promising = 0;
-            bool outerskip = false;
+        size_t nupdate = res.nupdate;
+        hybrid_expand_candidate(
+                hnsw,
+                qdis,
+                filter,
+                sel,
+                neighbors0,
+                n0,
+                level,
+                res,
+                ndis,
+                candidates,
+                vt,
+                scratch);
+
+        neighbors_timer.stop(stats.neighbors_loop);
 
-            auto v1 = hnsw.neighbors[j];
-            // auto metadata = hnsw.metadata[v1];
-            // debug_search("------------visiting neighbor (%ld) - %d, metadata: %d\n", j-begin, v1, metadata);
+        nstep++; 
+        if (adaptive &&
+            adaptive->step(res, res.nupdate != nupdate, efSearch, candidates)) {
+            break;
+        }
+        if (!do_dis_check && nstep > efSearch &&
+            !(adaptive && adaptive->extend(res, efSearch, candidates))) {
+            break;
+        }
+    }
+    candidates_timer.stop(stats.candidates_loop);
 
+    if (level == 0) {
+        stats.n1++;
+        if (candidates.size() == 0) {
+            stats.n2++;
+        }
+        stats.n3 += ndis;
+    }
+}
 
-            if (v1 < 0) {
-                break;
-            }
+/// k-nn version: the k results are accumulated in the max-heap (I, D) that
+/// contains nres_in elements on input, returns the new nb of elements
+template <class Filter, class DC, class VT, class Timer = SearchTimer>
+int hybrid_search_from_candidates(
+        const ACORN& hnsw,
+        DC& qdis,
+        const Filter& filter,
+        int k,
+        idx_t* I,
+        float* D,
+        MinimaxHeap& candidates,
+        VT& vt,
+        ACORNSearchScratch& scratch,
+        ACORNStats& stats,
+        int level,
+        int nres_in = 0,
+        const SearchParametersACORN* params = nullptr,
+        AdaptiveTermination* adaptive = nullptr) {
+    HeapResults res(k, I, D, nres_in);
+    hybrid_search_from_candidates<Filter, DC, HeapResults, VT, Timer>(
+            hnsw,
+            qdis,
+            filter,
+            res,
+            candidates,
+            vt,
+            scratch,
+            stats,
+            level,
+            params,
+            adaptive);
+    return res.nres;
+}
 
-            // note that this slows down search performance significantly
-            // if (debugSearchFlag) {
-            //     neighbors_checked.push_back(std::make_pair(v1, metadata)); // for debugging
-            // }
-            if (filter_map[v1]) {
-               num_found = num_found + 1; // increment num found
-            }
-            
-            if (vt.get(v1)) {
-                continue;
+/// marks v as visited, returns whether it was not visited before. Safe
+/// when several threads share the table
+inline bool visit_atomic(VisitedTable& vt, storage_idx_t v) {
+    uint8_t visno = vt.visno;
+    uint8_t old;
+#pragma omp atomic capture
+    {
+        old = vt.visited[v];
+        vt.visited[v] = visno;
+    }
+    return old != visno;
+}
+
+inline bool visit_atomic(ACORNVisitedHashSet& vt, storage_idx_t v) {
+    bool is_new;
+#pragma omp critical(acorn_visited_hashset)
+    is_new = vt.insert(v);
+    return is_new;
+}
+
+/* Level 0 of hybrid_search_from_candidates explored by qdis.size()
+ * threads, for the latency of single queries. The threads share the
+ * candidate queue, the result heap and the visited table. Each one pops
+ * the nearest candidate, computes the distances of its new (two-hop)
+ * neighbors with its own distance computer and merges them. The queue
+ * and the results are protected by a lock and the visited flags are set
+ * atomically, so each node is evaluated once. The expansion order depends
+ * on the scheduling, so the results may differ slightly from the
+ * sequential search. A thread that finds the queue empty waits, without
+ * the lock, until another thread has pushed candidates or finished. */
+template <class Filter, class VT>
+int hybrid_search_from_candidates_parallel(
+        const ACORN& hnsw,
+        const std::vector<DistanceComputer*>& qdis,
+        const Filter& filter,
+        int k,
+        idx_t* I,
+        float* D,
+        MinimaxHeap& candidates,
+        VT& vt,
+        ACORNStats& stats,
+        const SearchParametersACORN* params = nullptr) {
+    const int level = 0;
+    int nres = 0;
+    bool do_dis_check = params ? params->check_relative_distance
+                               : hnsw.check_relative_distance;
+    int efSearch = params ? params->efSearch : hnsw.efSearch;
+    const IDSelector* sel = params ? params->sel : nullptr;
+
+    auto add_result = [&](storage_idx_t v, float d) {
+        if ((!sel || sel->is_member(v)) && !hnsw.is_deleted(v)) {
+            if (nres < k) {
+                faiss::maxheap_push(++nres, D, I, d, v);
+            } else if (d < D[0]) {
+                faiss::maxheap_replace_top(nres, D, I, d, v);
             }
+        }
+    };
+
+    for (int i = 0; i < candidates.size(); i++) {
+        if (filter(candidates.ids[i])) {
+            add_result(candidates.ids[i], candidates.dis[i]);
+        }
+        vt.set(candidates.ids[i]);
+    }
 
+    // shared state, protected by lock
+    omp_lock_t lock;
+    omp_init_lock(&lock);
+    int nstep = 0;
+    int nactive = 0; // nb of threads expanding a candidate
+    bool done = false;
+    // incremented when candidates are pushed or done is set, read
+    // atomically by the waiting threads
+    int nupdate = 0;
+    size_t ndis = 0;
 
-            // filter
-            if (filter_map[v1]) {
-                vt.set(v1);
-                num_new = num_new + 1; // increment num new
-                ndis++;
-                float d = qdis(v1);
-                // debug_search("------------new candidate %d, distance: %f\n", v1, d);
-
-                if (!sel || sel->is_member(v1)) {
-                    if (nres < k) {
-                        // debug_search("-----------------pushing new candidate, nres: %d (to be incrd)\n", nres);
-                        faiss::maxheap_push(++nres, D, I, d, v1);
-                        // debug_search("-----------------pushed new candidate, nres: %d\n", nres);
-                        promising = 1;
-                    } else if (d < D[0]) {
-                        // debug_search("-----------------replacing top, nres: %d\n", nres);
-                        faiss::maxheap_replace_top(nres, D, I, d, v1);
-                        promising =1;
-                    }
-                }
-                candidates.push(v1, d);
+    int nb = hnsw.nb_neighbors(level);
 
-                if (num_found >= hnsw.M * 2) {
-                    // debug_search("------------num_found: %d, M: %d - triggered outer brea, skpping to M_beta=%d neighbork\n", num_found, hnsw.M * 2, hnsw.M_beta);
-                    keep_expanding = false;
+#pragma omp parallel num_threads(int(qdis.size())) reduction(+ : ndis)
+    {
+        DistanceComputer& dis = *qdis[omp_get_thread_num()];
+        std::vector<storage_idx_t> buf0(nb), buf1(nb);
+        std::vector<storage_idx_t> new_ids;
+        std::vector<float> new_dis;
+        // value of nupdate when the queue was last found empty, -1 if the
+        // queue may be read right away
+        int seen_update = -1;
+
+        for (;;) {
+            // spin briefly, then yield, until the queue may have changed
+            for (int nwait = 0; seen_update >= 0; nwait++) {
+                int cur_update;
+#pragma omp atomic read
+                cur_update = nupdate;
+                if (cur_update != seen_update) {
                     break;
                 }
-            }    
-            
-            if (((j - begin >= hnsw.M_beta) && keep_expanding) || hnsw.gamma == 1) {
-                debug_search("------------expanding neighbor list for %d; neighbor %ld, hnsw.M_beta: %d\n", v1, j-begin, hnsw.M_beta);
-                size_t begin2, end2;
-                hnsw.neighbor_range(v1, level, &begin2, &end2);
-                // try to parallelize neighbor expansion
-                for (size_t j2 = begin2; j2 < end2; j2+=1) {
-                    
-                    auto v2 = hnsw.neighbors[j2];
-
-                    // note that this slows down search performance significantly when flag is on
-                    // if (debugSearchFlag) {
-                    //     neighbors_checked.push_back(std::make_pair(v2, metadata2)); // for debugging
-                    // }
-                    if (v2 < 0) {
-                        // continue;
-                        break;
-                    }
+                if (nwait >= 64) {
+                    std::this_thread::yield();
+                }
+            }
 
-                    // if (metadata2 == filter) {
-                    if (filter_map[v2]) {
-                        num_found = num_found + 1; // increment num found
-                    } else {
-                        continue;
+            storage_idx_t v0 = -1;
+            bool stop = false;
+            omp_set_lock(&lock);
+            if (done) {
+                stop = true;
+            } else if (candidates.size() > 0) {
+                float d0 = 0;
+                v0 = candidates.pop_min(&d0);
+                if (do_dis_check && candidates.count_below(d0) >= efSearch) {
+                    done = stop = true;
+#pragma omp atomic
+                    nupdate++;
+                } else {
+                    nstep++;
+                    if (!do_dis_check && nstep > efSearch) {
+                        done = true; // this candidate is the last one
                     }
+                    nactive++;
+                }
+            } else if (nactive == 0) {
+                done = stop = true;
+#pragma omp atomic
+                nupdate++;
+            } else {
+                // wait for the other threads to push new candidates
+                seen_update = nupdate;
+            }
+            omp_unset_lock(&lock);
+            if (stop) {
+                break;
+            }
+            if (v0 < 0) {
+                continue;
+            }
+            seen_update = -1;
+
+            new_ids.clear();
+            size_t n0;
+            const storage_idx_t* neighbors0 =
+                    hnsw.get_neighbors(v0, level, buf0.data(), &n0);
+            for (size_t j = 0;
+                 hnsw.use_prefetch && j < n0 && neighbors0[j] >= 0;
+                 j++) {
+                filter.prefetch(neighbors0[j]);
+                vt.prefetch(neighbors0[j]);
+            }
 
-        
-
-                    if (vt.get(v2)) {
+            int num_found = 0;
+            bool keep_expanding = true;
+            for (size_t j = 0; j < n0; j++) {
+                storage_idx_t v1 = neighbors0[j];
+                if (v1 < 0) {
+                    break;
+                }
+                if (filter(v1)) {
+                    num_found++;
+                    if (!visit_atomic(vt, v1)) {
                         continue;
                     }
-                    
-                    vt.set(v2);
-                    ndis++;
-  
-                    float d2 = qdis(v2);
-                    // debug_search("------------new candidate from expansion %d, distance: %f\n", v2, d2);
-                    if (!sel || sel->is_member(v2)) {
-                        if (nres < k) {
-                            // debug_search("-----------------pushing new candidate, nres: %d (to be incrd)\n", nres);
-                            faiss::maxheap_push(++nres, D, I, d2, v2);
-                            // debug_search("-----------------pushed new candidate, nres: %d\n", nres);
-
-                        } else if (d2 < D[0]) {
-                            // debug_search("-----------------replacing top, nres: %d\n", nres);
-                            faiss::maxheap_replace_top(nres, D, I, d2, v2);
-                        }
-                    }
-                    candidates.push(v2, d2);
+                    new_ids.push_back(v1);
                     if (num_found >= hnsw.M * 2) {
-    
-                        // debug_search("------------num_found: %d, 2M: %d - triggers break\n", num_found, hnsw.M * 2);
                         keep_expanding = false;
                         break;
                     }
                 }
-
-
-    
+                if (((j >= size_t(hnsw.M_beta)) && keep_expanding) ||
+                    hnsw.gamma == 1) {
+                    size_t n1;
+                    const storage_idx_t* neighbors1 =
+                            hnsw.get_neighbors(v1, level, buf1.data(), &n1);
+                    for (size_t j2 = 0; j2 < n1; j2++) {
+                        storage_idx_t v2 = neighbors1[j2];
+                        if (v2 < 0) {
+                            break;
+                        }
+                        if (!filter(v2)) {
+                            continue;
+                        }
+                        num_found++;
+                        if (!visit_atomic(vt, v2)) {
+                            continue;
+                        }
+                        if (hnsw.use_prefetch) {
+                            dis.prefetch(v2);
+                        }
+                        new_ids.push_back(v2);
+                        if (num_found >= hnsw.M * 2) {
+                            keep_expanding = false;
+                            break;
+                        }
+                    }
+                }
             }
-        
-            
-        }
 
-     
-        
+            new_dis.resize(new_ids.size());
+            batch_distances(dis, new_ids.size(), new_ids.data(), new_dis.data());
+            ndis += new_ids.size();
 
-        nstep++; 
-        if (!do_dis_check && nstep > efSearch) {
-            break;
+            omp_set_lock(&lock);
+            for (size_t j = 0; j < new_ids.size(); j++) {
+                add_result(new_ids[j], new_dis[j]);
+                candidates.push(new_ids[j], new_dis[j]);
+            }
+            nactive--;
+#pragma omp atomic
+            nupdate++;
+            omp_unset_lock(&lock);
         }
     }
+    omp_destroy_lock(&lock);
 
-    if (level == 0) {
-        stats.n1++;
-        if (candidates.size() == 0) {
-            stats.n2++;
-        }
-        stats.n3 += ndis;
+    stats.n1++;
+    if (candidates.size() == 0) {
+        stats.n2++;
     }
-
-
+    stats.n3 += ndis;
     return nres;
 }
 
-
-
-
-
-
-
-
-} // anonymous namespace
-
-ACORNStats ACORN::search(
-        DistanceComputer& qdis,
+/// unfiltered search for one query
+template <class DC, class VT>
+ACORNStats search_impl(
+        const ACORN& hnsw,
+        DC& qdis,
         int k,
         idx_t* I,
         float* D,
-        VisitedTable& vt,
-        const SearchParametersACORN* params) const {
+        VT& vt,
+        ACORNSearchScratch& scratch,
+        const SearchParametersACORN* params) {
     debug("%s\n", "reached");
     ACORNStats stats;
-    if (entry_point == -1) {
+    if (hnsw.entry_point == -1) {
         return stats;
     }
-    if (upper_beam == 1) { // common branch
+    if (hnsw.upper_beam == 1) { // common branch
         debug("%s\n", "reached upper beam == 1");
 
         //  greedy search on upper levels
-        storage_idx_t nearest = entry_point;
+        storage_idx_t nearest = hnsw.entry_point;
         float d_nearest = qdis(nearest);
 
-        for (int level = max_level; level >= 1; level--) {
-            greedy_update_nearest(*this, qdis, level, nearest, d_nearest);
+        for (int level = hnsw.max_level; level >= 1; level--) {
+            greedy_update_nearest(hnsw, qdis, level, nearest, d_nearest);
         }
 
         
-        int ef = std::max(efSearch, k);
-        if (search_bounded_queue) { // this is the most common branch
+        int ef = std::max(params ? params->efSearch : hnsw.efSearch, k);
+        if (hnsw.search_bounded_queue) { // this is the most common branch
             debug("%s\n", "reached search bounded queue");
 
             MinimaxHeap candidates(ef);
@@ -1450,7 +2918,7 @@ ACORNStats ACORN::search(
             candidates.push(nearest, d_nearest);
 
             search_from_candidates(
-                    *this, qdis, k, I, D, candidates, vt, stats, 0, 0, params);
+                    hnsw, qdis, k, I, D, candidates, vt, scratch, stats, 0, 0, params);
         } else {
             debug("%s\n", "reached search_bounded_queue == False");
             throw FaissException("UNIMPLEMENTED search unbounded queue");
@@ -1462,17 +2930,17 @@ ACORNStats ACORN::search(
     } else {
         debug("%s\n", "reached upper beam != 1");
 
-        int candidates_size = upper_beam;
+        int candidates_size = hnsw.upper_beam;
         MinimaxHeap candidates(candidates_size);
 
         std::vector<idx_t> I_to_next(candidates_size);
         std::vector<float> D_to_next(candidates_size);
 
         int nres = 1;
-        I_to_next[0] = entry_point;
-        D_to_next[0] = qdis(entry_point);
+        I_to_next[0] = hnsw.entry_point;
+        D_to_next[0] = qdis(hnsw.entry_point);
 
-        for (int level = max_level; level >= 0; level--) {
+        for (int level = hnsw.max_level; level >= 0; level--) {
             // copy I, D -> candidates
 
             candidates.clear();
@@ -1483,16 +2951,17 @@ ACORNStats ACORN::search(
 
             if (level == 0) {
                 nres = search_from_candidates(
-                        *this, qdis, k, I, D, candidates, vt, stats, 0);
+                        hnsw, qdis, k, I, D, candidates, vt, scratch, stats, 0);
             } else {
                 nres = search_from_candidates(
-                        *this,
+                        hnsw,
                         qdis,
                         candidates_size,
                         I_to_next.data(),
                         D_to_next.data(),
                         candidates,
                         vt,
+                        scratch,
                         stats,
                         level);
             }
@@ -1504,57 +2973,155 @@ ACORNStats ACORN::search(
 }
 
 
-// hybrid search TODO
-ACORNStats ACORN::hybrid_search(
+template <class VT>
+struct SearchImpl {
+    const ACORN& hnsw;
+    int k;
+    idx_t* I;
+    float* D;
+    VT& vt;
+    ACORNSearchScratch& scratch;
+    const SearchParametersACORN* params;
+
+    template <class DC>
+    ACORNStats operator()(DC& qdis) const {
+        return search_impl(hnsw, qdis, k, I, D, vt, scratch, params);
+    }
+};
+
+} // anonymous namespace
+
+template <class VT>
+ACORNStats ACORN::search(
         DistanceComputer& qdis,
         int k,
         idx_t* I,
         float* D,
-        VisitedTable& vt,
-        char* filter_map,
-        // int filter,
-        // Operation op,
-        // std::string regex,
-        const SearchParametersACORN* params) const {
+        VT& vt,
+        const SearchParametersACORN* params,
+        ACORNSearchScratch* scratch) const {
+    ACORNSearchScratch local_scratch;
+    if (!scratch) {
+        scratch = &local_scratch;
+    }
+    scratch->prepare(*this);
+    SearchImpl<VT> f = {*this, k, I, D, vt, *scratch, params};
+    return with_concrete_distance_computer(qdis, f);
+}
+
+namespace {
+
+/// nearest of the attribute entry points that pass the filter, returns
+/// false if there is none
+template <class Filter, class DC>
+bool nearest_attribute_entry_point(
+        const ACORN& acorn,
+        DC& qdis,
+        const Filter& filter,
+        storage_idx_t& nearest,
+        float& d_nearest,
+        int& ndis) {
+    bool found = false;
+    for (storage_idx_t ep : acorn.attribute_entry_points) {
+        if (!filter(ep) || acorn.is_deleted(ep)) {
+            continue;
+        }
+        float d = qdis(ep);
+        ndis++;
+        if (!found || d < d_nearest) {
+            nearest = ep;
+            d_nearest = d;
+            found = true;
+        }
+    }
+    return found;
+}
+
+/** greedy search on the upper levels, from the entry point of the filter
+ * if there is one. Sets the entry point of the level 0 search, returns the
+ * nb of distances computed. */
+template <class Filter, class DC>
+int hybrid_search_upper_levels(
+        const ACORN& acorn,
+        DC& qdis,
+        const Filter& filter,
+        storage_idx_t& nearest,
+        float& d_nearest,
+        ACORNSearchScratch& scratch) {
+    nearest = acorn.entry_point;
+    d_nearest = 0;
+    int ndis_upper = 0;
+    int start_level = acorn.max_level;
+    if (nearest_attribute_entry_point(
+                acorn, qdis, filter, nearest, d_nearest, ndis_upper)) {
+        start_level = acorn.levels[nearest] - 1;
+    } else {
+        d_nearest = qdis(nearest);
+    }
+
+    debug_search("-starting at ep: %d, d: %f, metadata: %d\n", nearest, d_nearest, acorn.metadata[nearest]);
+
+    for (int level = start_level; level >= 1; level--) {
+        debug_search("-at level %d, searching for greedy nearest from current nearest: %d, dist: %f, metadata: %d\n", level, nearest, d_nearest, acorn.metadata[nearest]);
+        ndis_upper += hybrid_greedy_update_nearest(
+                acorn, qdis, filter, level, nearest, d_nearest, scratch);
+        debug_search("-at level %d, new nearest: %d, d: %f, metadata: %d\n", level, nearest, d_nearest, acorn.metadata[nearest]);
+    }
+    return ndis_upper;
+}
+
+/// hybrid search for one query, instantiated once per filter type and
+/// distance computer type
+template <class Filter, class DC, class VT>
+ACORNStats hybrid_search_impl(
+        const ACORN& acorn,
+        DC& qdis,
+        int k,
+        idx_t* I,
+        float* D,
+        VT& vt,
+        ACORNSearchScratch& scratch,
+        const Filter& filter,
+        const SearchParametersACORN* params,
+        const std::vector<DistanceComputer*>* par_qdis = nullptr) {
     debug("%s\n", "reached");
-    // debug_search("Hybrid Search, params -- k: %d, filter: %d\n", k, filter);
     ACORNStats stats;
-    if (entry_point == -1) {
+    if (acorn.entry_point == -1) {
         return stats;
     }
 
 
-    if (upper_beam == 1) { // common branch
+    if (acorn.upper_beam == 1) { // common branch
         debug("%s\n", "reached upper beam == 1");
 
-        //  greedy search on upper levels
-        storage_idx_t nearest = entry_point;
-        float d_nearest = qdis(nearest);
-
-        debug_search("-starting at ep: %d, d: %f, metadata: %d\n", nearest, d_nearest, metadata[nearest]);
-
-        int ndis_upper = 0;
-        for (int level = max_level; level >= 1; level--) {
-            debug_search("-at level %d, searching for greedy nearest from current nearest: %d, dist: %f, metadata: %d\n", level, nearest, d_nearest, metadata[nearest]);
-            ndis_upper += hybrid_greedy_update_nearest(*this, qdis, filter_map, level, nearest, d_nearest);
-            // ndis_upper += hybrid_greedy_update_nearest(*this, qdis, filter, op, regex, level, nearest, d_nearest);
-            debug_search("-at level %d, new nearest: %d, d: %f, metadata: %d\n", level, nearest, d_nearest, metadata[nearest]);
-            
-
-        }
-        stats.n3 += ndis_upper;
+        storage_idx_t nearest;
+        float d_nearest;
+        stats.n3 += hybrid_search_upper_levels(
+                acorn, qdis, filter, nearest, d_nearest, scratch);
 
-        int ef = std::max(efSearch, k);
-        if (search_bounded_queue) { // this is the most common branch
+        int ef = std::max(params ? params->efSearch : acorn.efSearch, k);
+        if (acorn.search_bounded_queue) { // this is the most common branch
             debug("%s\n", "reached search bounded queue");
 
             MinimaxHeap candidates(ef);
 
             candidates.push(nearest, d_nearest);
-            debug_search("-starting BFS at level 0 with ef: %d, nearest: %d, d: %f, metadata: %d\n", ef, nearest, d_nearest, metadata[nearest]);
-            hybrid_search_from_candidates(
-                    *this, qdis, filter_map, k, I, D, candidates, vt, stats, 0, 0, params);
-            
+            debug_search("-starting BFS at level 0 with ef: %d, nearest: %d, d: %f, metadata: %d\n", ef, nearest, d_nearest, acorn.metadata[nearest]);
+            if (par_qdis && par_qdis->size() > 1) {
+                hybrid_search_from_candidates_parallel(
+                        acorn, *par_qdis, filter, k, I, D, candidates, vt,
+                        stats, params);
+            } else if (params && params->convergence_patience > 0) {
+                AdaptiveTermination adaptive(*params);
+                hybrid_search_from_candidates(
+                        acorn, qdis, filter, k, I, D, candidates, vt, scratch, stats,
+                        0, 0, params, &adaptive);
+            } else {
+                hybrid_search_from_candidates(
+                        acorn, qdis, filter, k, I, D, candidates, vt, scratch, stats,
+                        0, 0, params);
+            }
+
 
         } else {
             // TODO
@@ -1570,17 +3137,17 @@ ACORNStats ACORN::hybrid_search(
     } else {
         debug("%s\n", "reached upper beam != 1");
 
-        int candidates_size = upper_beam;
+        int candidates_size = acorn.upper_beam;
         MinimaxHeap candidates(candidates_size);
 
         std::vector<idx_t> I_to_next(candidates_size);
         std::vector<float> D_to_next(candidates_size);
 
         int nres = 1;
-        I_to_next[0] = entry_point;
-        D_to_next[0] = qdis(entry_point);
+        I_to_next[0] = acorn.entry_point;
+        D_to_next[0] = qdis(acorn.entry_point);
 
-        for (int level = max_level; level >= 0; level--) {
+        for (int level = acorn.max_level; level >= 0; level--) {
             // copy I, D -> candidates
 
             candidates.clear();
@@ -1591,22 +3158,20 @@ ACORNStats ACORN::hybrid_search(
 
             if (level == 0) {
                 nres = hybrid_search_from_candidates(
-                        *this, qdis, filter_map, k, I, D, candidates, vt, stats, 0);
+                        acorn, qdis, filter, k, I, D, candidates, vt, scratch, stats, 0);
             
                 
             } else {
                 nres = hybrid_search_from_candidates(
-                        *this,
+                        acorn,
                         qdis,
-                        filter_map,
-                        // filter,
-                        // op,
-                        // regex,
+                        filter,
                         candidates_size,
                         I_to_next.data(),
                         D_to_next.data(),
                         candidates,
                         vt,
+                        scratch,
                         stats,
                         level);
             }
@@ -1617,10 +3182,635 @@ ACORNStats ACORN::hybrid_search(
     return stats;
 }
 
+/// calls f(filter functor) for a byte map
+template <class F>
+auto with_filter(char* filter_map, const F& f)
+        -> decltype(f(CharMapFilter(filter_map))) {
+    return f(CharMapFilter(filter_map));
+}
+
+/// calls f(filter functor) with the filter type that matches the selector
+template <class F>
+auto with_filter(const IDSelector* filter, const F& f)
+        -> decltype(f(SelectorFilter(filter))) {
+    FAISS_THROW_IF_NOT_MSG(filter, "hybrid_search needs a filter");
+    // common selectors get a specialized, inlined membership test
+    if (auto bitmap = dynamic_cast<const IDSelectorBitmap*>(filter)) {
+        return f(BitmapFilter(bitmap));
+    }
+    if (auto range = dynamic_cast<const IDSelectorRange*>(filter)) {
+        return f(RangeFilter(range));
+    }
+    if (auto eq = dynamic_cast<const IDSelectorAttributeEqual*>(filter)) {
+        if (eq->column->type == ATTR_INT) {
+            return f(AttributeEqualFilter(eq));
+        }
+    }
+    if (auto range = dynamic_cast<const IDSelectorAttributeRange*>(filter)) {
+        if (range->column->type == ATTR_INT) {
+            return f(AttributeRangeFilter(range));
+        }
+    }
+    return f(SelectorFilter(filter));
+}
+
+/// runs hybrid_search_impl with the filter type that matches the selector
+template <class DC, class VT>
+struct HybridSearchImpl {
+    const ACORN& acorn;
+    DC& qdis;
+    int k;
+    idx_t* I;
+    float* D;
+    VT& vt;
+    ACORNSearchScratch& scratch;
+    const SearchParametersACORN* params;
+    const std::vector<DistanceComputer*>* par_qdis;
+
+    template <class Filter>
+    ACORNStats operator()(const Filter& filter) const {
+        return hybrid_search_impl(
+                acorn, qdis, k, I, D, vt, scratch, filter, params, par_qdis);
+    }
+
+    template <class FilterArg>
+    ACORNStats dispatch(FilterArg filter) const {
+        return with_filter(filter, *this);
+    }
+};
+
+/// runs HybridSearchImpl with the concrete type of the distance computer
+template <class FilterArg, class VT>
+struct HybridSearchDispatch {
+    const ACORN& acorn;
+    int k;
+    idx_t* I;
+    float* D;
+    VT& vt;
+    ACORNSearchScratch& scratch;
+    FilterArg filter;
+    const SearchParametersACORN* params;
+
+    template <class DC>
+    ACORNStats operator()(DC& qdis) const {
+        HybridSearchImpl<DC, VT> impl = {
+                acorn, qdis, k, I, D, vt, scratch, params, nullptr};
+        return impl.dispatch(filter);
+    }
+};
+
+/// accepts all the nodes, for the searches without filter
+struct AllFilter {
+    bool operator()(idx_t) const {
+        return true;
+    }
+
+    void prefetch(idx_t) const {}
+};
+
+/* The results within the radius are collected during a level 0 search
+ * with a candidate queue of size ef. When they are at least ef, the queue
+ * was likely too small to reach all of them: the search is restarted with
+ * a doubled ef. */
+template <class Filter, class DC, class VT>
+ACORNStats range_search_impl(
+        const ACORN& acorn,
+        DC& qdis,
+        float radius,
+        std::vector<float>& D,
+        std::vector<idx_t>& I,
+        VT& vt,
+        ACORNSearchScratch& scratch,
+        const Filter& filter,
+        const SearchParametersACORN* params) {
+    ACORNStats stats;
+    if (acorn.entry_point == -1) {
+        return stats;
+    }
+    storage_idx_t nearest;
+    float d_nearest;
+    stats.n3 += hybrid_search_upper_levels(
+            acorn, qdis, filter, nearest, d_nearest, scratch);
+
+    SearchParametersACORN params_ef;
+    if (params) {
+        params_ef = *params;
+    } else {
+        params_ef.efSearch = acorn.efSearch;
+        params_ef.check_relative_distance = acorn.check_relative_distance;
+    }
+    // the range search has its own rule to widen the beam
+    params_ef.convergence_patience = 0;
+    int ntotal = acorn.levels.size();
+    int ef = std::max(params_ef.efSearch, 1);
+    for (;;) {
+        params_ef.efSearch = ef;
+        MinimaxHeap candidates(ef);
+        candidates.push(nearest, d_nearest);
+        RangeResults res(radius);
+        hybrid_search_from_candidates(
+                acorn, qdis, filter, res, candidates, vt, scratch, stats, 0,
+                &params_ef);
+        vt.advance();
+        if (res.I.size() < size_t(ef) || ef >= ntotal) {
+            D.swap(res.D);
+            I.swap(res.I);
+            return stats;
+        }
+        ef = std::min(2 * ef, ntotal);
+    }
+}
+
+/// runs range_search_impl with the filter type that matches the selector
+template <class DC, class VT>
+struct RangeSearchImpl {
+    const ACORN& acorn;
+    DC& qdis;
+    float radius;
+    std::vector<float>& D;
+    std::vector<idx_t>& I;
+    VT& vt;
+    ACORNSearchScratch& scratch;
+    const SearchParametersACORN* params;
+
+    template <class Filter>
+    ACORNStats operator()(const Filter& filter) const {
+        return range_search_impl(
+                acorn, qdis, radius, D, I, vt, scratch, filter, params);
+    }
+};
+
+/// runs RangeSearchImpl with the concrete type of the distance computer
+template <class VT>
+struct RangeSearchDispatch {
+    const ACORN& acorn;
+    float radius;
+    std::vector<float>& D;
+    std::vector<idx_t>& I;
+    VT& vt;
+    ACORNSearchScratch& scratch;
+    const IDSelector* filter;
+    const SearchParametersACORN* params;
+
+    template <class DC>
+    ACORNStats operator()(DC& qdis) const {
+        RangeSearchImpl<DC, VT> impl = {
+                acorn, qdis, radius, D, I, vt, scratch, params};
+        if (!filter || dynamic_cast<const IDSelectorAll*>(filter)) {
+            return impl(AllFilter());
+        }
+        return with_filter(filter, impl);
+    }
+};
+
+} // anonymous namespace
+
+template <class VT>
+ACORNStats ACORN::hybrid_search(
+        DistanceComputer& qdis,
+        int k,
+        idx_t* I,
+        float* D,
+        VT& vt,
+        char* filter_map,
+        const SearchParametersACORN* params,
+        ACORNSearchScratch* scratch) const {
+    ACORNSearchScratch local_scratch;
+    if (!scratch) {
+        scratch = &local_scratch;
+    }
+    scratch->prepare(*this);
+    HybridSearchDispatch<char*, VT> f = {
+            *this, k, I, D, vt, *scratch, filter_map, params};
+    return with_concrete_distance_computer(qdis, f);
+}
+
+template <class VT>
+ACORNStats ACORN::hybrid_search(
+        DistanceComputer& qdis,
+        int k,
+        idx_t* I,
+        float* D,
+        VT& vt,
+        const IDSelector* filter,
+        const SearchParametersACORN* params,
+        ACORNSearchScratch* scratch) const {
+    ACORNSearchScratch local_scratch;
+    if (!scratch) {
+        scratch = &local_scratch;
+    }
+    scratch->prepare(*this);
+    HybridSearchDispatch<const IDSelector*, VT> f = {
+            *this, k, I, D, vt, *scratch, filter, params};
+    return with_concrete_distance_computer(qdis, f);
+}
+
+template <class VT>
+ACORNStats ACORN::hybrid_search_parallel(
+        const std::vector<DistanceComputer*>& qdis,
+        int k,
+        idx_t* I,
+        float* D,
+        VT& vt,
+        char* filter_map,
+        const SearchParametersACORN* params) const {
+    FAISS_THROW_IF_NOT(!qdis.empty());
+    // for the upper levels, level 0 has per-thread buffers
+    ACORNSearchScratch scratch;
+    scratch.prepare(*this);
+    HybridSearchImpl<DistanceComputer, VT> impl = {
+            *this, *qdis[0], k, I, D, vt, scratch, params, &qdis};
+    return impl.dispatch(filter_map);
+}
+
+template <class VT>
+ACORNStats ACORN::hybrid_search_parallel(
+        const std::vector<DistanceComputer*>& qdis,
+        int k,
+        idx_t* I,
+        float* D,
+        VT& vt,
+        const IDSelector* filter,
+        const SearchParametersACORN* params) const {
+    FAISS_THROW_IF_NOT(!qdis.empty());
+    // for the upper levels, level 0 has per-thread buffers
+    ACORNSearchScratch scratch;
+    scratch.prepare(*this);
+    HybridSearchImpl<DistanceComputer, VT> impl = {
+            *this, *qdis[0], k, I, D, vt, scratch, params, &qdis};
+    return impl.dispatch(filter);
+}
+
+template <class VT>
+ACORNStats ACORN::range_search(
+        DistanceComputer& qdis,
+        float radius,
+        std::vector<float>& D,
+        std::vector<idx_t>& I,
+        VT& vt,
+        const IDSelector* filter,
+        const SearchParametersACORN* params,
+        ACORNSearchScratch* scratch) const {
+    ACORNSearchScratch local_scratch;
+    if (!scratch) {
+        scratch = &local_scratch;
+    }
+    scratch->prepare(*this);
+    RangeSearchDispatch<VT> f = {
+            *this, radius, D, I, vt, *scratch, filter, params};
+    return with_concrete_distance_computer(qdis, f);
+}
+
+/**************************************************************
+ * Interleaved hybrid searches
+ **************************************************************/
+
+/// level 0 hybrid search of one query, advanced one step at a time
+struct ACORNInterleavedSearch::Traversal {
+    /// advances the search by one step, returns false when it is finished
+    virtual bool step() = 0;
+
+    /// adds the stats of the finished search to stats
+    virtual void finish(ACORNStats& stats) = 0;
+
+    virtual ~Traversal() {}
+};
+
+namespace {
+
+/* The steps alternate between two phases: the neighbor list of the
+ * current candidate is read and the filter and visited flags of its
+ * neighbors are prefetched; at the next step, the candidate is expanded
+ * and the neighbor list of the next candidate is prefetched. The other
+ * queries are processed in between, which gives the prefetches time to
+ * complete. The expansions are those of hybrid_search_impl, in the same
+ * order. */
+template <class Filter, class DC, class VT>
+struct HybridTraversal : ACORNInterleavedSearch::Traversal {
+    const ACORN& hnsw;
+    DC& qdis;
+    Filter filter;
+    int k;
+    idx_t* I;
+    float* D;
+    VT& vt;
+
+    // can be overridden by search params
+    bool do_dis_check;
+    int efSearch;
+    const IDSelector* sel;
+
+    MinimaxHeap candidates;
+    int nres = 0;
+    int ndis = 0;
+    int ndis_upper = 0;
+    int nstep = 0;
+    bool active = true;
+
+    /// candidate of the next expansion and its neighbor list
+    storage_idx_t v0 = -1;
+    const storage_idx_t* neighbors0 = nullptr;
+    size_t n0 = 0;
+    bool expand_next = false;
+
+    ACORNSearchScratch scratch;
+
+    HybridTraversal(
+            const ACORN& hnsw,
+            DC& qdis,
+            const Filter& filter,
+            int k,
+            idx_t* I,
+            float* D,
+            VT& vt,
+            const SearchParametersACORN* params)
+            : hnsw(hnsw),
+              qdis(qdis),
+              filter(filter),
+              k(k),
+              I(I),
+              D(D),
+              vt(vt),
+              do_dis_check(
+                      params ? params->check_relative_distance
+                             : hnsw.check_relative_distance),
+              efSearch(params ? params->efSearch : hnsw.efSearch),
+              sel(params ? params->sel : nullptr),
+              candidates(std::max(
+                      params ? params->efSearch : hnsw.efSearch, k)) {
+        scratch.prepare(hnsw);
+        storage_idx_t nearest;
+        float d_nearest;
+        ndis_upper = hybrid_search_upper_levels(
+                hnsw, qdis, filter, nearest, d_nearest, scratch);
+        if (filter(nearest) && (!sel || sel->is_member(nearest)) &&
+            !hnsw.is_deleted(nearest)) {
+            faiss::maxheap_push(++nres, D, I, d_nearest, nearest);
+        }
+        vt.set(nearest);
+        candidates.push(nearest, d_nearest);
+        active = next_candidate();
+    }
+
+    /// pops the candidate to expand next, returns false if the search
+    /// stops there
+    bool next_candidate() {
+        if (candidates.size() == 0) {
+            return false;
+        }
+        float d0 = 0;
+        v0 = candidates.pop_min(&d0);
+        if (do_dis_check && candidates.count_below(d0) >= efSearch) {
+            return false;
+        }
+        prefetch_neighbor_list(hnsw, v0, 0);
+        expand_next = false;
+        return true;
+    }
+
+    bool step() override {
+        if (!active) {
+            return false;
+        }
+        if (!expand_next) {
+            neighbors0 = hnsw.get_neighbors(v0, 0, scratch.buf0.data(), &n0);
+            for (size_t j = 0; hnsw.use_prefetch && j < n0; j++) {
+                storage_idx_t v1 = neighbors0[j];
+                if (v1 < 0) {
+                    break;
+                }
+                filter.prefetch(v1);
+                vt.prefetch(v1);
+            }
+            expand_next = true;
+            return true;
+        }
+        HeapResults res(k, I, D, nres);
+        hybrid_expand_candidate(
+                hnsw,
+                qdis,
+                filter,
+                sel,
+                neighbors0,
+                n0,
+                0,
+                res,
+                ndis,
+                candidates,
+                vt,
+                scratch);
+        nres = res.nres;
+        nstep++;
+        if (!do_dis_check && nstep > efSearch) {
+            active = false;
+        } else {
+            active = next_candidate();
+        }
+        return active;
+    }
+
+    void finish(ACORNStats& stats) override {
+        stats.n1++;
+        if (candidates.size() == 0) {
+            stats.n2++;
+        }
+        stats.n3 += ndis_upper + ndis;
+        vt.advance();
+    }
+};
+
+template <class DC, class VT>
+struct MakeHybridTraversal {
+    const ACORN& acorn;
+    DC& qdis;
+    int k;
+    idx_t* I;
+    float* D;
+    VT& vt;
+    const SearchParametersACORN* params;
+
+    template <class Filter>
+    ACORNInterleavedSearch::Traversal* operator()(const Filter& filter) const {
+        return new HybridTraversal<Filter, DC, VT>(
+                acorn, qdis, filter, k, I, D, vt, params);
+    }
+};
+
+/// creates the traversal for the concrete types of the distance computer
+/// and of the filter
+template <class FilterArg, class VT>
+struct HybridTraversalDispatch {
+    const ACORN& acorn;
+    int k;
+    idx_t* I;
+    float* D;
+    VT& vt;
+    FilterArg filter;
+    const SearchParametersACORN* params;
+
+    template <class DC>
+    ACORNInterleavedSearch::Traversal* operator()(DC& qdis) const {
+        MakeHybridTraversal<DC, VT> make = {acorn, qdis, k, I, D, vt, params};
+        return with_filter(filter, make);
+    }
+};
+
+template <class FilterArg, class VT>
+void add_interleaved_search(
+        ACORNInterleavedSearch& search,
+        DistanceComputer& qdis,
+        int k,
+        idx_t* I,
+        float* D,
+        VT& vt,
+        FilterArg filter,
+        const SearchParametersACORN* params) {
+    const ACORN& acorn = search.acorn;
+    if (acorn.entry_point == -1) {
+        return;
+    }
+    // the adaptive termination is not interleaved
+    if (acorn.upper_beam != 1 || !acorn.search_bounded_queue ||
+        (params && params->convergence_patience > 0)) {
+        ACORNSearchScratch scratch;
+        scratch.prepare(acorn);
+        HybridSearchDispatch<FilterArg, VT> f = {
+                acorn, k, I, D, vt, scratch, filter, params};
+        search.stats.combine(with_concrete_distance_computer(qdis, f));
+        return;
+    }
+    HybridTraversalDispatch<FilterArg, VT> f = {
+            acorn, k, I, D, vt, filter, params};
+    search.traversals.emplace_back(with_concrete_distance_computer(qdis, f));
+}
+
+} // anonymous namespace
+
+ACORNInterleavedSearch::ACORNInterleavedSearch(const ACORN& acorn)
+        : acorn(acorn) {}
 
+ACORNInterleavedSearch::~ACORNInterleavedSearch() {}
 
+template <class VT>
+void ACORNInterleavedSearch::add(
+        DistanceComputer& qdis,
+        int k,
+        idx_t* I,
+        float* D,
+        VT& vt,
+        char* filter_map,
+        const SearchParametersACORN* params) {
+    add_interleaved_search(*this, qdis, k, I, D, vt, filter_map, params);
+}
 
+template <class VT>
+void ACORNInterleavedSearch::add(
+        DistanceComputer& qdis,
+        int k,
+        idx_t* I,
+        float* D,
+        VT& vt,
+        const IDSelector* filter,
+        const SearchParametersACORN* params) {
+    add_interleaved_search(*this, qdis, k, I, D, vt, filter, params);
+}
 
+/* the search routines are instantiated for the two visited sets, the
+ * type is chosen by the caller (IndexACORN::visited_set_type) */
+#define INSTANTIATE_ACORN_SEARCH(VT)                                       \
+    template ACORNStats ACORN::search<VT>(                                 \
+            DistanceComputer&,                                             \
+            int,                                                           \
+            idx_t*,                                                        \
+            float*,                                                        \
+            VT&,                                                           \
+            const SearchParametersACORN*,                                  \
+            ACORNSearchScratch*) const;                                    \
+    template ACORNStats ACORN::hybrid_search<VT>(                          \
+            DistanceComputer&,                                             \
+            int,                                                           \
+            idx_t*,                                                        \
+            float*,                                                        \
+            VT&,                                                           \
+            char*,                                                         \
+            const SearchParametersACORN*,                                  \
+            ACORNSearchScratch*) const;                                    \
+    template ACORNStats ACORN::hybrid_search<VT>(                          \
+            DistanceComputer&,                                             \
+            int,                                                           \
+            idx_t*,                                                        \
+            float*,                                                        \
+            VT&,                                                           \
+            const IDSelector*,                                             \
+            const SearchParametersACORN*,                                  \
+            ACORNSearchScratch*) const;                                    \
+    template ACORNStats ACORN::hybrid_search_parallel<VT>(                 \
+            const std::vector<DistanceComputer*>&,                         \
+            int,                                                           \
+            idx_t*,                                                        \
+            float*,                                                        \
+            VT&,                                                           \
+            char*,                                                         \
+            const SearchParametersACORN*) const;                           \
+    template ACORNStats ACORN::hybrid_search_parallel<VT>(                 \
+            const std::vector<DistanceComputer*>&,                         \
+            int,                                                           \
+            idx_t*,                                                        \
+            float*,                                                        \
+            VT&,                                                           \
+            const IDSelector*,                                             \
+            const SearchParametersACORN*) const;                           \
+    template ACORNStats ACORN::range_search<VT>(                           \
+            DistanceComputer&,                                             \
+            float,                                                         \
+            std::vector<float>&,                                           \
+            std::vector<idx_t>&,                                           \
+            VT&,                                                           \
+            const IDSelector*,                                             \
+            const SearchParametersACORN*,                                  \
+            ACORNSearchScratch*) const;                                    \
+    template void ACORNInterleavedSearch::add<VT>(                         \
+            DistanceComputer&,                                             \
+            int,                                                           \
+            idx_t*,                                                        \
+            float*,                                                        \
+            VT&,                                                           \
+            char*,                                                         \
+            const SearchParametersACORN*);                                 \
+    template void ACORNInterleavedSearch::add<VT>(                         \
+            DistanceComputer&,                                             \
+            int,                                                           \
+            idx_t*,                                                        \
+            float*,                                                        \
+            VT&,                                                           \
+            const IDSelector*,                                             \
+            const SearchParametersACORN*);
+
+INSTANTIATE_ACORN_SEARCH(VisitedTable)
+INSTANTIATE_ACORN_SEARCH(ACORNVisitedHashSet)
+
+#undef INSTANTIATE_ACORN_SEARCH
+
+ACORNStats ACORNInterleavedSearch::run() {
+    ACORNStats result = stats;
+    stats.reset();
+    // round-robin over the active searches, a finished search is replaced
+    // by the last active one
+    size_t nactive = traversals.size();
+    while (nactive > 0) {
+        for (size_t i = 0; i < nactive;) {
+            if (traversals[i]->step()) {
+                i++;
+            } else {
+                traversals[i]->finish(result);
+                std::swap(traversals[i], traversals[nactive - 1]);
+                nactive--;
+            }
+        }
+    }
+    traversals.clear();
+    return result;
+}
 
 /**************************************************************
  * MinimaxHeap
@@ -9,6 +9,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <memory>
 #include <queue>
 #include <unordered_set>
 #include <vector>
@@ -16,7 +18,9 @@
 #include <omp.h>
 
 #include <faiss/Index.h>
+#include <faiss/impl/ACORNAttributes.h>
 #include <faiss/impl/FaissAssert.h>
+#include <faiss/impl/maybe_owned_vector.h>
 #include <faiss/impl/platform_macros.h>
 #include <faiss/utils/Heap.h>
 #include <faiss/utils/random.h>
@@ -35,14 +39,154 @@ namespace faiss {
 struct VisitedTable;
 struct DistanceComputer; // from AuxIndexStructures
 struct ACORNStats;
+struct ACORNBuildScratch;
+struct ACORNSearchScratch;
+struct HNSW;
 
 struct SearchParametersACORN : SearchParameters {
     int efSearch = 16;
     bool check_relative_distance = true;
 
+    /** adaptive termination of the level 0 hybrid search, 0 = fixed
+     * efSearch. Heuristic, with no recall guarantee: the search stops once
+     * it has k results that did not change during convergence_patience
+     * consecutive expansions, so easy queries stop early. Until then, the
+     * beam grows from efSearch up to efSearch_max (0 = 8 * efSearch)
+     * instead of dropping candidates, so hard queries (eg. sparse filters)
+     * get more budget. Not used by the intra-query parallel search. */
+    int convergence_patience = 0;
+    int efSearch_max = 0;
+
     ~SearchParametersACORN() {}
 };
 
+/** Visited set of the ACORN searches that visit a small fraction of a very
+ * large index. The visited ids are stored in an open-addressing hash
+ * table sized by the number of visited ids, instead of the byte array of
+ * size ntotal of VisitedTable, which it can replace in the search
+ * routines. The table is not shrunk by advance(). */
+struct ACORNVisitedHashSet {
+    /// slots of the hash table, -1 if empty. The size is a power of 2
+    std::vector<int> slots;
+
+    /// nb of ids in the table
+    size_t count = 0;
+
+    ACORNVisitedHashSet() : slots(1024, -1) {}
+
+    /// set flag #no to true
+    void set(int no) {
+        insert(no);
+    }
+
+    /// get flag #no
+    bool get(int no) const {
+        return slots[find(no)] == no;
+    }
+
+    /// the slot depends on the hash table, there is nothing to prefetch
+    void prefetch(int) const {}
+
+    /// reset all flags to false
+    void advance() {
+        if (count > 0) {
+            std::fill(slots.begin(), slots.end(), -1);
+            count = 0;
+        }
+    }
+
+    /// set flag #no to true, returns whether it was false
+    bool insert(int no) {
+        size_t slot = find(no);
+        if (slots[slot] == no) {
+            return false;
+        }
+        slots[slot] = no;
+        count++;
+        if (count * 2 > slots.size()) {
+            std::vector<int> old(slots.size() * 2, -1);
+            old.swap(slots);
+            for (int v : old) {
+                if (v >= 0) {
+                    slots[find(v)] = v;
+                }
+            }
+        }
+        return true;
+    }
+
+    /// slot of no in the hash table, or the empty slot where it goes
+    size_t find(int no) const {
+        size_t mask = slots.size() - 1;
+        uint32_t h = no;
+        h = ((h >> 16) ^ h) * 0x45d9f3bU;
+        h = ((h >> 16) ^ h) * 0x45d9f3bU;
+        size_t slot = ((h >> 16) ^ h) & mask;
+        while (slots[slot] != -1 && slots[slot] != no) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    int num_visited() const {
+        return count;
+    }
+};
+
+/** Level 0 of an ACORN graph in compressed form (see
+ * ACORN::compress_level0). The neighbor lists are stored without their -1
+ * padding and each neighbor id is bit-packed on nbits bits. The lists keep
+ * their order: the hybrid search expands neighbors differently depending
+ * on their rank in the list, so they cannot be sorted. */
+struct ACORNCompressedLinks {
+    using storage_idx_t = int32_t;
+
+    /// nb of bits per neighbor id
+    int nbits = 0;
+
+    /// the offsets of the lists are stored per block of 2^block_bits
+    /// vertices: absolute for the block in block_lims, 32-bit relative to
+    /// the block in lims, so that they cost 4 bytes per vertex
+    static const int block_bits = 6;
+
+    /// block_lims[b] is the first entry of vertex b << block_bits
+    std::vector<size_t> block_lims;
+
+    /// lims[i] is the first entry of vertex i relative to its block, the
+    /// neighbors of vertex i are the entries begin(i):begin(i + 1)
+    std::vector<uint32_t> lims;
+
+    /// bit-packed entries, followed by 8 bytes of padding so that decoding
+    /// can always read 64-bit words
+    std::vector<uint8_t> codes;
+
+    /// encode n lists, list i is ids[begins[i]:begins[i + 1]], all ids
+    /// must be in [0, 2^nbits)
+    void encode(size_t n, const size_t* begins, const storage_idx_t* ids,
+                int nbits);
+
+    /// decode list i to out, returns its size
+    size_t decode(size_t i, storage_idx_t* out) const;
+
+    /// hint that list i will be decoded soon
+    void prefetch(size_t i) const;
+
+    /// nb of encoded lists (0 if level 0 is not compressed)
+    size_t size() const {
+        return lims.empty() ? 0 : lims.size() - 1;
+    }
+
+    /// first entry of list i, i = size() gives the total nb of entries
+    size_t begin(size_t i) const {
+        return block_lims[i >> block_bits] + lims[i];
+    }
+
+    /// sets the offsets from the absolute ones, abs_lims has n + 1 entries
+    void set_lims(size_t n, const size_t* abs_lims);
+
+    void reset();
+};
+
 struct ACORN {
     /// internal storage of vectors (32 bits: this is expensive)
     using storage_idx_t = int32_t;
@@ -105,24 +249,34 @@ struct ACORN {
     std::vector<int> cum_nneighbor_per_level;
 
     /// level of each vector (base level = 1), size = ntotal
-    std::vector<int> levels;
+    MaybeOwnedVector<int> levels;
 
     // added to reference during hybrid construction
     std::vector<storage_idx_t> nb_per_level;
 
     /// offsets[i] is the offset in the neighbors array where vector i is stored
     /// size ntotal + 1
-    std::vector<size_t> offsets;
+    MaybeOwnedVector<size_t> offsets;
 
     /// neighbors[offsets[i]:offsets[i+1]] is the list of neighbors of vector i
     /// for all levels. this is where all storage goes.
-    std::vector<NeighNode> neighbors; // changed to add metadata
+    MaybeOwnedVector<NeighNode> neighbors; // changed to add metadata
+
+    /// level 0 when it is compressed. The neighbors table then only
+    /// contains the levels >= 1
+    ACORNCompressedLinks compressed_level0;
 
 
     /// entry point in the search structure (one of the points with maximum
     /// level
     storage_idx_t entry_point;
 
+    /// entry points of the hybrid search for the frequent values of an
+    /// attribute, see set_attribute_entry_points. The search starts from
+    /// the nearest one that passes the filter, if any, instead of
+    /// entry_point
+    std::vector<storage_idx_t> attribute_entry_points;
+
     faiss::RandomGenerator rng;
 
     /// multiplier of M for max edges per vertex
@@ -151,6 +305,14 @@ struct ACORN {
     /// use bounded queue during exploration
     bool search_bounded_queue = true;
 
+    /** issue software prefetches for the neighbor lists, vectors, filter
+     * entries and visited flags during the graph traversals. Off by
+     * default: on an index that fits in the caches they only add
+     * instructions (about 20% fewer QPS). Enable it only for indexes much
+     * larger than the LLC after measuring with bench_acorn_search. Not
+     * stored in the index. */
+    bool use_prefetch = false;
+
 
     // methods that initialize the tree sizes
 
@@ -173,13 +335,38 @@ struct ACORN {
     int cum_nb_neighbors(int layer_no) const;
 
     /// range of entries in the neighbors table of vertex no at layer_no
+    /// (layer_no > 0 when level 0 is compressed)
     void neighbor_range(idx_t no, int layer_no, size_t* begin, size_t* end)
             const;
 
+    /** neighbors of vertex no at layer_no, followed by -1 entries if the
+     * list is not full. Points to the neighbors table, or to buf (of size
+     * nb_neighbors(0)) where the compressed level 0 is decoded.
+     *
+     * @param n    size of the returned array
+     */
+    const storage_idx_t* get_neighbors(
+            idx_t no,
+            int layer_no,
+            storage_idx_t* buf,
+            size_t* n) const;
+
+    /** Compress level 0 of the graph. Its lists move from the neighbors
+     * table to compressed_level0, after that the index can be searched
+     * but no vectors can be added. */
+    void compress_level0();
+
+    bool is_level0_compressed() const {
+        return compressed_level0.size() > 0;
+    }
+
     /// only mandatory parameter: nb of neighbors
     // explicit HNSW(int M = 32);
     explicit ACORN(int M, int gamma, std::vector<int>& metadata, int M_beta);
 
+    /// without legacy metadata (eg. for indexes read from disk)
+    explicit ACORN(int M = 32, int gamma = 1, int M_beta = 32);
+
     /// pick a random level for a new point
     int random_level();
 
@@ -192,9 +379,9 @@ struct ACORN {
             storage_idx_t nearest,
             float d_nearest,
             int level,
-            omp_lock_t* locks,
+            std::vector<omp_lock_t>& locks,
             VisitedTable& vt,
-            std::vector<storage_idx_t> ep_per_level = {});
+            ACORNBuildScratch* scratch = nullptr);
 
     // void hybrid_add_links_starting_from(
     //         DistanceComputer& ptdis,
@@ -207,24 +394,89 @@ struct ACORN {
     //         std::vector<storage_idx_t> ep_per_level = {});
 
     /** add point pt_id on all levels <= pt_level and build the link
-     * structure for them. */
+     * structure for them. The locks are striped: vertex i is protected by
+     * locks[i % locks.size()]. On an empty graph, the first vertex must be
+     * added before the others are added in parallel.
+     *
+     * @param scratch  buffers of the calling thread, allocated locally if
+     *                 null */
     void add_with_locks(
             DistanceComputer& ptdis,
             int pt_level,
             int pt_id,
             std::vector<omp_lock_t>& locks,
-            VisitedTable& vt);
-
-
-
-    /// search interface for 1 point, single thread
+            VisitedTable& vt,
+            ACORNBuildScratch* scratch = nullptr);
+
+    /** new list of links of vertex no at level, without the removed
+     * vertices. The candidates are the remaining neighbors of no and the
+     * remaining neighbors of its removed neighbors, pruned as in add_link.
+     * The graph is only read, so several vertices can be repaired in
+     * parallel before their lists are written back.
+     *
+     * @param out  size nb_neighbors(level), padded with -1
+     * @return     false if the list has no link to a removed vertex (out
+     *             is then not filled) */
+    bool repair_links(
+            DistanceComputer& qdis,
+            storage_idx_t no,
+            int level,
+            std::vector<storage_idx_t>& out,
+            ACORNBuildScratch* scratch = nullptr);
+
+    /** initialize an empty graph with the structure of an HNSW graph on
+     * the same vectors: the levels, the entry point and the links of all
+     * the levels are copied (the lists are truncated to nb_neighbors).
+     * Level 0 is then meant to be rebuilt with densify_level0. */
+    void copy_from_hnsw(const HNSW& hnsw);
+
+    /** new level 0 list of vertex no: the efConstruction vertices closest
+     * to no in its two-hop neighborhood at level 0, pruned with the ACORN
+     * rule of shrink_neighbor_list. The graph is only read, so the lists
+     * of all the vertices can be computed in parallel before they are
+     * written back.
+     *
+     * @param out  size nb_neighbors(0), padded with -1 */
+    void densify_level0(
+            DistanceComputer& qdis,
+            storage_idx_t no,
+            std::vector<storage_idx_t>& out,
+            ACORNBuildScratch* scratch = nullptr);
+
+    /** remove the vertices flagged in deleted from the graph and renumber
+     * the remaining ones in order. The links to removed vertices are
+     * dropped, so repair their neighbors first.
+     *
+     * @param map  output, size ntotal, new id of each vertex or -1
+     * @return     nb of remaining vertices */
+    size_t remove_deleted(std::vector<idx_t>& map);
+
+    /** order of the vertices for reorder_nodes: breadth-first traversal
+     * of level 0 from the entry point (the vertices that are not reached
+     * follow, in the same way). Neighbors in the graph get close ids, so
+     * that a search touches fewer cache lines and pages.
+     *
+     * @param perm  output, size ntotal, perm[i] = vertex at position i */
+    void bfs_order(std::vector<idx_t>& perm) const;
+
+    /** renumber the vertices: vertex perm[i] becomes i. The levels,
+     * links, tombstones, entry points, legacy metadata and attribute
+     * columns are permuted together. */
+    void reorder_nodes(const idx_t* perm);
+
+    /** search interface for 1 point, single thread. In the search
+     * routines, vt is a VisitedTable or an ACORNVisitedHashSet, and
+     * scratch holds the buffers of the calling thread (allocated locally
+     * if null). */
+    template <class VT>
     ACORNStats search(
             DistanceComputer& qdis,
             int k,
             idx_t* I,
             float* D,
-            VisitedTable& vt,
-            const SearchParametersACORN* params = nullptr) const;
+            VT& vt,
+            const SearchParametersACORN* params = nullptr,
+            ACORNSearchScratch* scratch = nullptr) const;
 
 
     
@@ -234,21 +486,94 @@ struct ACORN {
     /// search interface for 1 point, single thread
     const int* metadata;
     std::vector<std::string> metadata_strings;
+
+    /// backs metadata for indexes read from disk, empty otherwise
+    std::vector<int> loaded_metadata;
+
+    /// typed attribute columns of the stored vectors, filters on them are
+    /// built with IDSelectorAttributeEqual / IDSelectorAttributeRange
+    ACORNAttributes attributes;
+
+    /// tombstones: deleted[i] is set if vector i was removed. Removed
+    /// vectors are still traversed but never returned. Empty if no vector
+    /// was removed since the last compaction
+    std::vector<uint8_t> deleted;
+
+    /// nb of vectors flagged in deleted
+    size_t ndeleted = 0;
+
+    bool is_deleted(idx_t i) const {
+        return size_t(i) < deleted.size() && deleted[i];
+    }
     // std::vector<std::string> metadata_strings_vec;
 
 
+    template <class VT>
     ACORNStats hybrid_search(
             DistanceComputer& qdis,
             int k,
             idx_t* I,
             float* D,
-            VisitedTable& vt,
+            VT& vt,
+            char* filter_map,
+            const SearchParametersACORN* params = nullptr,
+            ACORNSearchScratch* scratch = nullptr) const;
+
+    /** same as above, with the filter given as an IDSelector (bitmap,
+     * sorted id list, range, predicate...). It is evaluated only on the
+     * nodes visited by the traversal, so no per-query byte map of size
+     * ntotal is needed. */
+    template <class VT>
+    ACORNStats hybrid_search(
+            DistanceComputer& qdis,
+            int k,
+            idx_t* I,
+            float* D,
+            VT& vt,
+            const IDSelector* filter,
+            const SearchParametersACORN* params = nullptr,
+            ACORNSearchScratch* scratch = nullptr) const;
+
+    /** hybrid_search for a single query, with the level 0 explored by
+     * qdis.size() threads that share the candidate queue, the results and
+     * the visited table. Reduces the latency when efSearch is large. All
+     * the distance computers must be set to the query. */
+    template <class VT>
+    ACORNStats hybrid_search_parallel(
+            const std::vector<DistanceComputer*>& qdis,
+            int k,
+            idx_t* I,
+            float* D,
+            VT& vt,
             char* filter_map,
-            // int filter,
-            // Operation op,
-            // std::string regex,
             const SearchParametersACORN* params = nullptr) const;
 
+    template <class VT>
+    ACORNStats hybrid_search_parallel(
+            const std::vector<DistanceComputer*>& qdis,
+            int k,
+            idx_t* I,
+            float* D,
+            VT& vt,
+            const IDSelector* filter,
+            const SearchParametersACORN* params = nullptr) const;
+
+    /** range search for a single query: the vectors at distance below
+     * radius (unordered) and accepted by filter, which may be null. The
+     * level 0 search is restarted with a doubled efSearch as long as the
+     * results fill the candidate queue, so that the size of the result
+     * set is not bounded by efSearch. */
+    template <class VT>
+    ACORNStats range_search(
+            DistanceComputer& qdis,
+            float radius,
+            std::vector<float>& D,
+            std::vector<idx_t>& I,
+            VT& vt,
+            const IDSelector* filter,
+            const SearchParametersACORN* params = nullptr,
+            ACORNSearchScratch* scratch = nullptr) const;
+
     /**************************************************************
     **************************************************************/
  
@@ -265,12 +590,102 @@ struct ACORN {
 
     int prepare_level_tab(size_t n, bool preset_levels = false);
 
+    /** fill attribute_entry_points with, for each of the max_values most
+     * frequent values of the column, one of the vertices of highest level
+     * that have this value. Call it after adding the vectors: the entry
+     * points are not updated by later adds. */
+    void set_attribute_entry_points(
+            const ACORNAttributeColumn& col,
+            size_t max_values = 256);
+
+    /** allocate the graph arrays for n vectors in total, so that adding
+     * them by batches does not reallocate (and temporarily double) the
+     * arrays. The neighbors are sized from the expected level
+     * distribution. */
+    void reserve(size_t n);
 
+
+    /// scratch: buffers to reuse across calls, allocated locally if null
     void shrink_neighbor_list(
-            DistanceComputer& qdis,
             std::priority_queue<NodeDistFarther>& input,
             std::vector<NodeDistFarther>& output,
-            int max_size, int gamma = 1, storage_idx_t q_id = 0, int q_attr = 0);
+            int max_size, int gamma = 1,
+            ACORNBuildScratch* scratch = nullptr);
+};
+
+/** Buffers of one construction thread, reused across insertions so that
+ * the inner loops of add_with_locks do not allocate. */
+struct ACORNBuildScratch {
+    using storage_idx_t = ACORN::storage_idx_t;
+
+    /// priority_queue that keeps its storage when it is cleared
+    template <class T>
+    struct Queue : std::priority_queue<T> {
+        void clear() {
+            this->c.clear();
+        }
+    };
+
+    /** Set of vertex ids used by the pruning in shrink_neighbor_list. It
+     * is an open addressing table whose slots are tagged with the epoch
+     * in which they were filled, so clearing it is O(1). */
+    struct NeighborSet {
+        std::vector<storage_idx_t> keys;
+        std::vector<uint32_t> epochs;
+        uint32_t epoch = 0;
+        size_t count = 0;
+
+        /// empty the set, it can then hold n ids without growing
+        void clear(size_t n);
+
+        /// returns whether id was not in the set yet
+        bool insert(storage_idx_t id);
+
+        bool contains(storage_idx_t id) const;
+
+        size_t size() const {
+            return count;
+        }
+
+       private:
+        size_t slot(storage_idx_t id) const;
+        void grow();
+    };
+
+    NeighborSet neigh_of_neigh;
+
+    /// search_neighbors_to_add
+    Queue<ACORN::NodeDistFarther> candidates;
+    std::vector<storage_idx_t> batch_ids;
+    std::vector<float> batch_dis;
+
+    /// add_links_starting_from
+    Queue<ACORN::NodeDistCloser> link_targets;
+    std::vector<storage_idx_t> linked;
+
+    /// add_link
+    Queue<ACORN::NodeDistCloser> link_candidates;
+
+    /// shrink_neighbor_list
+    Queue<ACORN::NodeDistFarther> shrink_input;
+    std::vector<ACORN::NodeDistFarther> shrink_output;
+};
+
+/** Buffers of one search thread, reused across queries so that the
+ * traversal routines of the searches do not allocate. */
+struct ACORNSearchScratch {
+    using storage_idx_t = ACORN::storage_idx_t;
+
+    /// new two-hop neighbors that pass the filter and their distances,
+    /// computed in batches
+    std::vector<storage_idx_t> batch_ids;
+    std::vector<float> batch_dis;
+
+    /// decoded neighbor lists when level 0 is compressed
+    std::vector<storage_idx_t> buf0, buf1;
+
+    /// size the buffers for the longest neighbor list of acorn
+    void prepare(const ACORN& acorn);
 };
 
 struct ACORNStats {
@@ -285,6 +700,20 @@ struct ACORNStats {
     double skips;
     double visits;
 
+    /// nb of filtered queries answered by an exact scan of the matching
+    /// vectors / by an unfiltered graph search whose results are filtered
+    /// (see IndexACORN::brute_force_selectivity). The other filtered
+    /// queries use the hybrid search.
+    size_t n_brute_force = 0;
+    size_t n_post_filter = 0;
+
+    /// filtered queries with fewer than k results that were completed by
+    /// a search with a wider beam / by an exact scan, and the nb of
+    /// distances computed by these fallbacks (included in n3, see
+    /// IndexACORN::complete_results)
+    size_t n_fallback_beam = 0;
+    size_t n_fallback_scan = 0;
+    size_t n3_fallback = 0;
 
     ACORNStats(
             size_t n1 = 0,
@@ -310,6 +739,11 @@ struct ACORNStats {
         tuple_unwrap = 0.0;
         skips = 0.0;
         visits = 0.0;
+        n_brute_force = 0;
+        n_post_filter = 0;
+        n_fallback_beam = 0;
+        n_fallback_scan = 0;
+        n3_fallback = 0;
     }
 
     void combine(const ACORNStats& other) {
@@ -325,7 +759,67 @@ struct ACORNStats {
         tuple_unwrap += other.tuple_unwrap;
         skips = other.skips;
         visits = other.visits;
+        n_brute_force += other.n_brute_force;
+        n_post_filter += other.n_post_filter;
+        n_fallback_beam += other.n_fallback_beam;
+        n_fallback_scan += other.n_fallback_scan;
+        n3_fallback += other.n3_fallback;
+    }
+};
+
+/** Hybrid searches of several queries interleaved on one thread, to hide
+ * the memory latency of the graph walk. add() runs the greedy search of a
+ * query on the upper levels, run() then advances the level 0 traversals
+ * of all the added queries in round-robin, one candidate expansion at a
+ * time. The neighbor list of the next candidate of a query and the flags
+ * of its neighbors are prefetched while the other queries are processed.
+ *
+ * The results are the same as with ACORN::hybrid_search. Each query needs
+ * its own distance computer (set to the query) and visited table, and its
+ * result heap must be initialized by the caller; they must stay valid
+ * until run() returns. */
+struct ACORNInterleavedSearch {
+    /// level 0 search of one query, defined in ACORN.cpp
+    struct Traversal;
+
+    const ACORN& acorn;
+    std::vector<std::unique_ptr<Traversal>> traversals;
+
+    /// stats of the searches that were not interleaved (graphs searched
+    /// with upper_beam > 1)
+    ACORNStats stats;
+
+    explicit ACORNInterleavedSearch(const ACORN& acorn);
+
+    template <class VT>
+    void add(
+            DistanceComputer& qdis,
+            int k,
+            idx_t* I,
+            float* D,
+            VT& vt,
+            char* filter_map,
+            const SearchParametersACORN* params = nullptr);
+
+    template <class VT>
+    void add(
+            DistanceComputer& qdis,
+            int k,
+            idx_t* I,
+            float* D,
+            VT& vt,
+            const IDSelector* filter,
+            const SearchParametersACORN* params = nullptr);
+
+    /// nb of searches added since the last run()
+    size_t size() const {
+        return traversals.size();
     }
+
+    /// completes the added searches and returns their stats
+    ACORNStats run();
+
+    ~ACORNInterleavedSearch();
 };
 
 // global var that collects them all
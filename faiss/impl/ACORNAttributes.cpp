@@ -0,0 +1,288 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#include <faiss/impl/ACORNAttributes.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <faiss/impl/FaissAssert.h>
+
+namespace faiss {
+
+/**************************************************************
+ * ACORNAttributeColumn
+ **************************************************************/
+
+size_t ACORNAttributeColumn::size() const {
+    return type == ATTR_INT ? values.size()
+                            : (lims.size() == 0 ? 0 : lims.size() - 1);
+}
+
+bool ACORNAttributeColumn::has_value(idx_t i, int32_t v) const {
+    if (type == ATTR_INT) {
+        return values[i] == v;
+    }
+    const int32_t* begin = values.data() + lims[i];
+    const int32_t* end = values.data() + lims[i + 1];
+    return std::binary_search(begin, end, v);
+}
+
+bool ACORNAttributeColumn::has_value_in_range(
+        idx_t i,
+        int32_t vmin,
+        int32_t vmax) const {
+    if (type == ATTR_INT) {
+        return values[i] >= vmin && values[i] <= vmax;
+    }
+    const int32_t* begin = values.data() + lims[i];
+    const int32_t* end = values.data() + lims[i + 1];
+    const int32_t* lb = std::lower_bound(begin, end, vmin);
+    return lb != end && *lb <= vmax;
+}
+
+void ACORNAttributeColumn::ids_in_range(
+        int32_t vmin,
+        int32_t vmax,
+        std::vector<idx_t>& ids) const {
+    {
+        std::lock_guard<std::mutex> lock(inv_mutex);
+        if (!inv_valid) {
+            size_t n = size();
+            std::vector<std::pair<int32_t, idx_t>> entries;
+            entries.reserve(values.size());
+            for (size_t i = 0; i < n; i++) {
+                if (type == ATTR_INT) {
+                    entries.emplace_back(values[i], i);
+                } else {
+                    for (size_t j = lims[i]; j < lims[i + 1]; j++) {
+                        entries.emplace_back(values[j], i);
+                    }
+                }
+            }
+            std::sort(entries.begin(), entries.end());
+            inv_values.resize(entries.size());
+            inv_ids.resize(entries.size());
+            for (size_t j = 0; j < entries.size(); j++) {
+                inv_values[j] = entries[j].first;
+                inv_ids[j] = entries[j].second;
+            }
+            inv_valid = true;
+        }
+    }
+    if (vmin > vmax) {
+        return;
+    }
+    size_t begin = std::lower_bound(inv_values.begin(), inv_values.end(), vmin) -
+            inv_values.begin();
+    size_t end = std::upper_bound(inv_values.begin(), inv_values.end(), vmax) -
+            inv_values.begin();
+    size_t n0 = ids.size();
+    ids.insert(ids.end(), inv_ids.begin() + begin, inv_ids.begin() + end);
+    if (vmin != vmax || type == ATTR_INT_SET) {
+        // several values: the ids are sorted per value only, and a set may
+        // contain several values of the range
+        std::sort(ids.begin() + n0, ids.end());
+        ids.erase(std::unique(ids.begin() + n0, ids.end()), ids.end());
+    }
+}
+
+void ACORNAttributeColumn::invalidate_inverted_index() {
+    std::lock_guard<std::mutex> lock(inv_mutex);
+    inv_valid = false;
+    inv_values.clear();
+    inv_ids.clear();
+}
+
+/**************************************************************
+ * ACORNAttributes
+ **************************************************************/
+
+int ACORNAttributes::add_int_column(
+        const std::string& name,
+        size_t n,
+        const int32_t* x) {
+    FAISS_THROW_IF_NOT_FMT(
+            column_no(name) < 0, "column %s already exists", name.c_str());
+    FAISS_THROW_IF_NOT_MSG(
+            columns.empty() || n == size(),
+            "all attribute columns must have the same size");
+    columns.emplace_back(new ACORNAttributeColumn());
+    ACORNAttributeColumn& col = *columns.back();
+    col.name = name;
+    col.type = ATTR_INT;
+    col.values.assign(x, x + n);
+    return columns.size() - 1;
+}
+
+int ACORNAttributes::add_int_set_column(
+        const std::string& name,
+        size_t n,
+        const size_t* lims,
+        const int32_t* x) {
+    FAISS_THROW_IF_NOT_FMT(
+            column_no(name) < 0, "column %s already exists", name.c_str());
+    FAISS_THROW_IF_NOT_MSG(
+            columns.empty() || n == size(),
+            "all attribute columns must have the same size");
+    columns.emplace_back(new ACORNAttributeColumn());
+    ACORNAttributeColumn& col = *columns.back();
+    col.name = name;
+    col.type = ATTR_INT_SET;
+    col.lims.resize(n + 1);
+    col.lims[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        FAISS_THROW_IF_NOT(lims[i + 1] >= lims[i]);
+        col.lims[i + 1] = col.lims[i] + lims[i + 1] - lims[i];
+    }
+    col.values.assign(x + lims[0], x + lims[n]);
+    for (size_t i = 0; i < n; i++) {
+        std::sort(
+                col.values.begin() + col.lims[i],
+                col.values.begin() + col.lims[i + 1]);
+    }
+    return columns.size() - 1;
+}
+
+int ACORNAttributes::column_no(const std::string& name) const {
+    for (size_t i = 0; i < columns.size(); i++) {
+        if (columns[i]->name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const ACORNAttributeColumn& ACORNAttributes::column(
+        const std::string& name) const {
+    int no = column_no(name);
+    FAISS_THROW_IF_NOT_FMT(no >= 0, "no attribute column %s", name.c_str());
+    return *columns[no];
+}
+
+size_t ACORNAttributes::size() const {
+    return columns.empty() ? 0 : columns[0]->size();
+}
+
+void ACORNAttributes::set_int(const std::string& name, idx_t i, int32_t v) {
+    int no = column_no(name);
+    FAISS_THROW_IF_NOT_FMT(no >= 0, "no attribute column %s", name.c_str());
+    ACORNAttributeColumn& col = *columns[no];
+    FAISS_THROW_IF_NOT_FMT(
+            col.type == ATTR_INT, "column %s is not scalar", name.c_str());
+    FAISS_THROW_IF_NOT(i >= 0 && size_t(i) < col.size());
+    col.values[i] = v;
+    col.invalidate_inverted_index();
+}
+
+void ACORNAttributes::set_int_set(
+        const std::string& name,
+        idx_t i,
+        size_t n,
+        const int32_t* x) {
+    int no = column_no(name);
+    FAISS_THROW_IF_NOT_FMT(no >= 0, "no attribute column %s", name.c_str());
+    ACORNAttributeColumn& col = *columns[no];
+    FAISS_THROW_IF_NOT_FMT(
+            col.type == ATTR_INT_SET,
+            "column %s is not multi-valued",
+            name.c_str());
+    FAISS_THROW_IF_NOT(i >= 0 && size_t(i) < col.size());
+    size_t n0 = col.lims[i + 1] - col.lims[i];
+    std::vector<int32_t>::iterator begin = col.values.begin() + col.lims[i];
+    if (n > n0) {
+        begin = col.values.insert(begin + n0, n - n0, 0) - n0;
+    } else {
+        begin = col.values.erase(begin + n, begin + n0) - n;
+    }
+    std::copy(x, x + n, begin);
+    std::sort(begin, begin + n);
+    for (size_t j = i + 1; j < col.lims.size(); j++) {
+        col.lims[j] = col.lims[j] + n - n0;
+    }
+    col.invalidate_inverted_index();
+}
+
+void ACORNAttributes::resize(size_t n) {
+    for (std::unique_ptr<ACORNAttributeColumn>& col_ptr : columns) {
+        ACORNAttributeColumn& col = *col_ptr;
+        col.invalidate_inverted_index();
+        FAISS_THROW_IF_NOT(n >= col.size());
+        if (col.type == ATTR_INT) {
+            col.values.resize(n, 0);
+        } else {
+            col.lims.resize(n + 1, col.values.size());
+        }
+    }
+}
+
+void ACORNAttributes::remap(size_t n, const idx_t* map) {
+    for (std::unique_ptr<ACORNAttributeColumn>& col_ptr : columns) {
+        ACORNAttributeColumn& col = *col_ptr;
+        col.invalidate_inverted_index();
+        FAISS_THROW_IF_NOT(col.size() == n);
+        size_t j = 0;
+        if (col.type == ATTR_INT) {
+            for (size_t i = 0; i < n; i++) {
+                if (map[i] >= 0) {
+                    col.values[j++] = col.values[i];
+                }
+            }
+            col.values.resize(j);
+        } else {
+            size_t o = 0;
+            for (size_t i = 0; i < n; i++) {
+                size_t begin = col.lims[i], end = col.lims[i + 1];
+                if (map[i] < 0) {
+                    continue;
+                }
+                col.lims[j++] = o;
+                for (size_t k = begin; k < end; k++) {
+                    col.values[o++] = col.values[k];
+                }
+            }
+            col.lims[j] = o;
+            col.lims.resize(j + 1);
+            col.values.resize(o);
+        }
+    }
+}
+
+void ACORNAttributes::permute(size_t n, const idx_t* perm) {
+    for (std::unique_ptr<ACORNAttributeColumn>& col_ptr : columns) {
+        ACORNAttributeColumn& col = *col_ptr;
+        col.invalidate_inverted_index();
+        FAISS_THROW_IF_NOT(col.size() == n);
+        std::vector<int32_t> values(col.values.size());
+        if (col.type == ATTR_INT) {
+            for (size_t i = 0; i < n; i++) {
+                values[i] = col.values[perm[i]];
+            }
+        } else {
+            std::vector<size_t> lims(n + 1);
+            size_t o = 0;
+            for (size_t i = 0; i < n; i++) {
+                lims[i] = o;
+                for (size_t k = col.lims[perm[i]]; k < col.lims[perm[i] + 1];
+                     k++) {
+                    values[o++] = col.values[k];
+                }
+            }
+            lims[n] = o;
+            col.lims.swap(lims);
+        }
+        col.values.swap(values);
+    }
+}
+
+void ACORNAttributes::reset() {
+    columns.clear();
+}
+
+} // namespace faiss
@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <faiss/Index.h>
+#include <faiss/impl/IDSelector.h>
+
+/** Attribute columns stored next to the ACORN graph, and predicates over
+ * them.
+ *
+ * The predicates are IDSelectors, so they can be passed directly to the
+ * filtered IndexACORN::search. They are evaluated only on the nodes that
+ * the graph traversal visits, which avoids building an O(ntotal) filter
+ * per query. */
+
+namespace faiss {
+
+enum ACORNAttributeType {
+    ATTR_INT = 0,     ///< one int per vector
+    ATTR_INT_SET = 1, ///< a (possibly empty) set of ints per vector
+};
+
+/** One attribute column, with a value or a set of values per vector.
+ * Modify it through ACORNAttributes, which keeps the inverted index in
+ * sync. */
+struct ACORNAttributeColumn {
+    std::string name;
+    ACORNAttributeType type;
+
+    /// for ATTR_INT_SET: the values of vector i are
+    /// values[lims[i]:lims[i + 1]], sorted. Empty for ATTR_INT.
+    std::vector<size_t> lims;
+    std::vector<int32_t> values;
+
+    /** inverted index of the column, built on first use by ids_in_range:
+     * one entry per (value, vector), sorted by value then by id */
+    mutable std::vector<int32_t> inv_values;
+    mutable std::vector<idx_t> inv_ids;
+    mutable bool inv_valid = false;
+    mutable std::mutex inv_mutex;
+
+    ACORNAttributeColumn() : type(ATTR_INT) {}
+
+    /// nb of vectors covered by the column
+    size_t size() const;
+
+    /// does vector i have value v
+    bool has_value(idx_t i, int32_t v) const;
+
+    /// does vector i have a value in [vmin, vmax] (bounds included)
+    bool has_value_in_range(idx_t i, int32_t vmin, int32_t vmax) const;
+
+    /** append to ids the vectors that have a value in [vmin, vmax], in
+     * increasing order, with the inverted index. Thread-safe. */
+    void ids_in_range(int32_t vmin, int32_t vmax, std::vector<idx_t>& ids)
+            const;
+
+    /// to call after modifying the values
+    void invalidate_inverted_index();
+};
+
+/** Set of named attribute columns, all covering the same vectors */
+struct ACORNAttributes {
+    /// the columns are allocated separately, so that the pointers held by
+    /// the predicates stay valid when columns are added
+    std::vector<std::unique_ptr<ACORNAttributeColumn>> columns;
+
+    /// add a scalar column, returns its number
+    int add_int_column(const std::string& name, size_t n, const int32_t* x);
+
+    /** add a multi-valued column, returns its number
+     *
+     * @param lims   size n + 1, values of vector i are x[lims[i]:lims[i+1]]
+     * @param x      size lims[n], values in any order (they are sorted
+     *               per vector when stored)
+     */
+    int add_int_set_column(
+            const std::string& name,
+            size_t n,
+            const size_t* lims,
+            const int32_t* x);
+
+    /// column number from its name, -1 if it does not exist
+    int column_no(const std::string& name) const;
+
+    /// column from its name, throws if it does not exist
+    const ACORNAttributeColumn& column(const std::string& name) const;
+
+    /// nb of vectors covered by the columns (0 if there are no columns)
+    size_t size() const;
+
+    /// set the value of vector i in a scalar column
+    void set_int(const std::string& name, idx_t i, int32_t v);
+
+    /// set the values of vector i in a multi-valued column
+    void set_int_set(
+            const std::string& name,
+            idx_t i,
+            size_t n,
+            const int32_t* x);
+
+    /// extend the columns to n vectors, the new vectors get the value 0
+    /// (scalar columns) or an empty set
+    void resize(size_t n);
+
+    /** keep the rows of the vectors that are not removed, row i moves to
+     * map[i] (map[i] < 0 if vector i is removed, the remaining rows must
+     * keep their order). */
+    void remap(size_t n, const idx_t* map);
+
+    /// reorder the rows, row i of the result is row perm[i]
+    void permute(size_t n, const idx_t* perm);
+
+    void reset();
+};
+
+/** attribute == value for scalar columns, value in attribute for sets
+ * (exact match, EM and EMIS filters). */
+struct IDSelectorAttributeEqual : IDSelector {
+    const ACORNAttributeColumn* column;
+    int32_t value;
+
+    IDSelectorAttributeEqual(
+            const ACORNAttributeColumn* column,
+            int32_t value)
+            : column(column), value(value) {}
+
+    bool is_member(idx_t id) const final {
+        return column->has_value(id, value);
+    }
+    ~IDSelectorAttributeEqual() override {}
+};
+
+/** vmin <= attribute <= vmax (range filter). For set columns, any of the
+ * values of the vector may be in the range. */
+struct IDSelectorAttributeRange : IDSelector {
+    const ACORNAttributeColumn* column;
+    int32_t vmin, vmax;
+
+    IDSelectorAttributeRange(
+            const ACORNAttributeColumn* column,
+            int32_t vmin,
+            int32_t vmax)
+            : column(column), vmin(vmin), vmax(vmax) {}
+
+    bool is_member(idx_t id) const final {
+        return column->has_value_in_range(id, vmin, vmax);
+    }
+    ~IDSelectorAttributeRange() override {}
+};
+
+} // namespace faiss
@@ -0,0 +1,30 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#include <faiss/impl/ACORNDistanceComputers.h>
+
+#include <faiss/IndexFlat.h>
+
+namespace faiss {
+
+DistanceComputer* acorn_specialized_distance_computer(const Index* storage) {
+    if (auto flat = dynamic_cast<const IndexFlat*>(storage)) {
+        const float* xb = (const float*)flat->codes.data();
+        if (flat->metric_type == METRIC_L2) {
+            return new ACORNFlatL2Dis(flat->d, xb);
+        }
+        if (flat->metric_type == METRIC_INNER_PRODUCT) {
+            return new ACORNFlatNegIPDis(flat->d, xb);
+        }
+        return nullptr;
+    }
+    return nullptr;
+}
+
+} // namespace faiss
@@ -0,0 +1,138 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <stdint.h>
+
+#include <faiss/impl/DistanceComputer.h>
+#include <faiss/utils/distances.h>
+
+/** Distance computers of the common ACORN storages.
+ *
+ * Their methods are final and defined inline. The ACORN search and
+ * construction routines are instantiated for each of these types: the
+ * DistanceComputer given to them is downcast once per query or per added
+ * vector, after which the distance computations are direct calls that the
+ * compiler can inline in the traversal loops. The other storages go
+ * through the virtual DistanceComputer interface. This includes the scalar
+ * quantizers: their SIMD distance computers (ScalarQuantizer.cpp) are
+ * faster than an inlined scalar loop, so they are not specialized here.
+ *
+ * As for the graph, smaller is closer: the inner product computer returns
+ * negated similarities. */
+
+namespace faiss {
+
+struct Index;
+
+/// L2 distance to the vectors of an IndexFlat
+struct ACORNFlatL2Dis final : DistanceComputer {
+    size_t d;
+    const float* xb;
+    const float* q = nullptr;
+
+    ACORNFlatL2Dis(size_t d, const float* xb) : d(d), xb(xb) {}
+
+    void set_query(const float* x) override {
+        q = x;
+    }
+
+    float operator()(idx_t i) override {
+        return fvec_L2sqr(q, xb + i * d, d);
+    }
+
+    void distances_batch_4(
+            const idx_t idx0,
+            const idx_t idx1,
+            const idx_t idx2,
+            const idx_t idx3,
+            float& dis0,
+            float& dis1,
+            float& dis2,
+            float& dis3) override {
+        fvec_L2sqr_batch_4(
+                q,
+                xb + idx0 * d,
+                xb + idx1 * d,
+                xb + idx2 * d,
+                xb + idx3 * d,
+                d,
+                dis0,
+                dis1,
+                dis2,
+                dis3);
+    }
+
+    void prefetch(idx_t i) override {
+        prefetch_L2(xb + i * d);
+    }
+
+    float symmetric_dis(idx_t i, idx_t j) override {
+        return fvec_L2sqr(xb + i * d, xb + j * d, d);
+    }
+};
+
+/// negated inner product with the vectors of an IndexFlat
+struct ACORNFlatNegIPDis final : DistanceComputer {
+    size_t d;
+    const float* xb;
+    const float* q = nullptr;
+
+    ACORNFlatNegIPDis(size_t d, const float* xb) : d(d), xb(xb) {}
+
+    void set_query(const float* x) override {
+        q = x;
+    }
+
+    float operator()(idx_t i) override {
+        return -fvec_inner_product(q, xb + i * d, d);
+    }
+
+    void distances_batch_4(
+            const idx_t idx0,
+            const idx_t idx1,
+            const idx_t idx2,
+            const idx_t idx3,
+            float& dis0,
+            float& dis1,
+            float& dis2,
+            float& dis3) override {
+        fvec_inner_product_batch_4(
+                q,
+                xb + idx0 * d,
+                xb + idx1 * d,
+                xb + idx2 * d,
+                xb + idx3 * d,
+                d,
+                dis0,
+                dis1,
+                dis2,
+                dis3);
+        dis0 = -dis0;
+        dis1 = -dis1;
+        dis2 = -dis2;
+        dis3 = -dis3;
+    }
+
+    void prefetch(idx_t i) override {
+        prefetch_L2(xb + i * d);
+    }
+
+    float symmetric_dis(idx_t i, idx_t j) override {
+        return -fvec_inner_product(xb + i * d, xb + j * d, d);
+    }
+};
+
+/** specialized distance computer for storage, or nullptr if there is none
+ * for its type and metric. The distances are the same as those of
+ * storage->get_distance_computer(), negated for the inner product. */
+DistanceComputer* acorn_specialized_distance_computer(const Index* storage);
+
+} // namespace faiss
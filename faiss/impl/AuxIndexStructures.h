@@ -20,6 +20,7 @@
 
 #include <faiss/MetricType.h>
 #include <faiss/impl/platform_macros.h>
+#include <faiss/utils/prefetch.h>
 
 namespace faiss {
 
@@ -179,6 +180,11 @@ struct VisitedTable {
         return visited[no] == visno;
     }
 
+    /// hint that flag #no will be accessed soon
+    void prefetch(int no) const {
+        prefetch_L2(visited.data() + no);
+    }
+
     /// reset all flags to false
     void advance() {
         visno++;
@@ -8,6 +8,8 @@
 #include <faiss/impl/FaissAssert.h>
 #include <faiss/impl/IDSelector.h>
 
+#include <algorithm>
+
 namespace faiss {
 
 /***********************************************************************
@@ -77,6 +79,17 @@ bool IDSelectorArray::is_member(idx_t id) const {
     return false;
 }
 
+/***********************************************************************
+ * IDSelectorSortedArray
+ ***********************************************************************/
+
+IDSelectorSortedArray::IDSelectorSortedArray(size_t n, const idx_t* ids)
+        : n(n), ids(ids) {}
+
+bool IDSelectorSortedArray::is_member(idx_t id) const {
+    return std::binary_search(ids, ids + n, id);
+}
+
 /***********************************************************************
  * IDSelectorBatch
  ***********************************************************************/
@@ -66,6 +66,26 @@ struct IDSelectorArray : IDSelector {
     ~IDSelectorArray() override {}
 };
 
+/** Sorted array of elements
+ *
+ * Same as IDSelectorArray, but the ids must be sorted in increasing order,
+ * which makes is_member a bissection instead of a linear scan.
+ */
+struct IDSelectorSortedArray : IDSelector {
+    size_t n;
+    const idx_t* ids;
+
+    /** Construct with a sorted array of ids to process
+     *
+     * @param n number of ids to store
+     * @param ids elements to store, sorted in increasing order. The pointer
+     *            should remain valid during IDSelectorSortedArray's lifetime
+     */
+    IDSelectorSortedArray(size_t n, const idx_t* ids);
+    bool is_member(idx_t id) const final;
+    ~IDSelectorSortedArray() override {}
+};
+
 /** Ids from a set.
  *
  * Repetitions of ids in the indices set passed to the constructor does not hurt
@@ -123,6 +143,18 @@ struct IDSelectorNot : IDSelector {
     virtual ~IDSelectorNot() {}
 };
 
+/** selects the ids that are members of both selectors */
+struct IDSelectorAnd : IDSelector {
+    const IDSelector* lhs;
+    const IDSelector* rhs;
+    IDSelectorAnd(const IDSelector* lhs, const IDSelector* rhs)
+            : lhs(lhs), rhs(rhs) {}
+    bool is_member(idx_t id) const final {
+        return lhs->is_member(id) && rhs->is_member(id);
+    }
+    virtual ~IDSelectorAnd() {}
+};
+
 /// selects all entries (useful for benchmarking)
 struct IDSelectorAll : IDSelector {
     bool is_member(idx_t id) const final {
@@ -11,6 +11,7 @@
 
 #include <faiss/impl/io_macros.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 
@@ -22,6 +23,11 @@
 #include <faiss/impl/io_macros.h>
 #include <faiss/utils/hamming.h>
 
+#ifndef _WIN32
+#include <faiss/IndexFlatOnDisk.h>
+#include <faiss/impl/mapped_io.h>
+#endif
+
 #include <faiss/invlists/InvertedListsIOHook.h>
 
 #include <faiss/Index2Layer.h>
@@ -370,16 +376,65 @@ static void read_HNSW(HNSW* hnsw, IOReader* f) {
     READ1(hnsw->upper_beam);
 }
 
-static void read_ACORN(ACORN* acorn, IOReader* f) {
-    READVECTOR(acorn->assign_probas);
-    READVECTOR(acorn->cum_nneighbor_per_level);
-    READVECTOR(acorn->levels);
-    READVECTOR(acorn->offsets);
-    READVECTOR(acorn->neighbors);
+/* Reads an array written by write_aligned_vector. With IO_FLAG_MMAP_IFC
+ * and a memory-mapped file, the array is a view on the mapping, otherwise
+ * it is copied. */
+template <class T>
+static void read_aligned_vector(
+        MaybeOwnedVector<T>& vec,
+        IOReader* f,
+        int io_flags) {
+    size_t size, npad;
+    READ1(size);
+    FAISS_THROW_IF_NOT(size < (uint64_t{1} << 40));
+    READ1(npad);
+    FAISS_THROW_IF_NOT(npad < (1 << 16));
+#ifndef _WIN32
+    MappedFileIOReader* mf = dynamic_cast<MappedFileIOReader*>(f);
+    if (mf && (io_flags & IO_FLAG_MMAP_IFC)) {
+        mf->map(npad);
+        if (mf->pos % alignof(T) == 0) {
+            T* ptr = (T*)mf->map(size * sizeof(T));
+            vec = MaybeOwnedVector<T>::create_view(ptr, size, mf->file);
+            return;
+        }
+    } else
+#endif
+    {
+        std::vector<uint8_t> padding(npad);
+        READANDCHECK(padding.data(), npad);
+    }
+    vec.resize(size);
+    READANDCHECK(vec.data(), size);
+}
+
+static void read_ACORN(ACORN* acorn, IOReader* f, int io_flags) {
+    size_t marker;
+    READ1(marker);
+    if (marker != size_t(-1)) {
+        // before version 2, marker is the size of assign_probas and the
+        // arrays are not aligned
+        FAISS_THROW_IF_NOT(marker < (1 << 20));
+        acorn->assign_probas.resize(marker);
+        READANDCHECK(acorn->assign_probas.data(), marker);
+        READVECTOR(acorn->cum_nneighbor_per_level);
+        READVECTOR(acorn->levels);
+        READVECTOR(acorn->offsets);
+        READVECTOR(acorn->neighbors);
+    } else {
+        int version;
+        READ1(version);
+        FAISS_THROW_IF_NOT_FMT(
+                version == 2, "unsupported ACORN graph version %d", version);
+        READVECTOR(acorn->assign_probas);
+        READVECTOR(acorn->cum_nneighbor_per_level);
+        read_aligned_vector(acorn->levels, f, io_flags);
+        read_aligned_vector(acorn->offsets, f, io_flags);
+        read_aligned_vector(acorn->neighbors, f, io_flags);
+    }
 
     // added for hybrid version
     READVECTOR(acorn->nb_per_level);
-    // READVECTOR(acorn->metadata);
 
     READ1(acorn->entry_point);
     READ1(acorn->max_level);
@@ -391,6 +446,99 @@ static void read_ACORN(ACORN* acorn, IOReader* f) {
     READ1(acorn->M_beta);
 }
 
+/// returns the version of the section
+static int read_ACORN_attributes(ACORN* acorn, IOReader* f) {
+    int version;
+    READ1(version);
+    FAISS_THROW_IF_NOT_FMT(
+            version >= 1 && version <= 7,
+            "unsupported ACORN attributes version %d",
+            version);
+
+    READVECTOR(acorn->loaded_metadata);
+    FAISS_THROW_IF_NOT(
+            acorn->loaded_metadata.empty() ||
+            acorn->loaded_metadata.size() == acorn->levels.size());
+    acorn->metadata = acorn->loaded_metadata.empty()
+            ? nullptr
+            : acorn->loaded_metadata.data();
+
+    ACORNAttributes& attributes = acorn->attributes;
+    size_t ncol;
+    READ1(ncol);
+    FAISS_THROW_IF_NOT(ncol < (1 << 20));
+    attributes.columns.resize(ncol);
+    for (std::unique_ptr<ACORNAttributeColumn>& col_ptr : attributes.columns) {
+        col_ptr.reset(new ACORNAttributeColumn());
+        ACORNAttributeColumn& col = *col_ptr;
+        std::vector<char> name;
+        READVECTOR(name);
+        col.name.assign(name.begin(), name.end());
+        int type;
+        READ1(type);
+        FAISS_THROW_IF_NOT(type == ATTR_INT || type == ATTR_INT_SET);
+        col.type = ACORNAttributeType(type);
+        READVECTOR(col.lims);
+        READVECTOR(col.values);
+        FAISS_THROW_IF_NOT(
+                col.type == ATTR_INT ||
+                (col.lims.size() > 0 && col.lims.back() == col.values.size()));
+        FAISS_THROW_IF_NOT_FMT(
+                col.size() == acorn->levels.size(),
+                "attribute column %s has %zd values, expected %zd",
+                col.name.c_str(),
+                col.size(),
+                acorn->levels.size());
+    }
+
+    if (version >= 2) {
+        ACORNCompressedLinks& level0 = acorn->compressed_level0;
+        READ1(level0.nbits);
+        if (version >= 7) {
+            READVECTOR(level0.block_lims);
+            READVECTOR(level0.lims);
+        } else {
+            // absolute 64-bit offsets before version 7
+            std::vector<size_t> abs_lims;
+            READVECTOR(abs_lims);
+            FAISS_THROW_IF_NOT(
+                    std::is_sorted(abs_lims.begin(), abs_lims.end()));
+            if (!abs_lims.empty()) {
+                level0.set_lims(abs_lims.size() - 1, abs_lims.data());
+            }
+        }
+        READVECTOR(level0.codes);
+        size_t n = level0.size();
+        FAISS_THROW_IF_NOT(
+                level0.lims.empty() ||
+                (level0.nbits > 0 && level0.nbits <= 32 &&
+                 n == acorn->levels.size() &&
+                 level0.block_lims.size() ==
+                         (n >> ACORNCompressedLinks::block_bits) + 1));
+        for (size_t i = 0; i < n; i++) {
+            FAISS_THROW_IF_NOT(level0.begin(i) <= level0.begin(i + 1));
+        }
+        FAISS_THROW_IF_NOT(
+                level0.lims.empty() ||
+                level0.codes.size() ==
+                        (level0.begin(n) * level0.nbits + 7) / 8 + 8);
+    }
+
+    if (version >= 3) {
+        READVECTOR(acorn->deleted);
+        FAISS_THROW_IF_NOT(acorn->deleted.size() <= acorn->levels.size());
+        acorn->ndeleted = std::count(
+                acorn->deleted.begin(), acorn->deleted.end(), 1);
+    }
+    if (version >= 5) {
+        READVECTOR(acorn->attribute_entry_points);
+        for (ACORN::storage_idx_t ep : acorn->attribute_entry_points) {
+            FAISS_THROW_IF_NOT(ep >= 0 && size_t(ep) < acorn->levels.size());
+        }
+    }
+    return version;
+}
+
 static void read_NSG(NSG* nsg, IOReader* f) {
     READ1(nsg->ntotal);
     READ1(nsg->R);
@@ -563,6 +711,36 @@ Index* read_index(IOReader* f, int io_flags) {
                 idxf->codes.size() == idxf->ntotal * idxf->code_size);
         // leak!
         idx = idxf;
+    } else if (h == fourcc("IxFm")) {
+        // flat storage of ACORN indexes, see write_aligned_vector
+        IndexFlat header;
+        read_index_header(&header, f);
+        IndexFlat* idxf;
+        if (header.metric_type == METRIC_INNER_PRODUCT) {
+            idxf = new IndexFlatIP(header.d);
+        } else if (header.metric_type == METRIC_L2) {
+            idxf = new IndexFlatL2(header.d);
+        } else {
+            idxf = new IndexFlat(header.d, header.metric_type);
+        }
+        idxf->metric_arg = header.metric_arg;
+        idxf->ntotal = header.ntotal;
+        idxf->is_trained = header.is_trained;
+        read_aligned_vector(idxf->codes, f, io_flags);
+        FAISS_THROW_IF_NOT(
+                idxf->codes.size() == idxf->ntotal * idxf->code_size);
+        idx = idxf;
+#ifndef _WIN32
+    } else if (h == fourcc("IxFd")) {
+        IndexFlatOnDisk* idxfd = new IndexFlatOnDisk();
+        read_index_header(idxfd, f);
+        std::vector<char> x;
+        READVECTOR(x);
+        idxfd->filename.assign(x.begin(), x.end());
+        idxfd->read_only = io_flags & IO_FLAG_READ_ONLY;
+        idxfd->open_file();
+        idx = idxfd;
+#endif
     } else if (h == fourcc("IxHE") || h == fourcc("IxHe")) {
         IndexLSH* idxl = new IndexLSH();
         read_index_header(idxl, f);
@@ -962,17 +1140,45 @@ Index* read_index(IOReader* f, int io_flags) {
             dynamic_cast<IndexPQ*>(idxhnsw->storage)->pq.compute_sdc_table();
         }
         idx = idxhnsw;
-    } else if (h == fourcc("IHNH")) {
-        // IndexHNSWFlat* idxhnswhybrid = new IndexHNSWFlat();
-        IndexACORN* idxacorn= nullptr;
-        std::vector<int> metadata = {};
-        idxacorn = new IndexACORNFlat(0, 0, 0, metadata, 0);
-        // IndexACORNFlat* idxhnsw = new IndexACORNFlat();
-        // IndexACORN* idxhnsw = new IndexACORNFlat();
+    } else if (
+            h == fourcc("IHNH") || h == fourcc("IHNA") ||
+            h == fourcc("IHAs") || h == fourcc("IHAp")) {
+        // IHNH indexes were written without their metadata
+        IndexACORN* idxacorn = nullptr;
+        if (h == fourcc("IHAs")) {
+            idxacorn = new IndexACORNSQ();
+        } else if (h == fourcc("IHAp")) {
+            idxacorn = new IndexACORNPQ();
+        } else {
+            idxacorn = new IndexACORNFlat();
+        }
         read_index_header(idxacorn, f);
-        read_ACORN(&idxacorn->acorn, f);
+        read_ACORN(&idxacorn->acorn, f, io_flags);
+        int version = 0;
+        if (h != fourcc("IHNH")) {
+            version = read_ACORN_attributes(&idxacorn->acorn, f);
+        }
         idxacorn->storage = read_index(f, io_flags);
         idxacorn->own_fields = true;
+        if (h == fourcc("IHAp")) {
+            dynamic_cast<IndexPQ*>(idxacorn->storage)->pq.compute_sdc_table();
+        }
+        if (version >= 4) {
+            int has_refine;
+            READ1(has_refine);
+            if (has_refine) {
+                READ1(idxacorn->k_factor);
+                idxacorn->refine_index = read_index(f, io_flags);
+                idxacorn->own_refine_index = true;
+            }
+        }
+        if (version >= 6) {
+            READVECTOR(idxacorn->id_map);
+            FAISS_THROW_IF_NOT(
+                    idxacorn->id_map.empty() ||
+                    idxacorn->id_map.size() == size_t(idxacorn->ntotal));
+            idxacorn->construct_rev_map();
+        }
         idx = idxacorn;
     } else if (
             h == fourcc("INSf") || h == fourcc("INSp") || h == fourcc("INSs")) {
@@ -1072,6 +1278,14 @@ Index* read_index(FILE* f, int io_flags) {
 }
 
 Index* read_index(const char* fname, int io_flags) {
+    if (io_flags & IO_FLAG_MMAP_IFC) {
+#ifndef _WIN32
+        MappedFileIOReader reader(fname);
+        return read_index(&reader, io_flags);
+#else
+        FAISS_THROW_MSG("IO_FLAG_MMAP_IFC is not supported on Windows");
+#endif
+    }
     FileIOReader reader(fname);
     Index* idx = read_index(&reader, io_flags);
     return idx;
@@ -25,6 +25,10 @@
 #include <faiss/impl/io_macros.h>
 #include <faiss/utils/hamming.h>
 
+#ifndef _WIN32
+#include <faiss/IndexFlatOnDisk.h>
+#endif
+
 #include <faiss/Index2Layer.h>
 #include <faiss/IndexAdditiveQuantizer.h>
 #include <faiss/IndexAdditiveQuantizerFastScan.h>
@@ -319,16 +323,61 @@ static void write_HNSW(const HNSW* hnsw, IOWriter* f) {
     WRITE1(hnsw->upper_beam);
 }
 
+/* Large arrays that can be memory-mapped by read_index with
+ * IO_FLAG_MMAP_IFC. They are written as the size, the number of padding
+ * bytes and the data, padded so that the data starts on a page boundary
+ * of the file. The position is known only for the file and vector
+ * writers, the others do not pad. */
+static const size_t mmap_page_size = 4096;
+
+static bool writer_position(IOWriter* f, size_t* pos) {
+    if (FileIOWriter* fw = dynamic_cast<FileIOWriter*>(f)) {
+        long p = ftell(fw->f);
+        if (p < 0) {
+            return false;
+        }
+        *pos = p;
+        return true;
+    }
+    if (VectorIOWriter* vw = dynamic_cast<VectorIOWriter*>(f)) {
+        *pos = vw->data.size();
+        return true;
+    }
+    return false;
+}
+
+template <class VectorT>
+static void write_aligned_vector(const VectorT& vec, IOWriter* f) {
+    size_t size = vec.size();
+    WRITE1(size);
+    size_t npad = 0;
+    size_t pos;
+    if (writer_position(f, &pos)) {
+        pos += sizeof(npad);
+        npad = (mmap_page_size - pos % mmap_page_size) % mmap_page_size;
+    }
+    WRITE1(npad);
+    std::vector<uint8_t> padding(npad);
+    WRITEANDCHECK(padding.data(), npad);
+    WRITEANDCHECK(vec.data(), size);
+}
+
+/* Graph section of ACORN indexes. The first field used to be the size of
+ * assign_probas, it is now (size_t)-1 followed by a version number.
+ * Version 2 writes the per-vector arrays with write_aligned_vector. */
 static void write_ACORN(const ACORN* hnsw, IOWriter* f) {
+    size_t marker = size_t(-1);
+    WRITE1(marker);
+    int version = 2;
+    WRITE1(version);
     WRITEVECTOR(hnsw->assign_probas);
     WRITEVECTOR(hnsw->cum_nneighbor_per_level);
-    WRITEVECTOR(hnsw->levels);
-    WRITEVECTOR(hnsw->offsets);
-    WRITEVECTOR(hnsw->neighbors);
+    write_aligned_vector(hnsw->levels, f);
+    write_aligned_vector(hnsw->offsets, f);
+    write_aligned_vector(hnsw->neighbors, f);
 
     //added for hybrid version
     WRITEVECTOR(hnsw->nb_per_level)
-    // WRITEVECTOR(hnsw->metadata)
 
     WRITE1(hnsw->entry_point);
     WRITE1(hnsw->max_level);
@@ -343,6 +392,53 @@ static void write_ACORN(const ACORN* hnsw, IOWriter* f) {
 
 }
 
+/* Metadata and attribute columns of an ACORN index. Written in IHNA
+ * indexes after the graph, preceded by a version number so that fields
+ * can be appended later. Version 2 adds the compressed level 0, version 3
+ * the tombstones, version 4 the refine index (after the storage),
+ * version 5 the attribute entry points, version 6 the labels of
+ * reordered indexes (after the refine index) and version 7 stores the
+ * offsets of the compressed level 0 per block. */
+static void write_ACORN_attributes(const ACORN* acorn, IOWriter* f) {
+    int version = 7;
+    WRITE1(version);
+
+    // legacy metadata, one int per vector if set
+    std::vector<int> metadata;
+    if (acorn->metadata) {
+        metadata.assign(
+                acorn->metadata, acorn->metadata + acorn->levels.size());
+    }
+    WRITEVECTOR(metadata);
+
+    const ACORNAttributes& attributes = acorn->attributes;
+    size_t ncol = attributes.columns.size();
+    WRITE1(ncol);
+    for (const std::unique_ptr<ACORNAttributeColumn>& col_ptr :
+         attributes.columns) {
+        const ACORNAttributeColumn& col = *col_ptr;
+        std::vector<char> name(col.name.begin(), col.name.end());
+        WRITEVECTOR(name);
+        int type = col.type;
+        WRITE1(type);
+        WRITEVECTOR(col.lims);
+        WRITEVECTOR(col.values);
+    }
+
+    // compressed level 0, empty lims if the graph is not compressed
+    const ACORNCompressedLinks& level0 = acorn->compressed_level0;
+    WRITE1(level0.nbits);
+    WRITEVECTOR(level0.block_lims);
+    WRITEVECTOR(level0.lims);
+    WRITEVECTOR(level0.codes);
+
+    // tombstones of the removed vectors
+    WRITEVECTOR(acorn->deleted);
+
+    // since version 5
+    WRITEVECTOR(acorn->attribute_entry_points);
+}
+
 static void write_NSG(const NSG* nsg, IOWriter* f) {
     WRITE1(nsg->ntotal);
     WRITE1(nsg->R);
@@ -425,6 +521,17 @@ void write_index(const Index* idx, IOWriter* f) {
         WRITE1(h);
         write_index_header(idx, f);
         WRITEXBVECTOR(idxf->codes);
+#ifndef _WIN32
+    } else if (
+            const IndexFlatOnDisk* idxfd =
+                    dynamic_cast<const IndexFlatOnDisk*>(idx)) {
+        // the vectors stay in their file, only its name is written
+        uint32_t h = fourcc("IxFd");
+        WRITE1(h);
+        write_index_header(idx, f);
+        std::vector<char> x(idxfd->filename.begin(), idxfd->filename.end());
+        WRITEVECTOR(x);
+#endif
     } else if (const IndexLSH* idxl = dynamic_cast<const IndexLSH*>(idx)) {
         uint32_t h = fourcc("IxHe");
         WRITE1(h);
@@ -776,12 +883,34 @@ void write_index(const Index* idx, IOWriter* f) {
         write_HNSW(&idxhnsw->hnsw, f);
         write_index(idxhnsw->storage, f);
     } else if (const IndexACORN* indxacorn = dynamic_cast<const IndexACORN*>(idx)) {
-        uint32_t h = fourcc("IHNH"); // this needs to be a 4 letter header
-        FAISS_THROW_IF_NOT(h != 0);
+        // IHNA = IHNH followed by the metadata / attributes section,
+        // IHAs / IHAp are the same for the SQ / PQ storages
+        uint32_t h = dynamic_cast<const IndexACORNSQ*>(idx) ? fourcc("IHAs")
+                : dynamic_cast<const IndexACORNPQ*>(idx)    ? fourcc("IHAp")
+                                                            : fourcc("IHNA");
         WRITE1(h);
         write_index_header(indxacorn, f);
         write_ACORN(&indxacorn->acorn, f);
-        write_index(indxacorn->storage, f);
+        write_ACORN_attributes(&indxacorn->acorn, f);
+        if (const IndexFlat* storage =
+                    dynamic_cast<const IndexFlat*>(indxacorn->storage)) {
+            // same as IxF2 / IxFI, with the codes aligned for mmap
+            uint32_t hs = fourcc("IxFm");
+            WRITE1(hs);
+            write_index_header(storage, f);
+            write_aligned_vector(storage->codes, f);
+        } else {
+            write_index(indxacorn->storage, f);
+        }
+        // since version 4 of the attributes section
+        int has_refine = indxacorn->refine_index != nullptr;
+        WRITE1(has_refine);
+        if (has_refine) {
+            WRITE1(indxacorn->k_factor);
+            write_index(indxacorn->refine_index, f);
+        }
+        // since version 6
+        WRITEVECTOR(indxacorn->id_map);
     } else if (const IndexNSG* idxnsg = dynamic_cast<const IndexNSG*>(idx)) {
         uint32_t h = dynamic_cast<const IndexNSGFlat*>(idx) ? fourcc("INSf")
                 : dynamic_cast<const IndexNSGPQ*>(idx)      ? fourcc("INSp")
@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#include <faiss/impl/mapped_io.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <faiss/impl/FaissAssert.h>
+
+namespace faiss {
+
+/***********************************************************************
+ * MmappedFile
+ ***********************************************************************/
+
+MmappedFile::MmappedFile(const char* fname) {
+    int fd = open(fname, O_RDONLY);
+    FAISS_THROW_IF_NOT_FMT(
+            fd >= 0, "could not open %s: %s", fname, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        FAISS_THROW_FMT("could not stat %s: %s", fname, strerror(err));
+    }
+    size = st.st_size;
+    if (size > 0) {
+        void* p = mmap(
+                nullptr,
+                size,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE,
+                fd,
+                0);
+        int err = errno;
+        close(fd);
+        FAISS_THROW_IF_NOT_FMT(
+                p != MAP_FAILED, "could not mmap %s: %s", fname, strerror(err));
+        ptr = (uint8_t*)p;
+    } else {
+        close(fd);
+    }
+}
+
+MmappedFile::~MmappedFile() {
+    if (ptr) {
+        munmap(ptr, size);
+    }
+}
+
+/***********************************************************************
+ * MappedFileIOReader
+ ***********************************************************************/
+
+MappedFileIOReader::MappedFileIOReader(const char* fname)
+        : file(std::make_shared<MmappedFile>(fname)) {
+    name = fname;
+}
+
+size_t MappedFileIOReader::operator()(void* ptr, size_t size, size_t nitems) {
+    if (size == 0) {
+        return nitems;
+    }
+    size_t nremain = (file->size - pos) / size;
+    if (nremain < nitems) {
+        nitems = nremain;
+    }
+    if (nitems > 0) {
+        memcpy(ptr, file->ptr + pos, size * nitems);
+        pos += size * nitems;
+    }
+    return nitems;
+}
+
+uint8_t* MappedFileIOReader::map(size_t nbytes) {
+    FAISS_THROW_IF_NOT_FMT(
+            nbytes <= file->size - pos,
+            "read error in %s: %zd bytes requested, %zd available",
+            name.c_str(),
+            nbytes,
+            file->size - pos);
+    uint8_t* p = file->ptr + pos;
+    pos += nbytes;
+    return p;
+}
+
+} // namespace faiss
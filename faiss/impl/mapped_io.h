@@ -0,0 +1,49 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <memory>
+
+#include <faiss/impl/io.h>
+
+namespace faiss {
+
+/** Private mapping of a whole file. The pages are read from the page
+ * cache on demand and shared with the other processes that map the
+ * file, until they are written to (copy on write, the file itself is
+ * never modified). */
+struct MmappedFile {
+    uint8_t* ptr = nullptr;
+    size_t size = 0;
+
+    explicit MmappedFile(const char* fname);
+
+    ~MmappedFile();
+};
+
+/** Reader on a memory-mapped file. Besides reading (copying) data, it
+ * can return pointers to the mapped data, used by read_index with
+ * IO_FLAG_MMAP_IFC to build MaybeOwnedVector views. */
+struct MappedFileIOReader : IOReader {
+    std::shared_ptr<MmappedFile> file;
+
+    /// position of the next read in the file
+    size_t pos = 0;
+
+    explicit MappedFileIOReader(const char* fname);
+
+    size_t operator()(void* ptr, size_t size, size_t nitems) override;
+
+    /// returns the address of the next nbytes in the mapping and skips
+    /// them
+    uint8_t* map(size_t nbytes);
+};
+
+} // namespace faiss
@@ -0,0 +1,192 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace faiss {
+
+/** Array that either owns its elements in a std::vector, or is a view on
+ * memory owned by another object (typically a memory-mapped file, see
+ * MmappedFile). The owner is kept alive as long as one of its views
+ * exists.
+ *
+ * It has the subset of the std::vector interface used for the large
+ * arrays of the indexes. The operations that change the size of a view
+ * first copy it to an owned vector. */
+template <typename T>
+struct MaybeOwnedVector {
+    using value_type = T;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    MaybeOwnedVector() {}
+
+    explicit MaybeOwnedVector(size_t n) : owned_data(n) {}
+
+    MaybeOwnedVector(size_t n, const T& v) : owned_data(n, v) {}
+
+    MaybeOwnedVector(std::vector<T>&& v) : owned_data(std::move(v)) {}
+
+    MaybeOwnedVector(const std::vector<T>& v) : owned_data(v) {}
+
+    template <class InputIt>
+    MaybeOwnedVector(InputIt first, InputIt last) : owned_data(first, last) {}
+
+    /// view on n elements at ptr, owner keeps them valid
+    static MaybeOwnedVector create_view(
+            T* ptr,
+            size_t n,
+            std::shared_ptr<void> owner) {
+        MaybeOwnedVector v;
+        v.view_data = ptr;
+        v.view_size = n;
+        v.owner = std::move(owner);
+        return v;
+    }
+
+    bool is_owner() const {
+        return !owner;
+    }
+
+    T* data() {
+        return owner ? view_data : owned_data.data();
+    }
+    const T* data() const {
+        return owner ? view_data : owned_data.data();
+    }
+
+    size_t size() const {
+        return owner ? view_size : owned_data.size();
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+
+    T& operator[](size_t i) {
+        return data()[i];
+    }
+    const T& operator[](size_t i) const {
+        return data()[i];
+    }
+
+    T* begin() {
+        return data();
+    }
+    T* end() {
+        return data() + size();
+    }
+    const T* begin() const {
+        return data();
+    }
+    const T* end() const {
+        return data() + size();
+    }
+
+    T& back() {
+        return data()[size() - 1];
+    }
+    const T& back() const {
+        return data()[size() - 1];
+    }
+
+    /// the elements as a std::vector, copied first if this is a view
+    std::vector<T>& owned() {
+        if (owner) {
+            owned_data.assign(view_data, view_data + view_size);
+            owner.reset();
+            view_data = nullptr;
+            view_size = 0;
+        }
+        return owned_data;
+    }
+
+    void resize(size_t n) {
+        owned().resize(n);
+    }
+    void resize(size_t n, const T& v) {
+        owned().resize(n, v);
+    }
+    void reserve(size_t n) {
+        owned().reserve(n);
+    }
+    void clear() {
+        owner.reset();
+        view_data = nullptr;
+        view_size = 0;
+        owned_data.clear();
+    }
+    void shrink_to_fit() {
+        owned().shrink_to_fit();
+    }
+
+    void push_back(const T& v) {
+        owned().push_back(v);
+    }
+
+    template <class InputIt>
+    void assign(InputIt first, InputIt last) {
+        std::vector<T> tmp(first, last);
+        clear();
+        owned_data.swap(tmp);
+    }
+    void assign(size_t n, const T& v) {
+        clear();
+        owned_data.assign(n, v);
+    }
+
+    template <class InputIt>
+    T* insert(const T* pos, InputIt first, InputIt last) {
+        size_t ofs = pos - data();
+        std::vector<T>& vec = owned();
+        vec.insert(vec.begin() + ofs, first, last);
+        return vec.data() + ofs;
+    }
+    T* insert(const T* pos, size_t n, const T& v) {
+        size_t ofs = pos - data();
+        std::vector<T>& vec = owned();
+        vec.insert(vec.begin() + ofs, n, v);
+        return vec.data() + ofs;
+    }
+
+    T* erase(const T* first, const T* last) {
+        size_t ofs0 = first - data(), ofs1 = last - data();
+        std::vector<T>& vec = owned();
+        vec.erase(vec.begin() + ofs0, vec.begin() + ofs1);
+        return vec.data() + ofs0;
+    }
+
+    void swap(MaybeOwnedVector& other) {
+        owned_data.swap(other.owned_data);
+        std::swap(view_data, other.view_data);
+        std::swap(view_size, other.view_size);
+        owner.swap(other.owner);
+    }
+
+    bool operator==(const MaybeOwnedVector& other) const {
+        return size() == other.size() &&
+                std::equal(begin(), end(), other.begin());
+    }
+    bool operator!=(const MaybeOwnedVector& other) const {
+        return !(*this == other);
+    }
+
+   private:
+    std::vector<T> owned_data;
+
+    // when the data is not owned
+    T* view_data = nullptr;
+    size_t view_size = 0;
+    std::shared_ptr<void> owner;
+};
+
+} // namespace faiss
@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#include <faiss/impl/vecs_io.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <faiss/impl/FaissAssert.h>
+
+namespace faiss {
+
+VecsReader::VecsReader(const char* fname, int is_bvecs_in) : fname(fname) {
+    if (is_bvecs_in >= 0) {
+        is_bvecs = is_bvecs_in;
+    } else {
+        size_t l = this->fname.size();
+        is_bvecs = l >= 6 && this->fname.compare(l - 6, 6, ".bvecs") == 0;
+    }
+    f = fopen(fname, "rb");
+    FAISS_THROW_IF_NOT_FMT(
+            f, "could not open %s for reading: %s", fname, strerror(errno));
+    // the destructor is not called if the constructor throws
+    try {
+        struct stat st;
+        FAISS_THROW_IF_NOT_FMT(
+                fstat(fileno(f), &st) == 0,
+                "could not stat %s: %s",
+                fname,
+                strerror(errno));
+        size_t file_size = st.st_size;
+        if (file_size == 0) {
+            return;
+        }
+        int32_t di;
+        FAISS_THROW_IF_NOT_FMT(
+                fread(&di, sizeof(di), 1, f) == 1,
+                "could not read %s",
+                fname);
+        FAISS_THROW_IF_NOT_FMT(
+                di > 0 && di < 1000000,
+                "unreasonable dimension %d in %s",
+                di,
+                fname);
+        d = di;
+        size_t record_size =
+                sizeof(int32_t) + d * (is_bvecs ? 1 : sizeof(float));
+        FAISS_THROW_IF_NOT_FMT(
+                file_size % record_size == 0,
+                "size of %s is not a multiple of the record size %zd",
+                fname,
+                record_size);
+        n = file_size / record_size;
+        fseek(f, 0, SEEK_SET);
+    } catch (...) {
+        fclose(f);
+        f = nullptr;
+        throw;
+    }
+}
+
+size_t VecsReader::read(size_t nmax, float* x) {
+    size_t nr = std::min(nmax, n - i0);
+    if (nr == 0) {
+        return 0;
+    }
+    size_t elt_size = is_bvecs ? 1 : sizeof(float);
+    size_t record_size = sizeof(int32_t) + d * elt_size;
+    buf.resize(nr * record_size);
+    FAISS_THROW_IF_NOT_FMT(
+            fread(buf.data(), record_size, nr, f) == nr,
+            "read error in %s at vector %zd",
+            fname.c_str(),
+            i0);
+    for (size_t i = 0; i < nr; i++) {
+        const uint8_t* rec = buf.data() + i * record_size;
+        int32_t di;
+        memcpy(&di, rec, sizeof(di));
+        FAISS_THROW_IF_NOT_FMT(
+                di > 0 && size_t(di) == d,
+                "vector %zd of %s has dimension %d instead of %zd",
+                i0 + i,
+                fname.c_str(),
+                di,
+                d);
+        rec += sizeof(int32_t);
+        float* xi = x + i * d;
+        if (is_bvecs) {
+            for (size_t j = 0; j < d; j++) {
+                xi[j] = rec[j];
+            }
+        } else {
+            memcpy(xi, rec, d * sizeof(float));
+        }
+    }
+    i0 += nr;
+    return nr;
+}
+
+VecsReader::~VecsReader() {
+    if (f) {
+        fclose(f);
+    }
+}
+
+} // namespace faiss
@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace faiss {
+
+/** Sequential reader of .fvecs and .bvecs files (the format of the
+ * TEXMEX datasets: each vector is stored as its dimension, as an int32,
+ * followed by its components, float32 or uint8).
+ *
+ * The vectors are returned by batches, converted to float, so that a
+ * dataset larger than the RAM can be added to an index with a bounded
+ * memory usage. */
+struct VecsReader {
+    std::string fname;
+    FILE* f = nullptr;
+
+    /// components are uint8 (.bvecs) rather than float32
+    bool is_bvecs = false;
+
+    size_t d = 0; ///< dimension of the vectors
+    size_t n = 0; ///< nb of vectors in the file
+    size_t i0 = 0; ///< nb of vectors read so far
+
+    /** @param fname     input file
+     * @param is_bvecs  components are uint8. By default (-1), true if the
+     *                  file name ends with .bvecs */
+    explicit VecsReader(const char* fname, int is_bvecs = -1);
+
+    // the file is owned
+    VecsReader(const VecsReader&) = delete;
+    VecsReader& operator=(const VecsReader&) = delete;
+
+    /** read the next vectors
+     *
+     * @param nmax  max nb of vectors to read
+     * @param x     output, size nmax * d
+     * @return      nb of vectors read, 0 at the end of the file */
+    size_t read(size_t nmax, float* x);
+
+    ~VecsReader();
+
+   private:
+    // raw records of a batch
+    std::vector<uint8_t> buf;
+};
+
+} // namespace faiss
@@ -55,6 +55,10 @@ const int IO_FLAG_SKIP_PRECOMPUTE_TABLE = 16;
 // try to memmap data (useful to load an ArrayInvertedLists as an
 // OnDiskInvertedLists)
 const int IO_FLAG_MMAP = IO_FLAG_SKIP_IVF_DATA | 0x646f0000;
+// memory-map the flat codes and the graph arrays of ACORN indexes
+// instead of copying them (read_index from a file name only). The pages
+// are shared between the processes that load the same file.
+const int IO_FLAG_MMAP_IFC = 1 << 9;
 
 Index* read_index(const char* fname, int io_flags = 0);
 Index* read_index(FILE* f, int io_flags = 0);
@@ -96,6 +96,7 @@ vector_name_map = {
     'UInt16': 'uint16',
     'UInt32': 'uint32',
     'UInt64': 'uint64',
+    'MaybeOwnedUInt8': 'uint8',
     **{k: v.lower() for k, v in deprecated_name_map.items()}
 }
 
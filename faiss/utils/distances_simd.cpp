@@ -1301,6 +1301,182 @@ void fvec_inner_products_ny(
 
 #endif
 
+/***************************************************************************
+ * Distances between one query and 4 database vectors. The 4 accumulators
+ * share the loads of the query, which is useful for graph indexes that
+ * compute distances to scattered vectors.
+ ***************************************************************************/
+
+#ifdef __AVX2__
+
+static inline float horizontal_sum(const __m256 v) {
+    __m128 v0 = _mm_add_ps(
+            _mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 v1 = _mm_add_ps(v0, _mm_movehl_ps(v0, v0));
+    __m128 v2 = _mm_add_ss(v1, _mm_movehdup_ps(v1));
+    return _mm_cvtss_f32(v2);
+}
+
+void fvec_inner_product_batch_4(
+        const float* x,
+        const float* y0,
+        const float* y1,
+        const float* y2,
+        const float* y3,
+        const size_t d,
+        float& dis0,
+        float& dis1,
+        float& dis2,
+        float& dis3) {
+    __m256 m0 = _mm256_setzero_ps();
+    __m256 m1 = _mm256_setzero_ps();
+    __m256 m2 = _mm256_setzero_ps();
+    __m256 m3 = _mm256_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        __m256 mx = _mm256_loadu_ps(x + i);
+        m0 = _mm256_add_ps(m0, _mm256_mul_ps(mx, _mm256_loadu_ps(y0 + i)));
+        m1 = _mm256_add_ps(m1, _mm256_mul_ps(mx, _mm256_loadu_ps(y1 + i)));
+        m2 = _mm256_add_ps(m2, _mm256_mul_ps(mx, _mm256_loadu_ps(y2 + i)));
+        m3 = _mm256_add_ps(m3, _mm256_mul_ps(mx, _mm256_loadu_ps(y3 + i)));
+    }
+
+    float d0 = horizontal_sum(m0);
+    float d1 = horizontal_sum(m1);
+    float d2 = horizontal_sum(m2);
+    float d3 = horizontal_sum(m3);
+
+    for (; i < d; i++) {
+        d0 += x[i] * y0[i];
+        d1 += x[i] * y1[i];
+        d2 += x[i] * y2[i];
+        d3 += x[i] * y3[i];
+    }
+
+    dis0 = d0;
+    dis1 = d1;
+    dis2 = d2;
+    dis3 = d3;
+}
+
+void fvec_L2sqr_batch_4(
+        const float* x,
+        const float* y0,
+        const float* y1,
+        const float* y2,
+        const float* y3,
+        const size_t d,
+        float& dis0,
+        float& dis1,
+        float& dis2,
+        float& dis3) {
+    __m256 m0 = _mm256_setzero_ps();
+    __m256 m1 = _mm256_setzero_ps();
+    __m256 m2 = _mm256_setzero_ps();
+    __m256 m3 = _mm256_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        __m256 mx = _mm256_loadu_ps(x + i);
+        __m256 t0 = _mm256_sub_ps(mx, _mm256_loadu_ps(y0 + i));
+        __m256 t1 = _mm256_sub_ps(mx, _mm256_loadu_ps(y1 + i));
+        __m256 t2 = _mm256_sub_ps(mx, _mm256_loadu_ps(y2 + i));
+        __m256 t3 = _mm256_sub_ps(mx, _mm256_loadu_ps(y3 + i));
+        m0 = _mm256_add_ps(m0, _mm256_mul_ps(t0, t0));
+        m1 = _mm256_add_ps(m1, _mm256_mul_ps(t1, t1));
+        m2 = _mm256_add_ps(m2, _mm256_mul_ps(t2, t2));
+        m3 = _mm256_add_ps(m3, _mm256_mul_ps(t3, t3));
+    }
+
+    float d0 = horizontal_sum(m0);
+    float d1 = horizontal_sum(m1);
+    float d2 = horizontal_sum(m2);
+    float d3 = horizontal_sum(m3);
+
+    for (; i < d; i++) {
+        float t0 = x[i] - y0[i];
+        float t1 = x[i] - y1[i];
+        float t2 = x[i] - y2[i];
+        float t3 = x[i] - y3[i];
+        d0 += t0 * t0;
+        d1 += t1 * t1;
+        d2 += t2 * t2;
+        d3 += t3 * t3;
+    }
+
+    dis0 = d0;
+    dis1 = d1;
+    dis2 = d2;
+    dis3 = d3;
+}
+
+#else
+
+void fvec_inner_product_batch_4(
+        const float* x,
+        const float* y0,
+        const float* y1,
+        const float* y2,
+        const float* y3,
+        const size_t d,
+        float& dis0,
+        float& dis1,
+        float& dis2,
+        float& dis3) {
+    float d0 = 0;
+    float d1 = 0;
+    float d2 = 0;
+    float d3 = 0;
+    for (size_t i = 0; i < d; ++i) {
+        const float q = x[i];
+        d0 += q * y0[i];
+        d1 += q * y1[i];
+        d2 += q * y2[i];
+        d3 += q * y3[i];
+    }
+
+    dis0 = d0;
+    dis1 = d1;
+    dis2 = d2;
+    dis3 = d3;
+}
+
+void fvec_L2sqr_batch_4(
+        const float* x,
+        const float* y0,
+        const float* y1,
+        const float* y2,
+        const float* y3,
+        const size_t d,
+        float& dis0,
+        float& dis1,
+        float& dis2,
+        float& dis3) {
+    float d0 = 0;
+    float d1 = 0;
+    float d2 = 0;
+    float d3 = 0;
+    for (size_t i = 0; i < d; ++i) {
+        const float q = x[i];
+        const float t0 = q - y0[i];
+        const float t1 = q - y1[i];
+        const float t2 = q - y2[i];
+        const float t3 = q - y3[i];
+        d0 += t0 * t0;
+        d1 += t1 * t1;
+        d2 += t2 * t2;
+        d3 += t3 * t3;
+    }
+
+    dis0 = d0;
+    dis1 = d1;
+    dis2 = d2;
+    dis3 = d3;
+}
+
+#endif
+
 /***************************************************************************
  * heavily optimized table computations
  ***************************************************************************/
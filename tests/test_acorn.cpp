@@ -0,0 +1,1650 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <omp.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <faiss/IndexACORN.h>
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/IndexScalarQuantizer.h>
+#include <faiss/impl/DistanceComputer.h>
+#include <faiss/impl/ACORNAttributes.h>
+#include <faiss/impl/ACORNDistanceComputers.h>
+#include <faiss/impl/AuxIndexStructures.h>
+#include <faiss/impl/IDSelector.h>
+#include <faiss/impl/io.h>
+#include <faiss/impl/vecs_io.h>
+#include <faiss/index_io.h>
+
+#ifndef _WIN32
+#include <faiss/IndexFlatOnDisk.h>
+#endif
+
+using namespace faiss;
+
+namespace {
+
+// dimension of the vectors to index
+int d = 16;
+
+// size of the database we plan to index
+size_t nb = 2000;
+
+// nb of queries
+size_t nq = 20;
+
+// nb of distinct attribute values
+size_t n_attr = 5;
+
+int k = 10;
+
+std::vector<float> make_data(size_t n, int seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> u(0, 1);
+    std::vector<float> x(n * d);
+    for (size_t i = 0; i < x.size(); i++) {
+        x[i] = u(rng);
+    }
+    return x;
+}
+
+std::vector<int> make_metadata(size_t n) {
+    std::vector<int> metadata(n);
+    for (size_t i = 0; i < n; i++) {
+        metadata[i] = i % n_attr;
+    }
+    return metadata;
+}
+
+/// attribute value selected by the filter of query q
+int query_attr(size_t q) {
+    return q % n_attr;
+}
+
+/// one byte per (query, vector), set if the vector passes the filter of
+/// the query
+std::vector<char> make_filter_map(const std::vector<int>& metadata) {
+    size_t n = metadata.size();
+    std::vector<char> filter_map(nq * n);
+    for (size_t q = 0; q < nq; q++) {
+        for (size_t i = 0; i < n; i++) {
+            filter_map[q * n + i] = metadata[i] == query_attr(q);
+        }
+    }
+    return filter_map;
+}
+
+/// the k results of each query are vectors that pass its filter
+void check_filtered_results(
+        const std::vector<idx_t>& I,
+        const std::vector<int>& metadata) {
+    for (size_t q = 0; q < nq; q++) {
+        for (int j = 0; j < k; j++) {
+            idx_t id = I[q * k + j];
+            ASSERT_GE(id, 0);
+            ASSERT_LT(id, idx_t(metadata.size()));
+            EXPECT_EQ(query_attr(q), metadata[id]);
+        }
+    }
+}
+
+/// nb of results of the filtered search on index that are in the exact
+/// filtered results
+size_t filtered_recall(
+        IndexACORN& index,
+        const std::vector<float>& xb,
+        const std::vector<float>& xq,
+        const std::vector<int>& metadata) {
+    std::vector<char> filter_map = make_filter_map(metadata);
+    std::vector<idx_t> I(nq * k);
+    std::vector<float> D(nq * k);
+    index.search(nq, xq.data(), k, D.data(), I.data(), filter_map.data());
+
+    IndexFlat index_flat(d);
+    index_flat.add(nb, xb.data());
+    size_t nfound = 0;
+    for (size_t q = 0; q < nq; q++) {
+        std::vector<idx_t> ids;
+        for (size_t i = 0; i < nb; i++) {
+            if (filter_map[q * nb + i]) {
+                ids.push_back(i);
+            }
+        }
+        IDSelectorArray sel(ids.size(), ids.data());
+        SearchParameters params;
+        params.sel = &sel;
+        std::vector<idx_t> I_ref(k);
+        std::vector<float> D_ref(k);
+        index_flat.search(
+                1, xq.data() + q * d, k, D_ref.data(), I_ref.data(), &params);
+        for (int j = 0; j < k; j++) {
+            for (int j2 = 0; j2 < k; j2++) {
+                if (I[q * k + j] == I_ref[j2]) {
+                    nfound++;
+                }
+            }
+        }
+    }
+    return nfound;
+}
+
+} // namespace
+
+TEST(ACORN, filter_representations) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 32;
+
+    // reference: one byte per (query, vector)
+    std::vector<char> filter_map(nq * nb);
+    // same filters as packed bitmaps and as sorted id lists
+    size_t bitmap_size = (nb + 7) / 8;
+    std::vector<uint8_t> bitmaps(nq * bitmap_size);
+    std::vector<std::vector<idx_t>> id_lists(nq);
+    for (size_t q = 0; q < nq; q++) {
+        for (size_t i = 0; i < nb; i++) {
+            if (metadata[i] == query_attr(q)) {
+                filter_map[q * nb + i] = 1;
+                bitmaps[q * bitmap_size + i / 8] |= 1 << (i % 8);
+                id_lists[q].push_back(i);
+            }
+        }
+    }
+
+    std::vector<IDSelectorBitmap> bitmap_sels;
+    std::vector<IDSelectorSortedArray> sorted_sels;
+    bitmap_sels.reserve(nq);
+    sorted_sels.reserve(nq);
+    std::vector<const IDSelector*> bitmap_filters(nq), sorted_filters(nq);
+    for (size_t q = 0; q < nq; q++) {
+        bitmap_sels.emplace_back(bitmap_size, bitmaps.data() + q * bitmap_size);
+        sorted_sels.emplace_back(id_lists[q].size(), id_lists[q].data());
+        bitmap_filters[q] = &bitmap_sels[q];
+        sorted_filters[q] = &sorted_sels[q];
+    }
+
+    std::vector<idx_t> I_ref(nq * k), I_bitmap(nq * k), I_sorted(nq * k);
+    std::vector<float> D_ref(nq * k), D_bitmap(nq * k), D_sorted(nq * k);
+    index.search(nq, xq.data(), k, D_ref.data(), I_ref.data(), filter_map.data());
+    index.search(
+            nq, xq.data(), k, D_bitmap.data(), I_bitmap.data(),
+            bitmap_filters.data());
+    index.search(
+            nq, xq.data(), k, D_sorted.data(), I_sorted.data(),
+            sorted_filters.data());
+
+    EXPECT_EQ(I_ref, I_bitmap);
+    EXPECT_EQ(I_ref, I_sorted);
+    EXPECT_EQ(D_ref, D_bitmap);
+
+    check_filtered_results(I_ref, metadata);
+
+    // the prefetches do not change the traversal
+    index.acorn.use_prefetch = true;
+    index.search(
+            nq, xq.data(), k, D_bitmap.data(), I_bitmap.data(),
+            bitmap_filters.data());
+    EXPECT_EQ(I_ref, I_bitmap);
+    EXPECT_EQ(D_ref, D_bitmap);
+}
+
+TEST(ACORN, attribute_predicates) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 32;
+
+    // scalar column "em", set column "tags" with {i % 7, i % 11}, and a
+    // scalar column "r" used for ranges
+    std::vector<int32_t> em(nb), r(nb), tags;
+    std::vector<size_t> lims(nb + 1, 0);
+    for (size_t i = 0; i < nb; i++) {
+        em[i] = metadata[i];
+        r[i] = i % 100;
+        tags.push_back(i % 11);
+        tags.push_back(i % 7);
+        lims[i + 1] = tags.size();
+    }
+    ACORNAttributes& attributes = index.acorn.attributes;
+    attributes.add_int_column("em", nb, em.data());
+    attributes.add_int_column("r", nb, r.data());
+    attributes.add_int_set_column("tags", nb, lims.data(), tags.data());
+
+    const ACORNAttributeColumn& col_em = attributes.column("em");
+    const ACORNAttributeColumn& col_r = attributes.column("r");
+    const ACORNAttributeColumn& col_tags = attributes.column("tags");
+
+    std::vector<std::unique_ptr<IDSelector>> sels;
+    std::vector<const IDSelector*> filters(nq);
+    for (size_t q = 0; q < nq; q++) {
+        IDSelector* sel = nullptr;
+        switch (q % 3) {
+            case 0:
+                sel = new IDSelectorAttributeEqual(&col_tags, q % 7);
+                break;
+            case 1:
+                sel = new IDSelectorAttributeRange(&col_r, 10, 60);
+                break;
+            default: {
+                IDSelector* a = new IDSelectorAttributeEqual(&col_em, q % 5);
+                IDSelector* b = new IDSelectorAttributeRange(&col_r, 0, 49);
+                sels.emplace_back(a);
+                sels.emplace_back(b);
+                sel = new IDSelectorAnd(a, b);
+            }
+        }
+        sels.emplace_back(sel);
+        filters[q] = sel;
+    }
+
+    // same filters as a byte map
+    std::vector<char> filter_map(nq * nb);
+    for (size_t q = 0; q < nq; q++) {
+        for (size_t i = 0; i < nb; i++) {
+            filter_map[q * nb + i] = filters[q]->is_member(i);
+        }
+    }
+
+    std::vector<idx_t> I_ref(nq * k), I(nq * k);
+    std::vector<float> D_ref(nq * k), D(nq * k);
+    index.search(nq, xq.data(), k, D_ref.data(), I_ref.data(), filter_map.data());
+    index.search(nq, xq.data(), k, D.data(), I.data(), filters.data());
+
+    EXPECT_EQ(I_ref, I);
+    for (size_t q = 0; q < nq; q++) {
+        for (int j = 0; j < k; j++) {
+            idx_t id = I[q * k + j];
+            ASSERT_GE(id, 0);
+            EXPECT_TRUE(filters[q]->is_member(id));
+        }
+    }
+
+    // in-place updates of a set column
+    int32_t new_tags[] = {30, 2, 20};
+    attributes.set_int_set("tags", 5, 3, new_tags);
+    attributes.set_int_set("tags", 6, 0, nullptr);
+    EXPECT_TRUE(col_tags.has_value(5, 20));
+    EXPECT_TRUE(col_tags.has_value(5, 30));
+    EXPECT_FALSE(col_tags.has_value_in_range(6, -1000, 1000));
+    EXPECT_EQ(nb, col_tags.size());
+    EXPECT_EQ(lims.back() - lims[7], col_tags.lims[nb] - col_tags.lims[7]);
+
+    // the predicates stay valid when more columns are added
+    for (int c = 0; c < 20; c++) {
+        attributes.add_int_column(
+                "extra" + std::to_string(c), nb, metadata.data());
+    }
+    EXPECT_EQ(&col_em, &attributes.column("em"));
+    index.search(nq, xq.data(), k, D.data(), I.data(), filters.data());
+    for (size_t q = 0; q < nq; q++) {
+        for (int j = 0; j < k; j++) {
+            EXPECT_TRUE(filters[q]->is_member(I[q * k + j]));
+        }
+    }
+}
+
+TEST(ACORN, io_keeps_attributes) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+
+    VectorIOWriter writer;
+    {
+        // the metadata vector does not outlive the original index
+        std::vector<int> metadata = make_metadata(nb);
+        IndexACORNFlat index(d, 16, 4, metadata, 32);
+        index.add(nb, xb.data());
+        index.acorn.attributes.add_int_column("em", nb, metadata.data());
+        write_index(&index, &writer);
+    }
+
+    VectorIOReader reader;
+    reader.data = writer.data;
+    std::unique_ptr<Index> index2(read_index(&reader));
+    IndexACORNFlat* acorn_index = dynamic_cast<IndexACORNFlat*>(index2.get());
+    ASSERT_TRUE(acorn_index);
+
+    const ACORN& acorn = acorn_index->acorn;
+    std::vector<int> metadata = make_metadata(nb);
+    ASSERT_TRUE(acorn.metadata);
+    for (size_t i = 0; i < nb; i++) {
+        EXPECT_EQ(metadata[i], acorn.metadata[i]);
+    }
+    const ACORNAttributeColumn& col = acorn.attributes.column("em");
+    EXPECT_EQ(ATTR_INT, col.type);
+    EXPECT_EQ(nb, col.size());
+
+    // filtered search straight after loading
+    std::vector<std::unique_ptr<IDSelector>> sels;
+    std::vector<const IDSelector*> filters(nq);
+    for (size_t q = 0; q < nq; q++) {
+        sels.emplace_back(new IDSelectorAttributeEqual(&col, query_attr(q)));
+        filters[q] = sels.back().get();
+    }
+    std::vector<idx_t> I(nq * k);
+    std::vector<float> D(nq * k);
+    acorn_index->search(nq, xq.data(), k, D.data(), I.data(), filters.data());
+    check_filtered_results(I, metadata);
+
+    // a column that does not cover all the vectors is rejected at load
+    acorn_index->acorn.attributes.columns[0]->values.pop_back();
+    VectorIOWriter writer2;
+    write_index(acorn_index, &writer2);
+    VectorIOReader reader2;
+    reader2.data = writer2.data;
+    EXPECT_THROW(read_index(&reader2), FaissException);
+}
+
+TEST(ACORN, distances_batch_4) {
+    // d is not a multiple of the SIMD width
+    int d2 = 13;
+    size_t n = 50;
+    std::mt19937 rng(789);
+    std::uniform_real_distribution<float> u(0, 1);
+    std::vector<float> xb(n * d2), xq(d2);
+    for (size_t i = 0; i < xb.size(); i++) {
+        xb[i] = u(rng);
+    }
+    for (int i = 0; i < d2; i++) {
+        xq[i] = u(rng);
+    }
+
+    for (MetricType metric : {METRIC_L2, METRIC_INNER_PRODUCT}) {
+        IndexFlat storage(d2, metric);
+        storage.add(n, xb.data());
+        std::unique_ptr<DistanceComputer> dc(
+                storage.get_FlatCodesDistanceComputer());
+        dc->set_query(xq.data());
+        for (size_t i = 0; i + 4 <= n; i += 3) {
+            float dis[4];
+            dc->distances_batch_4(
+                    i, i + 1, i + 2, i + 3, dis[0], dis[1], dis[2], dis[3]);
+            for (int j = 0; j < 4; j++) {
+                EXPECT_NEAR((*dc)(i + j), dis[j], 1e-5);
+            }
+        }
+    }
+}
+
+TEST(ACORN, compressed_level0) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 32;
+
+    std::vector<char> filter_map = make_filter_map(metadata);
+
+    std::vector<idx_t> I_ref(nq * k), I(nq * k);
+    std::vector<float> D_ref(nq * k), D(nq * k);
+    index.search(nq, xq.data(), k, D_ref.data(), I_ref.data(), filter_map.data());
+    std::vector<idx_t> I_unfiltered_ref(nq * k);
+    std::vector<float> D_unfiltered_ref(nq * k);
+    index.search(
+            nq, xq.data(), k, D_unfiltered_ref.data(), I_unfiltered_ref.data());
+
+    // statistics and edge lists of the level 0, printed before and after
+    // the compression
+    testing::internal::CaptureStdout();
+    index.printStats(false, true, 1);
+    index.acorn.print_edges(0);
+    std::string stats_ref = testing::internal::GetCapturedStdout();
+
+    size_t size_before = index.acorn.neighbors.size() * sizeof(int32_t);
+    index.acorn.compress_level0();
+    ASSERT_TRUE(index.acorn.is_level0_compressed());
+    const ACORNCompressedLinks& level0 = index.acorn.compressed_level0;
+    size_t size_after = index.acorn.neighbors.size() * sizeof(int32_t) +
+            level0.codes.size() + level0.lims.size() * sizeof(uint32_t) +
+            level0.block_lims.size() * sizeof(size_t);
+    EXPECT_LT(size_after, size_before / 2);
+    // about 4 bytes of offsets per vertex
+    EXPECT_LT(
+            level0.lims.size() * sizeof(uint32_t) +
+                    level0.block_lims.size() * sizeof(size_t),
+            (nb + 1) * 5);
+
+    // same traversal order, so same results
+    index.search(nq, xq.data(), k, D.data(), I.data(), filter_map.data());
+    EXPECT_EQ(I_ref, I);
+    EXPECT_EQ(D_ref, D);
+
+    // unfiltered search goes through level 0 as well
+    index.search(nq, xq.data(), k, D.data(), I.data());
+    EXPECT_EQ(I_unfiltered_ref, I);
+    EXPECT_EQ(D_unfiltered_ref, D);
+
+    testing::internal::CaptureStdout();
+    index.printStats(false, true, 1);
+    index.acorn.print_edges(0);
+    EXPECT_EQ(stats_ref, testing::internal::GetCapturedStdout());
+
+    EXPECT_THROW(index.add(1, xb.data()), FaissException);
+
+    // the compressed form is kept in the index file
+    VectorIOWriter writer;
+    write_index(&index, &writer);
+    VectorIOReader reader;
+    reader.data = writer.data;
+    std::unique_ptr<Index> index2(read_index(&reader));
+    IndexACORNFlat* acorn_index = dynamic_cast<IndexACORNFlat*>(index2.get());
+    ASSERT_TRUE(acorn_index);
+    EXPECT_TRUE(acorn_index->acorn.is_level0_compressed());
+    acorn_index->acorn.efSearch = 32;
+    acorn_index->search(
+            nq, xq.data(), k, D.data(), I.data(), filter_map.data());
+    EXPECT_EQ(I_ref, I);
+}
+
+TEST(ACORN, parallel_build_recall) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    // several threads even on small machines, to exercise the locking
+    int nt = omp_get_max_threads();
+    omp_set_num_threads(4);
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb / 2, xb.data());
+    index.add(nb - nb / 2, xb.data() + nb / 2 * d);
+    omp_set_num_threads(nt);
+    index.acorn.efSearch = 64;
+
+    EXPECT_GT(filtered_recall(index, xb, xq, metadata), nq * k * 8 / 10);
+}
+
+TEST(ACORN, neighbor_set) {
+    ACORNBuildScratch::NeighborSet set;
+    std::mt19937 rng(1234);
+    for (int run = 0; run < 300; run++) {
+        // sometimes more ids than announced, so that the table grows
+        size_t n = rng() % 50;
+        set.clear(n);
+        std::unordered_set<int32_t> ref;
+        for (size_t i = 0; i < 2 * n + 10; i++) {
+            int32_t id = rng() % 200;
+            EXPECT_EQ(ref.count(id) > 0, set.contains(id));
+            EXPECT_EQ(ref.insert(id).second, set.insert(id));
+            EXPECT_EQ(ref.size(), set.size());
+        }
+    }
+}
+
+TEST(ACORN, remove_and_compact) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 64;
+    index.acorn.attributes.add_int_column("attr", nb, metadata.data());
+
+    std::vector<idx_t> removed;
+    for (size_t i = 0; i < nb; i += 3) {
+        removed.push_back(i);
+    }
+    IDSelectorBatch sel(removed.size(), removed.data());
+    EXPECT_EQ(removed.size(), index.remove_ids(sel));
+    EXPECT_EQ(size_t(0), index.remove_ids(sel));
+    EXPECT_EQ(idx_t(nb), index.ntotal);
+
+    const ACORNAttributeColumn* col = &index.acorn.attributes.column("attr");
+    std::vector<IDSelectorAttributeEqual> sels;
+    std::vector<const IDSelector*> filters(nq);
+    sels.reserve(nq);
+    for (size_t q = 0; q < nq; q++) {
+        sels.emplace_back(col, query_attr(q));
+        filters[q] = &sels[q];
+    }
+    std::vector<idx_t> I(nq * k);
+    std::vector<float> D(nq * k);
+    index.search(nq, xq.data(), k, D.data(), I.data(), filters.data());
+    for (size_t i = 0; i < nq * k; i++) {
+        ASSERT_GE(I[i], 0);
+        EXPECT_NE(0, I[i] % 3);
+    }
+
+    // the tombstones are kept in the index file
+    VectorIOWriter writer;
+    write_index(&index, &writer);
+    VectorIOReader reader;
+    reader.data = writer.data;
+    std::unique_ptr<Index> index2(read_index(&reader));
+    IndexACORNFlat* acorn_index = dynamic_cast<IndexACORNFlat*>(index2.get());
+    ASSERT_TRUE(acorn_index);
+    EXPECT_EQ(removed.size(), acorn_index->acorn.ndeleted);
+
+    // after repair, the lists do not point to removed vectors
+    index.repair_deleted();
+    for (size_t i = 0; i < nb; i++) {
+        if (i % 3 == 0) {
+            continue;
+        }
+        size_t begin, end;
+        index.acorn.neighbor_range(i, 0, &begin, &end);
+        for (size_t j = begin; j < end && index.acorn.neighbors[j] >= 0; j++) {
+            EXPECT_NE(0, index.acorn.neighbors[j] % 3);
+        }
+    }
+
+    // an attribute column of the wrong size is detected before anything
+    // is modified
+    index.acorn.attributes.columns[0]->values.pop_back();
+    EXPECT_THROW(index.compact(), FaissException);
+    EXPECT_EQ(idx_t(nb), index.ntotal);
+    EXPECT_EQ(idx_t(nb), index.storage->ntotal);
+    EXPECT_EQ(removed.size(), index.acorn.ndeleted);
+    index.acorn.attributes.columns[0]->values.push_back(metadata[nb - 1]);
+
+    index.compact();
+    size_t n1 = nb - removed.size();
+    EXPECT_EQ(idx_t(n1), index.ntotal);
+    EXPECT_EQ(size_t(0), index.acorn.ndeleted);
+    ASSERT_EQ(n1, index.acorn.attributes.size());
+
+    // the remaining vectors are renumbered in order
+    std::vector<float> xb1;
+    std::vector<int> metadata1;
+    for (size_t i = 0; i < nb; i++) {
+        if (i % 3 != 0) {
+            xb1.insert(xb1.end(), xb.begin() + i * d, xb.begin() + (i + 1) * d);
+            metadata1.push_back(metadata[i]);
+        }
+    }
+    col = &index.acorn.attributes.column("attr");
+    EXPECT_EQ(metadata1, std::vector<int>(col->values.begin(), col->values.end()));
+    std::vector<float> recons(d);
+    index.reconstruct(n1 - 1, recons.data());
+    EXPECT_EQ(recons, std::vector<float>(xb1.end() - d, xb1.end()));
+
+    sels.clear();
+    for (size_t q = 0; q < nq; q++) {
+        sels.emplace_back(col, query_attr(q));
+        filters[q] = &sels[q];
+    }
+    index.search(nq, xq.data(), k, D.data(), I.data(), filters.data());
+
+    IndexFlat index_flat(d);
+    index_flat.add(n1, xb1.data());
+    size_t nfound = 0;
+    for (size_t q = 0; q < nq; q++) {
+        std::vector<idx_t> ids;
+        for (size_t i = 0; i < n1; i++) {
+            if (metadata1[i] == query_attr(q)) {
+                ids.push_back(i);
+            }
+        }
+        IDSelectorArray sel_q(ids.size(), ids.data());
+        SearchParameters params;
+        params.sel = &sel_q;
+        std::vector<idx_t> I_ref(k);
+        std::vector<float> D_ref(k);
+        index_flat.search(
+                1, xq.data() + q * d, k, D_ref.data(), I_ref.data(), &params);
+        for (int j = 0; j < k; j++) {
+            for (int j2 = 0; j2 < k; j2++) {
+                if (I[q * k + j] == I_ref[j2]) {
+                    nfound++;
+                }
+            }
+        }
+    }
+    EXPECT_GT(nfound, nq * k * 8 / 10);
+
+    // add after compaction, and set the attributes of the new vectors
+    size_t n2 = 100;
+    std::vector<float> xb2 = make_data(n2, 789);
+    index.add(n2, xb2.data());
+    ASSERT_EQ(n1 + n2, index.acorn.attributes.size());
+    for (size_t i = n1; i < n1 + n2; i++) {
+        index.acorn.attributes.set_int("attr", i, 99);
+    }
+    IDSelectorAttributeEqual sel_new(&index.acorn.attributes.column("attr"), 99);
+    std::vector<const IDSelector*> filters_new(nq, &sel_new);
+    index.search(nq, xq.data(), k, D.data(), I.data(), filters_new.data());
+    for (size_t i = 0; i < nq * k; i++) {
+        EXPECT_GE(I[i], idx_t(n1));
+    }
+}
+
+TEST(ACORN, quantized_storage) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNSQ index_sq(
+            d, ScalarQuantizer::QT_8bit, 16, 4, metadata, 32);
+    EXPECT_FALSE(index_sq.is_trained);
+    index_sq.train(nb, xb.data());
+    index_sq.add(nb, xb.data());
+    index_sq.acorn.efSearch = 64;
+    EXPECT_GT(filtered_recall(index_sq, xb, xq, metadata), nq * k * 7 / 10);
+
+    // PQ codes, re-ranked with the exact distances
+    IndexACORNPQ index_pq(d, 4, 16, 4, metadata, 32);
+    index_pq.refine_index = new IndexFlat(d);
+    index_pq.own_refine_index = true;
+    index_pq.k_factor = 4;
+    index_pq.train(nb, xb.data());
+    index_pq.add(nb, xb.data());
+    index_pq.acorn.efSearch = 64;
+    size_t nfound_pq = filtered_recall(index_pq, xb, xq, metadata);
+    EXPECT_GT(nfound_pq, nq * k * 7 / 10);
+
+    // both keep their type through I/O
+    VectorIOWriter writer;
+    write_index(&index_sq, &writer);
+    write_index(&index_pq, &writer);
+    VectorIOReader reader;
+    reader.data = writer.data;
+    std::unique_ptr<Index> index_sq2(read_index(&reader));
+    std::unique_ptr<Index> index_pq2(read_index(&reader));
+    ASSERT_TRUE(dynamic_cast<IndexACORNSQ*>(index_sq2.get()));
+    IndexACORNPQ* acorn_pq2 = dynamic_cast<IndexACORNPQ*>(index_pq2.get());
+    ASSERT_TRUE(acorn_pq2);
+    ASSERT_TRUE(acorn_pq2->refine_index);
+    EXPECT_EQ(4, acorn_pq2->k_factor);
+    acorn_pq2->acorn.efSearch = 64;
+    EXPECT_EQ(nfound_pq, filtered_recall(*acorn_pq2, xb, xq, metadata));
+}
+
+TEST(ACORN, query_planner) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 32;
+
+    // a single vector per query: exhaustive scan
+    std::vector<idx_t> single_ids(nq);
+    std::vector<IDSelectorSortedArray> single_sels;
+    single_sels.reserve(nq);
+    std::vector<const IDSelector*> filters(nq);
+    for (size_t q = 0; q < nq; q++) {
+        single_ids[q] = q * 17;
+        single_sels.emplace_back(1, &single_ids[q]);
+        filters[q] = &single_sels[q];
+    }
+    EXPECT_EQ(1.0f / nb, index.estimate_selectivity(single_sels[0]));
+
+    // the planner is off by default
+    std::vector<idx_t> I(nq * k);
+    std::vector<float> D(nq * k);
+    acorn_stats.reset();
+    index.search(nq, xq.data(), k, D.data(), I.data(), filters.data());
+    EXPECT_EQ(size_t(0), acorn_stats.n_brute_force);
+
+    index.query_planner = true;
+    acorn_stats.reset();
+    index.search(nq, xq.data(), k, D.data(), I.data(), filters.data());
+    EXPECT_EQ(nq, acorn_stats.n_brute_force);
+    EXPECT_EQ(size_t(0), acorn_stats.n_post_filter);
+    for (size_t q = 0; q < nq; q++) {
+        EXPECT_EQ(single_ids[q], I[q * k]);
+        EXPECT_EQ(-1, I[q * k + 1]);
+    }
+
+    // all vectors: unfiltered search
+    std::vector<uint8_t> bitmap((nb + 7) / 8, 0xff);
+    IDSelectorBitmap sel_all(bitmap.size(), bitmap.data());
+    EXPECT_EQ(1.0f, index.estimate_selectivity(sel_all));
+    std::vector<const IDSelector*> filters_all(nq, &sel_all);
+    acorn_stats.reset();
+    index.search(nq, xq.data(), k, D.data(), I.data(), filters_all.data());
+    EXPECT_EQ(size_t(0), acorn_stats.n_brute_force);
+    EXPECT_EQ(nq, acorn_stats.n_post_filter);
+    for (size_t i = 0; i < nq * k; i++) {
+        EXPECT_GE(I[i], 0);
+    }
+
+    // attribute predicates are scanned with the inverted index of their
+    // column, arbitrary selectors are not scanned
+    index.acorn.attributes.add_int_column("attr", nb, metadata.data());
+    index.brute_force_selectivity = 0.5;
+    const ACORNAttributeColumn* col = &index.acorn.attributes.column("attr");
+    std::vector<IDSelectorAttributeEqual> attr_sels;
+    std::vector<IDSelectorBatch> batch_sels;
+    attr_sels.reserve(nq);
+    batch_sels.reserve(nq);
+    std::vector<const IDSelector*> attr_filters(nq), batch_filters(nq);
+    for (size_t q = 0; q < nq; q++) {
+        attr_sels.emplace_back(col, query_attr(q));
+        attr_filters[q] = &attr_sels[q];
+        batch_sels.emplace_back(1, &single_ids[q]);
+        batch_filters[q] = &batch_sels[q];
+    }
+    acorn_stats.reset();
+    index.search(nq, xq.data(), k, D.data(), I.data(), attr_filters.data());
+    EXPECT_EQ(nq, acorn_stats.n_brute_force);
+    EXPECT_EQ(nq * nb / n_attr, acorn_stats.ndis);
+    EXPECT_EQ(nq * k, filtered_recall(index, xb, xq, metadata));
+    acorn_stats.reset();
+    index.search(nq, xq.data(), k, D.data(), I.data(), batch_filters.data());
+    EXPECT_EQ(size_t(0), acorn_stats.n_brute_force);
+
+    // when all queries are routed to the exhaustive scan, the results are
+    // exact
+    index.brute_force_selectivity = 2;
+    std::vector<char> filter_map = make_filter_map(metadata);
+    index.search(nq, xq.data(), k, D.data(), I.data(), filter_map.data());
+    EXPECT_EQ(nq * k, filtered_recall(index, xb, xq, metadata));
+
+    // the selector of the params applies on top of the filters, on the
+    // exhaustive scan and on the post-filtered search
+    IDSelectorRange sel_low(0, nb / 2);
+    std::vector<const IDSelector*> low_filters(nq, &sel_low);
+    IDSelectorRange sel_params(nb / 4, nb);
+    SearchParametersACORN params;
+    params.sel = &sel_params;
+    params.efSearch = 32;
+    for (float bf_selectivity : {2.0f, 0.0f}) {
+        index.brute_force_selectivity = bf_selectivity;
+        index.post_filter_selectivity = 0.1;
+        acorn_stats.reset();
+        index.search(
+                nq, xq.data(), k, D.data(), I.data(), low_filters.data(),
+                &params);
+        EXPECT_EQ(bf_selectivity > 1 ? nq : 0, acorn_stats.n_brute_force);
+        EXPECT_EQ(bf_selectivity > 1 ? 0 : nq, acorn_stats.n_post_filter);
+        for (size_t i = 0; i < nq * k; i++) {
+            ASSERT_GE(I[i], idx_t(nb / 4));
+            ASSERT_LT(I[i], idx_t(nb / 2));
+        }
+    }
+}
+
+TEST(ACORN, mmap_load) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+
+    std::string fname = "/tmp/faiss_acorn_XXXXXX";
+    int fd = mkstemp(&fname[0]);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    write_index(&index, fname.c_str());
+
+    std::unique_ptr<IndexACORNFlat> index2(dynamic_cast<IndexACORNFlat*>(
+            read_index(fname.c_str(), IO_FLAG_MMAP_IFC)));
+    unlink(fname.c_str()); // the mapping stays valid
+    ASSERT_TRUE(index2);
+    IndexFlat* storage2 = dynamic_cast<IndexFlatL2*>(index2->storage);
+    ASSERT_TRUE(storage2);
+    EXPECT_FALSE(storage2->codes.is_owner());
+    EXPECT_FALSE(index2->acorn.neighbors.is_owner());
+    EXPECT_FALSE(index2->acorn.offsets.is_owner());
+    EXPECT_TRUE(
+            storage2->codes ==
+            dynamic_cast<IndexFlat*>(index.storage)->codes);
+    EXPECT_TRUE(index2->acorn.neighbors == index.acorn.neighbors);
+
+    std::vector<char> filter_map = make_filter_map(metadata);
+    std::vector<idx_t> I(nq * k), I2(nq * k);
+    std::vector<float> D(nq * k), D2(nq * k);
+    index.search(nq, xq.data(), k, D.data(), I.data(), filter_map.data());
+    index2->search(nq, xq.data(), k, D2.data(), I2.data(), filter_map.data());
+    EXPECT_EQ(I, I2);
+    EXPECT_EQ(D, D2);
+
+    // adding copies the mapped arrays
+    std::vector<float> xb2 = make_data(10, 789);
+    index2->add(10, xb2.data());
+    EXPECT_TRUE(storage2->codes.is_owner());
+    EXPECT_TRUE(index2->acorn.neighbors.is_owner());
+    EXPECT_EQ(idx_t(nb + 10), index2->ntotal);
+}
+
+TEST(ACORN, streaming_build) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    // the same vectors, scaled to [0, 255], in a .fvecs and a .bvecs file
+    std::string fname = "/tmp/faiss_acorn_XXXXXX";
+    int fd = mkstemp(&fname[0]);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    std::string fvecs_name = fname + ".fvecs", bvecs_name = fname + ".bvecs";
+    std::vector<float> xb_int(nb * d);
+    {
+        FILE* ff = fopen(fvecs_name.c_str(), "wb");
+        FILE* fb = fopen(bvecs_name.c_str(), "wb");
+        ASSERT_TRUE(ff && fb);
+        int32_t di = d;
+        for (size_t i = 0; i < nb; i++) {
+            std::vector<uint8_t> b(d);
+            for (int j = 0; j < d; j++) {
+                b[j] = uint8_t(xb[i * d + j] * 255);
+                xb_int[i * d + j] = b[j];
+            }
+            fwrite(&di, sizeof(di), 1, ff);
+            fwrite(&xb_int[i * d], sizeof(float), d, ff);
+            fwrite(&di, sizeof(di), 1, fb);
+            fwrite(b.data(), 1, d, fb);
+        }
+        fclose(ff);
+        fclose(fb);
+    }
+
+    for (const std::string& name : {fvecs_name, bvecs_name}) {
+        VecsReader reader(name.c_str());
+        EXPECT_EQ(size_t(d), reader.d);
+        EXPECT_EQ(nb, reader.n);
+
+        IndexACORNFlat index(d, 16, 4, metadata, 32);
+        index.reserve(nb);
+        const void* codes_ptr =
+                dynamic_cast<IndexFlat*>(index.storage)->codes.data();
+        const void* neighbors_ptr = index.acorn.neighbors.data();
+
+        size_t bs = 300;
+        std::vector<float> batch(bs * d);
+        size_t nr;
+        while ((nr = reader.read(bs, batch.data())) > 0) {
+            EXPECT_EQ(
+                    0,
+                    memcmp(batch.data(),
+                           &xb_int[(reader.i0 - nr) * d],
+                           nr * d * sizeof(float)));
+            index.add(nr, batch.data());
+        }
+        EXPECT_EQ(nb, reader.i0);
+        EXPECT_EQ(idx_t(nb), index.ntotal);
+        // the arrays were not reallocated
+        EXPECT_EQ(
+                codes_ptr,
+                dynamic_cast<IndexFlat*>(index.storage)->codes.data());
+        EXPECT_EQ(neighbors_ptr, index.acorn.neighbors.data());
+
+        index.acorn.efSearch = 64;
+        EXPECT_GT(
+                filtered_recall(index, xb_int, xq, metadata), nq * k * 8 / 10);
+    }
+    unlink(fname.c_str());
+    unlink(fvecs_name.c_str());
+    unlink(bvecs_name.c_str());
+}
+
+TEST(ACORN, intra_query_parallel) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 64;
+    size_t recall_ref = filtered_recall(index, xb, xq, metadata);
+
+    index.intra_query_threads = 4;
+    size_t recall = filtered_recall(index, xb, xq, metadata);
+    // the traversal order differs, not the quality
+    EXPECT_GT(recall, nq * k * 8 / 10);
+    EXPECT_GE(recall + nq, recall_ref);
+
+    // one query at a time, with selectors
+    index.acorn.attributes.add_int_column("attr", nb, metadata.data());
+    const ACORNAttributeColumn* col = &index.acorn.attributes.column("attr");
+    for (size_t q = 0; q < nq; q++) {
+        IDSelectorAttributeEqual sel(col, query_attr(q));
+        const IDSelector* filter = &sel;
+        std::vector<idx_t> I(k);
+        std::vector<float> D(k);
+        index.search(1, xq.data() + q * d, k, D.data(), I.data(), &filter);
+        for (int j = 0; j < k; j++) {
+            ASSERT_GE(I[j], 0);
+            EXPECT_EQ(query_attr(q), metadata[I[j]]);
+            if (j > 0) {
+                EXPECT_LE(D[j - 1], D[j]);
+            }
+        }
+    }
+}
+
+TEST(ACORN, attribute_entry_points) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 64;
+    ACORN& acorn = index.acorn;
+    acorn.attributes.add_int_column("attr", nb, metadata.data());
+    const ACORNAttributeColumn& col = acorn.attributes.column("attr");
+
+    acorn.set_attribute_entry_points(col, 3);
+    EXPECT_EQ(size_t(3), acorn.attribute_entry_points.size());
+    acorn.set_attribute_entry_points(col);
+    ASSERT_EQ(n_attr, acorn.attribute_entry_points.size());
+    std::vector<int> ep_level(n_attr, -1);
+    for (ACORN::storage_idx_t ep : acorn.attribute_entry_points) {
+        ep_level[metadata[ep]] = acorn.levels[ep];
+    }
+    for (size_t i = 0; i < nb; i++) {
+        // one entry point per value, of maximum level
+        EXPECT_LE(acorn.levels[i], ep_level[metadata[i]]);
+    }
+
+    EXPECT_GT(filtered_recall(index, xb, xq, metadata), nq * k * 8 / 10);
+
+    // the entry points are saved and follow the compaction
+    VectorIOWriter writer;
+    write_index(&index, &writer);
+    VectorIOReader reader;
+    reader.data = writer.data;
+    std::unique_ptr<IndexACORN> index2(
+            dynamic_cast<IndexACORN*>(read_index(&reader)));
+    EXPECT_EQ(acorn.attribute_entry_points, index2->acorn.attribute_entry_points);
+
+    ACORN::storage_idx_t ep0 = acorn.attribute_entry_points[0];
+    IDSelectorRange sel(ep0, ep0 + 1);
+    index2->remove_ids(sel);
+    index2->compact();
+    ASSERT_EQ(n_attr - 1, index2->acorn.attribute_entry_points.size());
+    for (size_t j = 1; j < n_attr; j++) {
+        EXPECT_EQ(
+                acorn.attribute_entry_points[j] - 1,
+                index2->acorn.attribute_entry_points[j - 1]);
+    }
+}
+
+TEST(ACORN, sparse_visited_table) {
+    ACORNVisitedHashSet vt;
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 5000; i++) {
+            vt.set(i * 4096 + round);
+        }
+        EXPECT_EQ(5000, vt.num_visited());
+        for (int i = 0; i < 5000; i++) {
+            EXPECT_TRUE(vt.get(i * 4096 + round));
+            EXPECT_FALSE(vt.get(i * 4096 + round + 1));
+        }
+        vt.advance();
+        EXPECT_FALSE(vt.get(round));
+    }
+
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 64;
+    std::vector<char> filter_map = make_filter_map(metadata);
+
+    // the traversal is the same with both visited sets
+    std::vector<idx_t> I(nq * k), I2(nq * k);
+    std::vector<float> D(nq * k), D2(nq * k);
+    index.visited_set_type = 0;
+    index.search(nq, xq.data(), k, D.data(), I.data(), filter_map.data());
+    index.visited_set_type = 1;
+    index.search(nq, xq.data(), k, D2.data(), I2.data(), filter_map.data());
+    EXPECT_EQ(I, I2);
+    EXPECT_EQ(D, D2);
+
+    // the sets of both types are kept for the next calls, up to max_size
+    VisitedTablePool& pool = *index.visited_pool;
+    EXPECT_FALSE(pool.tables.empty());
+    EXPECT_FALSE(pool.hashsets.empty());
+    size_t nsets = pool.hashsets.size();
+    EXPECT_LE(nsets, pool.max_size);
+    index.search(nq, xq.data(), k, D2.data(), I2.data(), filter_map.data());
+    EXPECT_EQ(nsets, pool.hashsets.size());
+    EXPECT_EQ(I, I2);
+    pool.max_size = 0;
+    pool.clear();
+    index.search(nq, xq.data(), k, D2.data(), I2.data(), filter_map.data());
+    EXPECT_TRUE(pool.hashsets.empty());
+    pool.max_size = 1;
+    index.search(nq, xq.data(), k, D2.data(), I2.data(), filter_map.data());
+    EXPECT_EQ(size_t(1), pool.hashsets.size());
+    index.reset();
+    EXPECT_TRUE(pool.tables.empty());
+    EXPECT_TRUE(pool.hashsets.empty());
+}
+
+TEST(ACORN, reorder_graph) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 64;
+    index.acorn.attributes.add_int_column("attr", nb, metadata.data());
+    std::vector<char> filter_map = make_filter_map(metadata);
+    std::vector<idx_t> I(nq * k), I2(nq * k);
+    std::vector<float> D(nq * k), D2(nq * k);
+    index.search(nq, xq.data(), k, D.data(), I.data(), filter_map.data());
+
+    index.reorder_graph();
+    ASSERT_EQ(nb, index.id_map.size());
+    std::vector<float> x(d);
+    index.reconstruct(17, x.data());
+    EXPECT_TRUE(std::equal(x.begin(), x.end(), xb.begin() + 17 * d));
+    std::vector<float> xb2(nb * d);
+    index.reconstruct_n(0, nb, xb2.data());
+    EXPECT_EQ(xb, xb2);
+    for (size_t i = 0; i < nb; i++) {
+        EXPECT_EQ(metadata[index.id_map[i]], index.acorn.metadata[i]);
+    }
+
+    // the graph is the same up to the numbering: same labels, same results
+    index.search(nq, xq.data(), k, D2.data(), I2.data(), filter_map.data());
+    EXPECT_EQ(I, I2);
+    EXPECT_EQ(D, D2);
+
+    // attribute predicates and selectors on labels
+    const ACORNAttributeColumn* col = &index.acorn.attributes.column("attr");
+    std::vector<IDSelectorAttributeEqual> attr_sels;
+    std::vector<IDSelectorRange> range_sels;
+    attr_sels.reserve(nq);
+    range_sels.reserve(nq);
+    std::vector<const IDSelector*> filters(nq), range_filters(nq);
+    for (size_t q = 0; q < nq; q++) {
+        attr_sels.emplace_back(col, query_attr(q));
+        filters[q] = &attr_sels[q];
+        range_sels.emplace_back(0, nb / 2);
+        range_filters[q] = &range_sels[q];
+    }
+    index.search(nq, xq.data(), k, D2.data(), I2.data(), filters.data());
+    for (size_t i = 0; i < nq * k; i++) {
+        ASSERT_GE(I2[i], 0);
+        EXPECT_EQ(query_attr(i / k), metadata[I2[i]]);
+    }
+    index.search(
+            nq, xq.data(), k, D2.data(), I2.data(), range_filters.data());
+    for (size_t i = 0; i < nq * k; i++) {
+        ASSERT_GE(I2[i], 0);
+        EXPECT_LT(I2[i], idx_t(nb / 2));
+    }
+
+    // the labels are saved
+    VectorIOWriter writer;
+    write_index(&index, &writer);
+    VectorIOReader reader;
+    reader.data = writer.data;
+    std::unique_ptr<IndexACORN> index2(
+            dynamic_cast<IndexACORN*>(read_index(&reader)));
+    EXPECT_EQ(index.id_map, index2->id_map);
+
+    // removal by label, the labels above are shifted down
+    IDSelectorRange sel(0, 10);
+    EXPECT_EQ(size_t(10), index2->remove_ids(sel));
+    index2->compact();
+    ASSERT_EQ(idx_t(nb - 10), index2->ntotal);
+    std::vector<idx_t> labels(index2->id_map);
+    std::sort(labels.begin(), labels.end());
+    for (size_t i = 0; i < labels.size(); i++) {
+        EXPECT_EQ(idx_t(i), labels[i]);
+    }
+    index2->reconstruct(7, x.data());
+    EXPECT_TRUE(std::equal(x.begin(), x.end(), xb.begin() + 17 * d));
+
+    // the vectors added afterwards get the next labels
+    index2->add(1, xb.data());
+    index2->reconstruct(nb - 10, x.data());
+    EXPECT_TRUE(std::equal(x.begin(), x.end(), xb.begin()));
+
+    // a compressed level 0 cannot be reordered, the index is unchanged
+    IndexACORNFlat index3(d, 16, 4, metadata, 32);
+    index3.add(nb, xb.data());
+    index3.acorn.compress_level0();
+    EXPECT_THROW(index3.reorder_graph(), FaissException);
+    EXPECT_TRUE(index3.id_map.empty());
+    index3.reconstruct_n(0, nb, xb2.data());
+    EXPECT_EQ(xb, xb2);
+}
+
+TEST(ACORN, specialized_distance_computers) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    // flat L2: same distances as the generic computer, hence same results
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    std::unique_ptr<DistanceComputer> generic(
+            index.storage->get_distance_computer());
+    std::unique_ptr<DistanceComputer> specialized(
+            acorn_specialized_distance_computer(index.storage));
+    ASSERT_TRUE(dynamic_cast<ACORNFlatL2Dis*>(specialized.get()));
+    std::vector<char> filter_map(nb);
+    for (size_t i = 0; i < nb; i++) {
+        filter_map[i] = metadata[i] == 2;
+    }
+    VisitedTable vt(nb);
+    std::vector<idx_t> I(k), I2(k);
+    std::vector<float> D(k), D2(k);
+    for (size_t q = 0; q < nq; q++) {
+        generic->set_query(xq.data() + q * d);
+        specialized->set_query(xq.data() + q * d);
+        index.acorn.hybrid_search(
+                *generic, k, I.data(), D.data(), vt, filter_map.data());
+        index.acorn.hybrid_search(
+                *specialized, k, I2.data(), D2.data(), vt, filter_map.data());
+        EXPECT_EQ(I, I2);
+        EXPECT_EQ(D, D2);
+    }
+
+    // flat IP: negated similarities
+    IndexFlatIP flat_ip(d);
+    flat_ip.add(nb, xb.data());
+    generic.reset(flat_ip.get_distance_computer());
+    specialized.reset(acorn_specialized_distance_computer(&flat_ip));
+    ASSERT_TRUE(dynamic_cast<ACORNFlatNegIPDis*>(specialized.get()));
+    generic->set_query(xq.data());
+    specialized->set_query(xq.data());
+    for (idx_t i = 0; i < 100; i++) {
+        EXPECT_EQ(-(*generic)(i), (*specialized)(i));
+        EXPECT_EQ(
+                -generic->symmetric_dis(i, i + 1),
+                specialized->symmetric_dis(i, i + 1));
+    }
+
+    // the scalar quantizers keep their SIMD distance computers
+    IndexScalarQuantizer sq8(d, ScalarQuantizer::QT_8bit);
+    EXPECT_FALSE(acorn_specialized_distance_computer(&sq8));
+    IndexScalarQuantizer sq4(d, ScalarQuantizer::QT_4bit);
+    EXPECT_FALSE(acorn_specialized_distance_computer(&sq4));
+}
+
+TEST(ACORN, interleaved_queries) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 64;
+    index.acorn.attributes.add_int_column("attr", nb, metadata.data());
+    std::vector<char> filter_map = make_filter_map(metadata);
+    const ACORNAttributeColumn* col = &index.acorn.attributes.column("attr");
+    std::vector<IDSelectorAttributeEqual> attr_sels;
+    attr_sels.reserve(nq);
+    std::vector<const IDSelector*> filters(nq);
+    for (size_t q = 0; q < nq; q++) {
+        attr_sels.emplace_back(col, query_attr(q));
+        filters[q] = &attr_sels[q];
+    }
+
+    std::vector<idx_t> I(nq * k), I2(nq * k);
+    std::vector<float> D(nq * k), D2(nq * k);
+    index.search(nq, xq.data(), k, D.data(), I.data(), filter_map.data());
+    acorn_stats.reset();
+    index.search(nq, xq.data(), k, D2.data(), I2.data(), filters.data());
+    size_t n3 = acorn_stats.n3;
+
+    // same traversals, in any group size
+    for (int interleave : {3, 8}) {
+        index.interleave_queries = interleave;
+        std::vector<idx_t> I3(nq * k);
+        std::vector<float> D3(nq * k);
+        index.search(
+                nq, xq.data(), k, D3.data(), I3.data(), filter_map.data());
+        EXPECT_EQ(I, I3);
+        EXPECT_EQ(D, D3);
+        acorn_stats.reset();
+        index.search(nq, xq.data(), k, D3.data(), I3.data(), filters.data());
+        EXPECT_EQ(I2, I3);
+        EXPECT_EQ(D2, D3);
+        EXPECT_EQ(n3, acorn_stats.n3);
+    }
+
+    // with a reordered graph, the selectors live until the group is run
+    index.interleave_queries = 1;
+    index.reorder_graph();
+    index.search(nq, xq.data(), k, D.data(), I.data(), filter_map.data());
+    index.interleave_queries = 4;
+    index.search(nq, xq.data(), k, D2.data(), I2.data(), filter_map.data());
+    EXPECT_EQ(I, I2);
+    EXPECT_EQ(D, D2);
+}
+
+TEST(ACORN, range_search) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 16;
+    index.acorn.attributes.add_int_column("attr", nb, metadata.data());
+    IndexFlat index_flat(d);
+    index_flat.add(nb, xb.data());
+
+    // a radius that contains ~100 vectors, more than efSearch
+    int k_radius = 100;
+    std::vector<idx_t> I_knn(nq * k_radius);
+    std::vector<float> D_knn(nq * k_radius);
+    index_flat.search(nq, xq.data(), k_radius, D_knn.data(), I_knn.data());
+    std::vector<float> kth(nq);
+    for (size_t q = 0; q < nq; q++) {
+        kth[q] = D_knn[q * k_radius + k_radius - 1];
+    }
+    std::nth_element(kth.begin(), kth.begin() + nq / 2, kth.end());
+    float radius = kth[nq / 2];
+
+    RangeSearchResult ref(nq);
+    index_flat.range_search(nq, xq.data(), radius, &ref);
+
+    const ACORNAttributeColumn* col = &index.acorn.attributes.column("attr");
+    std::vector<IDSelectorAttributeEqual> attr_sels;
+    attr_sels.reserve(nq);
+    std::vector<const IDSelector*> filters(nq);
+    for (size_t q = 0; q < nq; q++) {
+        attr_sels.emplace_back(col, query_attr(q));
+        filters[q] = &attr_sels[q];
+    }
+
+    // nb of results of res in the reference (restricted to the filter),
+    // and nb of results in the reference
+    auto compare = [&](const RangeSearchResult& res, bool filtered) {
+        size_t nfound = 0, nref = 0;
+        for (size_t q = 0; q < nq; q++) {
+            std::unordered_set<idx_t> ref_ids;
+            for (size_t j = ref.lims[q]; j < ref.lims[q + 1]; j++) {
+                if (!filtered || metadata[ref.labels[j]] == query_attr(q)) {
+                    ref_ids.insert(ref.labels[j]);
+                }
+            }
+            nref += ref_ids.size();
+            for (size_t j = res.lims[q]; j < res.lims[q + 1]; j++) {
+                EXPECT_LT(res.distances[j], radius);
+                EXPECT_TRUE(ref_ids.count(res.labels[j]));
+                nfound++;
+            }
+        }
+        return std::make_pair(nfound, nref);
+    };
+
+    RangeSearchResult res(nq);
+    index.range_search(nq, xq.data(), radius, &res);
+    auto counts = compare(res, false);
+    EXPECT_GE(counts.first, counts.second * 0.9);
+    // the nb of results is not bounded by efSearch
+    EXPECT_GT(counts.first, nq * index.acorn.efSearch);
+
+    RangeSearchResult res_filtered(nq);
+    index.range_search(nq, xq.data(), radius, &res_filtered, filters.data());
+    counts = compare(res_filtered, true);
+    EXPECT_GE(counts.first, counts.second * 0.9);
+
+    // exhaustive scan of the filtered vectors: exact results
+    index.query_planner = true;
+    index.brute_force_selectivity = 1.1;
+    RangeSearchResult res_exact(nq);
+    index.range_search(nq, xq.data(), radius, &res_exact, filters.data());
+    counts = compare(res_exact, true);
+    EXPECT_EQ(counts.first, counts.second);
+}
+
+TEST(ACORN, complete_results) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 16;
+
+    // few scattered matching vectors, the filtered graph is disconnected.
+    // The last queries have fewer than k matching vectors
+    std::vector<std::vector<idx_t>> ids(nq);
+    std::vector<std::unique_ptr<IDSelectorBatch>> sels;
+    std::vector<const IDSelector*> filters(nq);
+    std::mt19937 rng(789);
+    for (size_t q = 0; q < nq; q++) {
+        size_t nmatch = q < nq / 2 ? 40 : 6;
+        for (size_t j = 0; j < nmatch; j++) {
+            ids[q].push_back(rng() % nb);
+        }
+        sels.emplace_back(new IDSelectorBatch(ids[q].size(), ids[q].data()));
+        filters[q] = sels.back().get();
+    }
+
+    // exact results
+    IndexFlat index_flat(d);
+    index_flat.add(nb, xb.data());
+    std::vector<idx_t> I_ref(nq * k);
+    std::vector<float> D_ref(nq * k);
+    for (size_t q = 0; q < nq; q++) {
+        SearchParameters params;
+        params.sel = sels[q].get();
+        index_flat.search(
+                1,
+                xq.data() + q * d,
+                k,
+                D_ref.data() + q * k,
+                I_ref.data() + q * k,
+                &params);
+    }
+
+    index.complete_results = true;
+    for (int interleave : {1, 4}) {
+        index.interleave_queries = interleave;
+        std::vector<idx_t> I(nq * k);
+        std::vector<float> D(nq * k);
+        acorn_stats.reset();
+        index.search(nq, xq.data(), k, D.data(), I.data(), filters.data());
+        EXPECT_GT(
+                acorn_stats.n_fallback_beam + acorn_stats.n_fallback_scan,
+                size_t(0));
+        EXPECT_GT(acorn_stats.n3_fallback, size_t(0));
+        for (size_t q = 0; q < nq; q++) {
+            std::set<idx_t> found(I.begin() + q * k, I.begin() + (q + 1) * k);
+            std::set<idx_t> ref(
+                    I_ref.begin() + q * k, I_ref.begin() + (q + 1) * k);
+            EXPECT_EQ(ref.count(-1), found.count(-1));
+            if (ref.count(-1) > 0) {
+                // the under-filled results are exact after the scan
+                EXPECT_EQ(ref, found);
+            }
+        }
+    }
+
+    // the completion honors the selector of the params
+    IDSelectorRange sel_params(nb / 2, nb);
+    SearchParametersACORN params;
+    params.sel = &sel_params;
+    std::vector<idx_t> I(nq * k);
+    std::vector<float> D(nq * k);
+    index.search(
+            nq, xq.data(), k, D.data(), I.data(), filters.data(), &params);
+    for (size_t q = 0; q < nq; q++) {
+        std::set<idx_t> matching;
+        for (idx_t id : ids[q]) {
+            if (sel_params.is_member(id)) {
+                matching.insert(id);
+            }
+        }
+        size_t nres = 0;
+        for (int j = 0; j < k; j++) {
+            idx_t id = I[q * k + j];
+            if (id >= 0) {
+                EXPECT_TRUE(matching.count(id));
+                nres++;
+            }
+        }
+        EXPECT_EQ(std::min(matching.size(), size_t(k)), nres);
+    }
+}
+
+TEST(ACORN, adaptive_termination) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.add(nb, xb.data());
+    index.acorn.attributes.add_int_column("attr", nb, metadata.data());
+    IndexFlat index_flat(d);
+    index_flat.add(nb, xb.data());
+
+    // nb of exact results found and nb of distances computed by a search
+    // with one filter per query
+    auto evaluate = [&](const std::vector<const IDSelector*>& filters,
+                        const SearchParametersACORN& params) {
+        std::vector<idx_t> I(nq * k), I_ref(nq * k);
+        std::vector<float> D(nq * k), D_ref(nq * k);
+        acorn_stats.reset();
+        index.search(
+                nq, xq.data(), k, D.data(), I.data(), filters.data(), &params);
+        size_t n3 = acorn_stats.n3;
+        size_t nfound = 0;
+        for (size_t q = 0; q < nq; q++) {
+            SearchParameters params_ref;
+            params_ref.sel = const_cast<IDSelector*>(filters[q]);
+            index_flat.search(
+                    1,
+                    xq.data() + q * d,
+                    k,
+                    D_ref.data() + q * k,
+                    I_ref.data() + q * k,
+                    &params_ref);
+            for (int j = 0; j < k; j++) {
+                for (int j2 = 0; j2 < k; j2++) {
+                    if (I_ref[q * k + j] >= 0 &&
+                        I[q * k + j2] == I_ref[q * k + j]) {
+                        nfound++;
+                    }
+                }
+            }
+        }
+        return std::make_pair(nfound, n3);
+    };
+
+    // easy queries: the results stabilize well before a large efSearch
+    const ACORNAttributeColumn* col = &index.acorn.attributes.column("attr");
+    std::vector<IDSelectorAttributeEqual> attr_sels;
+    attr_sels.reserve(nq);
+    std::vector<const IDSelector*> filters(nq);
+    for (size_t q = 0; q < nq; q++) {
+        attr_sels.emplace_back(col, query_attr(q));
+        filters[q] = &attr_sels[q];
+    }
+    SearchParametersACORN params;
+    params.efSearch = 200;
+    auto fixed = evaluate(filters, params);
+    params.convergence_patience = 9;
+    auto adaptive = evaluate(filters, params);
+    EXPECT_LT(adaptive.second, fixed.second);
+    EXPECT_GE(adaptive.first, fixed.first * 0.9);
+
+    // sparse filters with a small efSearch: the beam grows
+    std::mt19937 rng(789);
+    std::vector<std::vector<idx_t>> ids(nq);
+    std::vector<std::unique_ptr<IDSelectorBatch>> sels;
+    for (size_t q = 0; q < nq; q++) {
+        for (int j = 0; j < 100; j++) {
+            ids[q].push_back(rng() % nb);
+        }
+        sels.emplace_back(new IDSelectorBatch(ids[q].size(), ids[q].data()));
+        filters[q] = sels.back().get();
+    }
+    params.efSearch = 10;
+    params.convergence_patience = 0;
+    fixed = evaluate(filters, params);
+    params.convergence_patience = 99;
+    adaptive = evaluate(filters, params);
+    EXPECT_GT(adaptive.first, fixed.first);
+}
+
+TEST(ACORN, init_from_hnsw) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    // with the attributes of the vectors added afterwards
+    std::vector<int> metadata = make_metadata(nb + 100);
+
+    IndexHNSWFlat index_hnsw(d, 16);
+    index_hnsw.add(nb, xb.data());
+
+    IndexACORNFlat index(d, 16, 4, metadata, 32);
+    index.init_from_hnsw(index_hnsw);
+    EXPECT_EQ(index.ntotal, idx_t(nb));
+    EXPECT_EQ(index.acorn.entry_point, index_hnsw.hnsw.entry_point);
+    EXPECT_EQ(index.acorn.max_level, index_hnsw.hnsw.max_level);
+    index.acorn.efSearch = 64;
+    size_t nfound = filtered_recall(index, xb, xq, metadata);
+
+    // same recall as an index built by insertion
+    IndexACORNFlat index_ref(d, 16, 4, metadata, 32);
+    index_ref.add(nb, xb.data());
+    index_ref.acorn.efSearch = 64;
+    size_t nfound_ref = filtered_recall(index_ref, xb, xq, metadata);
+    EXPECT_GT(nfound, nq * k * 8 / 10);
+    EXPECT_GE(nfound, nfound_ref * 9 / 10);
+
+    // the index can be extended by the normal insertion
+    std::vector<float> xb2 = make_data(100, 789);
+    index.add(100, xb2.data());
+    EXPECT_EQ(index.ntotal, idx_t(nb + 100));
+}
+
+#ifndef _WIN32
+
+TEST(ACORN, ondisk_rerank) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+    std::vector<int> metadata = make_metadata(nb);
+
+    std::string fname = "/tmp/faiss_acorn_XXXXXX";
+    int fd = mkstemp(&fname[0]);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    std::string vecs_name = fname + ".vecs";
+
+    // exact vectors in RAM for the reference
+    IndexACORNPQ index(d, 4, 16, 4, metadata, 32);
+    index.refine_index = new IndexFlat(d);
+    index.own_refine_index = true;
+    index.k_factor = 4;
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    index.acorn.efSearch = 64;
+    size_t nfound = filtered_recall(index, xb, xq, metadata);
+
+    std::vector<char> filter_map = make_filter_map(metadata);
+    std::vector<idx_t> I(nq * k), I2(nq * k);
+    std::vector<float> D(nq * k), D2(nq * k);
+    index.search(nq, xq.data(), k, D.data(), I.data(), filter_map.data());
+
+    // same graph and codes, exact vectors on disk
+    IndexFlatOnDisk* ondisk = new IndexFlatOnDisk(vecs_name.c_str(), d);
+    ondisk->add(nb / 2, xb.data());
+    ondisk->add(nb - nb / 2, xb.data() + nb / 2 * d);
+    EXPECT_EQ(idx_t(nb), ondisk->ntotal);
+    delete index.refine_index;
+    index.refine_index = ondisk;
+    index.search(nq, xq.data(), k, D2.data(), I2.data(), filter_map.data());
+    EXPECT_EQ(I, I2);
+    for (size_t i = 0; i < nq * k; i++) {
+        EXPECT_NEAR(D[i], D2[i], 1e-4);
+    }
+
+    // batched reads, in any order and with repeated ids
+    std::vector<idx_t> ids = {17, 3, 18, 4, 17, idx_t(nb - 1), 0};
+    std::vector<float> vecs(ids.size() * d);
+    ondisk->read_vectors(ids.size(), ids.data(), vecs.data());
+    for (size_t i = 0; i < ids.size(); i++) {
+        EXPECT_EQ(0,
+                  memcmp(vecs.data() + i * d,
+                         xb.data() + ids[i] * d,
+                         d * sizeof(float)));
+    }
+
+    // the exhaustive search reads the file by blocks
+    IndexFlatL2 flat(d);
+    flat.add(nb, xb.data());
+    ondisk->scan_block_size = 100;
+    flat.search(nq, xq.data(), k, D.data(), I.data());
+    ondisk->search(nq, xq.data(), k, D2.data(), I2.data());
+    EXPECT_EQ(I, I2);
+
+    // only the file name of the vectors is stored in the index
+    write_index(&index, fname.c_str());
+    std::unique_ptr<IndexACORNPQ> index2(dynamic_cast<IndexACORNPQ*>(
+            read_index(fname.c_str(), IO_FLAG_READ_ONLY)));
+    ASSERT_TRUE(index2);
+    IndexFlatOnDisk* ondisk2 =
+            dynamic_cast<IndexFlatOnDisk*>(index2->refine_index);
+    ASSERT_TRUE(ondisk2);
+    EXPECT_EQ(vecs_name, ondisk2->filename);
+    EXPECT_EQ(idx_t(nb), ondisk2->ntotal);
+    index2->acorn.efSearch = 64;
+    EXPECT_EQ(nfound, filtered_recall(*index2, xb, xq, metadata));
+    unlink(fname.c_str());
+    unlink(vecs_name.c_str());
+}
+
+TEST(ACORN, ondisk_compact) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<int> metadata = make_metadata(nb);
+
+    std::string vecs_name = "/tmp/faiss_acorn_XXXXXX";
+    int fd = mkstemp(&vecs_name[0]);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    IndexACORNPQ index(d, 4, 16, 4, metadata, 32);
+    IndexFlatOnDisk* ondisk = new IndexFlatOnDisk(vecs_name.c_str(), d);
+    // the file is rewritten by several blocks
+    ondisk->scan_block_size = 100;
+    index.refine_index = ondisk;
+    index.own_refine_index = true;
+    index.k_factor = 4;
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    index.acorn.attributes.add_int_column("attr", nb, metadata.data());
+
+    std::vector<idx_t> removed;
+    for (size_t i = 0; i < nb; i += 3) {
+        removed.push_back(i);
+    }
+    IDSelectorBatch sel(removed.size(), removed.data());
+    EXPECT_EQ(removed.size(), index.remove_ids(sel));
+    index.compact();
+    size_t n1 = nb - removed.size();
+    EXPECT_EQ(idx_t(n1), index.ntotal);
+    EXPECT_EQ(idx_t(n1), index.storage->ntotal);
+    EXPECT_EQ(idx_t(n1), index.refine_index->ntotal);
+    EXPECT_EQ(n1, index.acorn.attributes.size());
+
+    // the file holds the remaining vectors in order
+    std::vector<float> recons(d);
+    for (size_t i = 0, i1 = 0; i < nb; i++) {
+        if (i % 3 == 0) {
+            continue;
+        }
+        index.reconstruct(i1, recons.data());
+        EXPECT_EQ(
+                recons,
+                std::vector<float>(
+                        xb.begin() + i * d, xb.begin() + (i + 1) * d));
+        i1++;
+    }
+
+    // the remaining vectors are found with their exact distances
+    std::vector<float> D(k);
+    std::vector<idx_t> I(k);
+    index.acorn.efSearch = 64;
+    index.search(1, xb.data() + d, k, D.data(), I.data());
+    EXPECT_EQ(0, I[0]);
+    EXPECT_EQ(0, D[0]);
+    unlink(vecs_name.c_str());
+}
+
+#endif // _WIN32